@@ -106,6 +106,32 @@ public interface WhisperCppJnaLibrary extends Library {
      */
     void whisper_free_state(Pointer state);
 
+    /**
+     * Acquire a pre-allocated state from the pool of the context, allocating a new one if none is idle.
+     *
+     * @param ctx Whisper context
+     * @return Whisper state on success, null if the memory limit of the pool is reached or the allocation fails
+     */
+    Pointer whisper_state_acquire(Pointer ctx);
+
+    /**
+     * Return a state acquired with whisper_state_acquire() to the pool of the context.
+     *
+     * @param ctx   Whisper context
+     * @param state Whisper state
+     */
+    void whisper_state_release(Pointer ctx, Pointer state);
+
+    /**
+     * Set the memory limit of the state pool and pre-allocate its states.
+     *
+     * @param ctx      Whisper context
+     * @param n_states minimum number of states in the pool
+     * @param mem_max  limit of the memory used by all states of the pool in bytes, 0 - no limit
+     * @return the number of states in the pool
+     */
+    int whisper_state_pool_reserve(Pointer ctx, int n_states, long mem_max);
+
 
     /**
      * Convert RAW PCM audio to log mel spectrogram.
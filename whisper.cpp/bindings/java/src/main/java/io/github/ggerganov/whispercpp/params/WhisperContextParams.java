@@ -26,6 +26,25 @@ public class WhisperContextParams extends Structure {
     /** CUDA device to use (default = 0) */
     public int gpu_device;
 
+    /** Map the model file and use the CPU weights in place (default = true) */
+    public CBool use_mmap;
+
+    /** Read the whole mapped model file ahead (default = false) */
+    public CBool mmap_prefetch;
+
+    /** [EXPERIMENTAL] ggml_type of the K and V caches (default = GGML_TYPE_F16), a quantized V cache requires flash attention */
+    public int type_k;
+    public int type_v;
+
+    /** [EXPERIMENTAL] ggml_type to convert the F16/F32 weights to while loading (default = GGML_TYPE_COUNT, keep the model types) */
+    public int type_w;
+
+    /** Number of threads for converting the weights while loading (default = 0, all the cores) */
+    public int n_threads_load;
+
+    /** Save the converted model next to the model file and load it on the next start (default = false) */
+    public CBool cache_type_w;
+
     /** [EXPERIMENTAL] Enable token-level timestamps with DTW (default = false) */
     public CBool dtw_token_timestamps;
 
@@ -37,6 +56,9 @@ public class WhisperContextParams extends Structure {
 
     public WhisperAheads.ByValue dtw_aheads;
 
+    /** [EXPERIMENTAL] Half-width of the DTW search band in audio tokens (default = 0, full cost matrix) */
+    public int dtw_band;
+
     /** DTW memory size (internal use) */
     public NativeLong dtw_mem_size;
 
@@ -50,6 +72,17 @@ public class WhisperContextParams extends Structure {
         flash_attn = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** Map the model file instead of reading it */
+    public void useMmap(boolean enable) {
+        use_mmap = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
+    /** Convert the weights to the given ggml_type while loading, optionally caching the result next to the model file */
+    public void setWeightType(int type, boolean cache) {
+        type_w = type;
+        cache_type_w = cache ? CBool.TRUE : CBool.FALSE;
+    }
+
     /** Enable DTW token-level timestamps */
     public void enableDtwTokenTimestamps(boolean enable) {
         dtw_token_timestamps = enable ? CBool.TRUE : CBool.FALSE;
@@ -66,10 +99,18 @@ public class WhisperContextParams extends Structure {
             "use_gpu",
             "flash_attn",
             "gpu_device",
+            "use_mmap",
+            "mmap_prefetch",
+            "type_k",
+            "type_v",
+            "type_w",
+            "n_threads_load",
+            "cache_type_w",
             "dtw_token_timestamps",
             "dtw_aheads_preset",
             "dtw_n_top",
             "dtw_aheads",
+            "dtw_band",
             "dtw_mem_size"
         );
     }
@@ -143,6 +143,14 @@ public class WhisperFullParams extends Structure {
     /** Overwrite the audio context size (0 = use default). */
     public int audio_ctx;
 
+    /** [EXPERIMENTAL] Pick the smallest encoder length bucket covering the audio in each window (default = false) */
+    public CBool audio_ctx_dynamic;
+
+    /** [EXPERIMENTAL] Pick the smallest encoder length bucket covering the audio in each window */
+    public void audioCtxDynamic(boolean enable) {
+        audio_ctx_dynamic = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
     /** Enable tinydiarize (default = false) */
     public CBool tdrz_enable;
 
@@ -182,6 +190,12 @@ public class WhisperFullParams extends Structure {
         detect_language = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** [EXPERIMENTAL] Audio context size for language detection (0 = same as the first window, reusing its encoder output). */
+    public int detect_audio_ctx;
+
+    /** [EXPERIMENTAL] Reuse the detected language for the next N calls on the same state (0 = detect on every call). */
+    public int detect_n_reuse;
+
     // Common decoding parameters.
 
     /** Flag to suppress blank tokens. */
@@ -222,6 +236,9 @@ public class WhisperFullParams extends Structure {
     /** No speech threshold. */
     public float no_speech_thold;
 
+    /** Skip the decoding of a window when no_speech_prob exceeds no_speech_thold by this margin (&lt; 0 - disabled). */
+    public float no_speech_margin;
+
     /** Greedy decoding parameters. */
     public GreedyParams greedy;
 
@@ -329,6 +346,10 @@ public class WhisperFullParams extends Structure {
     public long i_start_rule;
     public float grammar_penalty;
 
+    /** [EXPERIMENTAL] Speculative decoding: draft model context (not owned) and max number of draft tokens. */
+    public Pointer draft_ctx;
+    public int draft_n_max;
+
     @Override
     protected List<String> getFieldOrder() {
         return Arrays.asList("strategy", "n_threads", "n_max_text_ctx",
@@ -336,18 +357,20 @@ public class WhisperFullParams extends Structure {
                 "no_timestamps", "single_segment", "print_special",
                 "print_progress", "print_realtime", "print_timestamps",
                 "token_timestamps", "thold_pt", "thold_ptsum", "max_len",
-                "split_on_word", "max_tokens", "debug_mode", "audio_ctx", 
-                "tdrz_enable", "suppress_regex", "initial_prompt",
+                "split_on_word", "max_tokens", "debug_mode", "audio_ctx",
+                "audio_ctx_dynamic", "tdrz_enable", "suppress_regex", "initial_prompt",
                 "prompt_tokens", "prompt_n_tokens", "language", "detect_language",
+                "detect_audio_ctx", "detect_n_reuse",
                 "suppress_blank", "suppress_nst", "temperature",
                 "max_initial_ts", "length_penalty", "temperature_inc",
-                "entropy_thold", "logprob_thold", "no_speech_thold", "greedy",
+                "entropy_thold", "logprob_thold", "no_speech_thold", "no_speech_margin", "greedy",
                 "beam_search", "new_segment_callback", "new_segment_callback_user_data",
                 "progress_callback", "progress_callback_user_data",
                 "encoder_begin_callback", "encoder_begin_callback_user_data",
                 "abort_callback", "abort_callback_user_data",
                 "logits_filter_callback", "logits_filter_callback_user_data",
-                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty");
+                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty",
+                "draft_ctx", "draft_n_max");
     }
 
     public static class ByValue extends WhisperFullParams implements Structure.ByValue {
@@ -8,7 +8,7 @@
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - encoder conv stem, 4 - logits, 5 - decoder graph, 6 - tokenizer, 7 - batched encoder
 
     std::string model = "models/ggml-base.en.bin";
 
@@ -53,6 +53,11 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - encoder conv stem\n",                       "");
+    fprintf(stderr, "                           %-7s  4 - logits processing per sampled token\n",     "");
+    fprintf(stderr, "                           %-7s  5 - decoder graph overhead per token\n",        "");
+    fprintf(stderr, "                           %-7s  6 - tokenizer throughput\n",                    "");
+    fprintf(stderr, "                           %-7s  7 - batched encoder\n",                         "");
     fprintf(stderr, "  -ng,      --no-gpu      [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn  [%-7s] enable flash attention\n",                      params.flash_attn ? "true" : "false");
     fprintf(stderr, "\n");
@@ -155,6 +160,62 @@ static int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+static int whisper_bench_decoder_graph(const whisper_params & params) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu    = params.use_gpu;
+    cparams.flash_attn = params.flash_attn;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    whisper_bench_decoder(ctx, params.n_threads);
+    whisper_free(ctx);
+
+    return 0;
+}
+
+static int whisper_bench_encoder_batched(const whisper_params & params) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu    = params.use_gpu;
+    cparams.flash_attn = params.flash_attn;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    whisper_bench_encoder_batch(ctx, params.n_threads);
+    whisper_free(ctx);
+
+    return 0;
+}
+
+static int whisper_bench_tokenizer_vocab(const whisper_params & params) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu = false;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    whisper_bench_tokenizer(ctx, params.n_threads);
+    whisper_free(ctx);
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -168,6 +229,11 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_conv_stem(params.n_threads);    break;
+        case 4: ret = whisper_bench_logits(params.n_threads);       break;
+        case 5: ret = whisper_bench_decoder_graph(params);          break;
+        case 6: ret = whisper_bench_tokenizer_vocab(params);        break;
+        case 7: ret = whisper_bench_encoder_batched(params);        break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "common-whisper.h"
+#include "common-ggml.h"
 
 #include "whisper.h"
 #include "grammar-parser.h"
@@ -46,16 +47,21 @@ struct whisper_params {
     int32_t best_of       = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).greedy.best_of;
     int32_t beam_size     = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH).beam_search.beam_size;
     int32_t audio_ctx     = 0;
+    int32_t detect_ctx    = 0;
+    int32_t dtw_band      = 0;
+    int32_t draft_n_max   = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).draft_n_max;
 
     float word_thold      =  0.01f;
     float entropy_thold   =  2.40f;
     float logprob_thold   = -1.00f;
     float no_speech_thold =  0.6f;
+    float no_speech_margin = -1.0f;
     float grammar_penalty = 100.0f;
     float temperature     = 0.0f;
     float temperature_inc = 0.2f;
 
     bool debug_mode      = false;
+    bool audio_ctx_dyn   = false;
     bool translate       = false;
     bool detect_language = false;
     bool diarize         = false;
@@ -77,6 +83,9 @@ struct whisper_params {
     bool no_timestamps   = false;
     bool log_score       = false;
     bool use_gpu         = true;
+    bool use_mmap        = true;
+    bool mmap_prefetch   = false;
+    bool weight_cache    = false;
     bool flash_attn      = false;
     bool suppress_nst    = false;
 
@@ -84,6 +93,10 @@ struct whisper_params {
     std::string prompt;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model     = "models/ggml-base.en.bin";
+    std::string cache_type_k = "f16";
+    std::string cache_type_v = "f16";
+    std::string weight_type;
+    std::string model_draft;
     std::string grammar;
     std::string grammar_rule;
 
@@ -147,10 +160,12 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-bo"   || arg == "--best-of")         { params.best_of         = std::stoi(ARGV_NEXT); }
         else if (arg == "-bs"   || arg == "--beam-size")       { params.beam_size       = std::stoi(ARGV_NEXT); }
         else if (arg == "-ac"   || arg == "--audio-ctx")       { params.audio_ctx       = std::stoi(ARGV_NEXT); }
+        else if (arg == "-acd"  || arg == "--audio-ctx-dyn")   { params.audio_ctx_dyn   = true; }
         else if (arg == "-wt"   || arg == "--word-thold")      { params.word_thold      = std::stof(ARGV_NEXT); }
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(ARGV_NEXT); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(ARGV_NEXT); }
         else if (arg == "-nth"  || arg == "--no-speech-thold") { params.no_speech_thold = std::stof(ARGV_NEXT); }
+        else if (arg == "-nss"  || arg == "--no-speech-skip")  { params.no_speech_margin = std::stof(ARGV_NEXT); }
         else if (arg == "-tp"   || arg == "--temperature")     { params.temperature     = std::stof(ARGV_NEXT); }
         else if (arg == "-tpi"  || arg == "--temperature-inc") { params.temperature_inc = std::stof(ARGV_NEXT); }
         else if (arg == "-debug"|| arg == "--debug-mode")      { params.debug_mode      = true; }
@@ -176,14 +191,24 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-nt"   || arg == "--no-timestamps")   { params.no_timestamps   = true; }
         else if (arg == "-l"    || arg == "--language")        { params.language        = whisper_param_turn_lowercase(ARGV_NEXT); }
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
+        else if (arg == "-dac"  || arg == "--detect-ctx")      { params.detect_ctx      = std::stoi(ARGV_NEXT); }
         else if (                  arg == "--prompt")          { params.prompt          = ARGV_NEXT; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = ARGV_NEXT; }
+        else if (arg == "-md"   || arg == "--model-draft")     { params.model_draft     = ARGV_NEXT; }
+        else if (arg == "-nd"   || arg == "--draft-max")       { params.draft_n_max     = std::stoi(ARGV_NEXT); }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(ARGV_NEXT); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = ARGV_NEXT; }
         else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = ARGV_NEXT; }
+        else if (arg == "-dtwb" || arg == "--dtw-band")        { params.dtw_band        = std::stoi(ARGV_NEXT); }
         else if (arg == "-ls"   || arg == "--log-score")       { params.log_score       = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
+        else if (arg == "-nmm"  || arg == "--no-mmap")         { params.use_mmap        = false; }
+        else if (arg == "-mmp"  || arg == "--mmap-prefetch")   { params.mmap_prefetch   = true; }
         else if (arg == "-fa"   || arg == "--flash-attn")      { params.flash_attn      = true; }
+        else if (arg == "-tw"   || arg == "--type-w")          { params.weight_type     = ARGV_NEXT; }
+        else if (arg == "-twc"  || arg == "--type-w-cache")    { params.weight_cache    = true; }
+        else if (arg == "-ctk"  || arg == "--cache-type-k")    { params.cache_type_k    = ARGV_NEXT; }
+        else if (arg == "-ctv"  || arg == "--cache-type-v")    { params.cache_type_v    = ARGV_NEXT; }
         else if (arg == "-sns"  || arg == "--suppress-nst")    { params.suppress_nst    = true; }
         else if (                  arg == "--suppress-regex")  { params.suppress_regex  = ARGV_NEXT; }
         else if (                  arg == "--grammar")         { params.grammar         = ARGV_NEXT; }
@@ -217,10 +242,12 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
     fprintf(stderr, "  -ac N,     --audio-ctx N       [%-7d] audio context size (0 - all)\n",                   params.audio_ctx);
+    fprintf(stderr, "  -acd,      --audio-ctx-dyn     [%-7s] pick the audio context size from the audio length\n", params.audio_ctx_dyn ? "true" : "false");
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
     fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech threshold\n",                          params.no_speech_thold);
+    fprintf(stderr, "  -nss N,    --no-speech-skip N  [%-7.2f] skip decoding if no speech prob > thold + N (< 0 - off)\n", params.no_speech_margin);
     fprintf(stderr, "  -tp,       --temperature N     [%-7.2f] The sampling temperature, between 0 and 1\n",    params.temperature);
     fprintf(stderr, "  -tpi,      --temperature-inc N [%-7.2f] The increment of temperature, between 0 and 1\n",params.temperature_inc);
     fprintf(stderr, "  -debug,    --debug-mode        [%-7s] enable debug mode (eg. dump log_mel)\n",           params.debug_mode ? "true" : "false");
@@ -245,14 +272,24 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -nt,       --no-timestamps     [%-7s] do not print timestamps\n",                        params.no_timestamps ? "true" : "false");
     fprintf(stderr, "  -l LANG,   --language LANG     [%-7s] spoken language ('auto' for auto-detect)\n",       params.language.c_str());
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
+    fprintf(stderr, "  -dac N,    --detect-ctx N      [%-7d] audio context size for language detection (0 - reuse)\n", params.detect_ctx);
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt (max n_text_ctx/2 tokens)\n",       params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model path for speculative decoding\n",       params.model_draft.c_str());
+    fprintf(stderr, "  -nd N,     --draft-max N       [%-7d] max number of draft tokens per verification\n",   params.draft_n_max);
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input audio file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -dtw MODEL --dtw MODEL         [%-7s] compute token-level timestamps\n",                 params.dtw.c_str());
+    fprintf(stderr, "  -dtwb N,   --dtw-band N        [%-7d] DTW search band around the diagonal (0 - full)\n", params.dtw_band);
     fprintf(stderr, "  -ls,       --log-score         [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
     fprintf(stderr, "  -ng,       --no-gpu            [%-7s] disable GPU\n",                                    params.use_gpu ? "false" : "true");
+    fprintf(stderr, "  -nmm,      --no-mmap           [%-7s] read the model instead of mapping it\n",             params.use_mmap ? "false" : "true");
+    fprintf(stderr, "  -mmp,      --mmap-prefetch     [%-7s] read the whole mapped model ahead\n",                 params.mmap_prefetch ? "true" : "false");
     fprintf(stderr, "  -fa,       --flash-attn        [%-7s] flash attention\n",                                params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -tw TYPE,  --type-w TYPE       [%-7s] convert the f16/f32 weights on load (f16, q8_0, q5_1, q5_0, q4_1, q4_0, ...)\n", params.weight_type.c_str());
+    fprintf(stderr, "  -twc,      --type-w-cache      [%-7s] save the converted model next to the model file and reuse it\n", params.weight_cache ? "true" : "false");
+    fprintf(stderr, "  -ctk TYPE, --cache-type-k TYPE [%-7s] KV cache type for K (f16, q8_0, q5_1, q5_0, q4_1, q4_0)\n", params.cache_type_k.c_str());
+    fprintf(stderr, "  -ctv TYPE, --cache-type-v TYPE [%-7s] KV cache type for V, quantized types require -fa\n", params.cache_type_v.c_str());
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n",                     params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  --suppress-regex REGEX         [%-7s] regular expression matching tokens to suppress\n", params.suppress_regex.c_str());
     fprintf(stderr, "  --grammar GRAMMAR              [%-7s] GBNF grammar to guide decoding\n",                 params.grammar.c_str());
@@ -1008,10 +1045,30 @@ int main(int argc, char ** argv) {
 
     cparams.use_gpu    = params.use_gpu;
     cparams.flash_attn = params.flash_attn;
+    cparams.use_mmap   = params.use_mmap;
+    cparams.mmap_prefetch = params.mmap_prefetch;
+    cparams.n_threads_load = params.n_threads;
+    cparams.cache_type_w  = params.weight_cache;
+    cparams.type_k     = ggml_parse_type(params.cache_type_k.c_str());
+    cparams.type_v     = ggml_parse_type(params.cache_type_v.c_str());
+
+    if (cparams.type_k == GGML_TYPE_COUNT || cparams.type_v == GGML_TYPE_COUNT) {
+        fprintf(stderr, "error: unknown KV cache type\n");
+        return 3;
+    }
+
+    if (!params.weight_type.empty()) {
+        cparams.type_w = ggml_parse_type(params.weight_type.c_str());
+        if (cparams.type_w == GGML_TYPE_COUNT) {
+            fprintf(stderr, "error: unknown weight type\n");
+            return 3;
+        }
+    }
 
     if (!params.dtw.empty()) {
         cparams.dtw_token_timestamps = true;
         cparams.dtw_aheads_preset = WHISPER_AHEADS_NONE;
+        cparams.dtw_band = params.dtw_band;
 
         if (params.dtw == "tiny")      cparams.dtw_aheads_preset = WHISPER_AHEADS_TINY;
         if (params.dtw == "tiny.en")   cparams.dtw_aheads_preset = WHISPER_AHEADS_TINY_EN;
@@ -1042,6 +1099,22 @@ int main(int argc, char ** argv) {
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    // the draft model for speculative decoding, its state is created by whisper_full() for each state of the main model
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.model_draft.empty()) {
+        struct whisper_context_params cparams_draft = cparams;
+        cparams_draft.dtw_token_timestamps = false;
+
+        ctx_draft = whisper_init_from_file_with_params_no_state(params.model_draft.c_str(), cparams_draft);
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context for the draft model\n");
+            whisper_free(ctx);
+            return 3;
+        }
+    }
+
     if (!params.grammar.empty()) {
         auto & grammar = params.grammar_parsed;
         if (is_file_exist(params.grammar.c_str())) {
@@ -1121,6 +1194,7 @@ int main(int argc, char ** argv) {
             wparams.translate        = params.translate;
             wparams.language         = params.language.c_str();
             wparams.detect_language  = params.detect_language;
+            wparams.detect_audio_ctx = params.detect_ctx;
             wparams.n_threads        = params.n_threads;
             wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
             wparams.offset_ms        = params.offset_t_ms;
@@ -1131,6 +1205,7 @@ int main(int argc, char ** argv) {
             wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
             wparams.split_on_word    = params.split_on_word;
             wparams.audio_ctx        = params.audio_ctx;
+            wparams.audio_ctx_dynamic = params.audio_ctx_dyn;
 
             wparams.debug_mode       = params.debug_mode;
 
@@ -1149,11 +1224,15 @@ int main(int argc, char ** argv) {
             wparams.entropy_thold    = params.entropy_thold;
             wparams.logprob_thold    = params.logprob_thold;
             wparams.no_speech_thold  = params.no_speech_thold;
+            wparams.no_speech_margin = params.no_speech_margin;
 
             wparams.no_timestamps    = params.no_timestamps;
 
             wparams.suppress_nst     = params.suppress_nst;
 
+            wparams.draft_ctx        = ctx_draft;
+            wparams.draft_n_max      = params.draft_n_max;
+
             whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
 
             const auto & grammar_parsed = params.grammar_parsed;
@@ -1269,6 +1348,7 @@ int main(int argc, char ** argv) {
     if (!params.no_prints) {
         whisper_print_timings(ctx);
     }
+    whisper_free(ctx_draft);
     whisper_free(ctx);
 
     return 0;
@@ -1,5 +1,6 @@
 #include "common-ggml.h"
 
+#include <cstring>
 #include <regex>
 #include <map>
 
@@ -38,6 +39,19 @@ enum ggml_ftype ggml_parse_ftype(const char * str) {
     return ftype;
 }
 
+enum ggml_type ggml_parse_type(const char * str) {
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const char * name = ggml_type_name((enum ggml_type) i);
+        if (name != nullptr && strcmp(name, str) == 0) {
+            return (enum ggml_type) i;
+        }
+    }
+
+    fprintf(stderr, "%s: unknown type '%s'\n", __func__, str);
+
+    return GGML_TYPE_COUNT;
+}
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
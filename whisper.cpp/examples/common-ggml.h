@@ -10,6 +10,10 @@ enum ggml_ftype ggml_parse_ftype(const char * str);
 
 void ggml_print_ftypes(FILE * fp = stderr);
 
+// parse a tensor type name, such as "f16" or "q8_0"
+// returns GGML_TYPE_COUNT if the name is unknown
+enum ggml_type ggml_parse_type(const char * str);
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
@@ -1,4 +1,7 @@
 #include "ggml.h"
+#include "gguf.h"
+
+#include "whisper-impl.h"
 
 #include "common.h"
 #include "common-ggml.h"
@@ -13,29 +16,235 @@
 #include <vector>
 #include <regex>
 
-// default hparams (Whisper tiny)
-struct whisper_hparams {
-    int32_t n_vocab       = 51864;
-    int32_t n_audio_ctx   = 1500;
-    int32_t n_audio_state = 384;
-    int32_t n_audio_head  = 6;
-    int32_t n_audio_layer = 4;
-    int32_t n_text_ctx    = 448;
-    int32_t n_text_state  = 384;
-    int32_t n_text_head   = 6;
-    int32_t n_text_layer  = 4;
-    int32_t n_mels        = 80;
-    int32_t ftype         = 1;
+// regexes of tensor names to not be quantized
+static const std::vector<std::string> k_to_skip = {
+    //"encoder.*",
+    "encoder.conv1.bias",
+    "encoder.conv2.bias",
+    "encoder.positional_embedding",
+    "decoder.positional_embedding",
 };
 
-struct whisper_filters {
-    int32_t n_mel;
-    int32_t n_fft;
+// write the model as GGUF: the hparams, the mel filters and the vocab as metadata, followed by the index of the tensors
+// and their data, aligned so that it can be mapped in place. the tensors are quantized like in ggml_common_quantize_0
+// f32 and f16 (0 and 1) keep the types of the input model
+//
+// the tensors of finp are read twice: first their headers, to build the index, then their data
+static bool whisper_model_write_gguf(
+        std::ifstream & finp,
+        const std::string & fname_out,
+        const whisper_hparams & hparams,
+        const whisper_filters & filters,
+        const std::vector<std::string> & tokens,
+        ggml_ftype ftype) {
+    const int32_t ftype_src = hparams.ftype % GGML_QNT_VERSION_FACTOR;
+
+    ggml_type qtype = GGML_TYPE_COUNT;
+
+    if (ftype == GGML_FTYPE_ALL_F32 || ftype == GGML_FTYPE_MOSTLY_F16) {
+        if (ftype != ftype_src) {
+            fprintf(stderr, "%s: cannot convert ftype %d to %d - only quantization is supported\n", __func__, ftype_src, ftype);
+            return false;
+        }
+    } else {
+        qtype = ggml_ftype_to_ggml_type(ftype);
+        if (qtype == GGML_TYPE_COUNT || !ggml_is_quantized(qtype)) {
+            fprintf(stderr, "%s: invalid model type %d\n", __func__, ftype);
+            return false;
+        }
+    }
 
-    std::vector<float> data;
-};
+    struct tensor_info {
+        std::string name;
+
+        int32_t n_dims;
+        int64_t ne[4];
+
+        ggml_type type_src;
+        ggml_type type_dst;
+
+        std::streamoff offs; // of the data in finp
+    };
+
+    std::vector<tensor_info> tensors;
+
+    // read the tensor headers
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        finp.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        finp.read(reinterpret_cast<char *>(&length), sizeof(length));
+        finp.read(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
+
+        if (finp.eof()) {
+            break;
+        }
+
+        if (n_dims < 1 || n_dims > 4 || (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16)) {
+            fprintf(stderr, "%s: invalid tensor header (n_dims = %d, ttype = %d)\n", __func__, n_dims, ttype);
+            return false;
+        }
+
+        tensor_info info;
+
+        info.n_dims   = n_dims;
+        info.type_src = (ggml_type) ttype;
+        info.type_dst = (ggml_type) ttype;
+
+        int64_t nelements = 1;
+        for (int i = 0; i < 4; ++i) {
+            int32_t ne = 1;
+            if (i < n_dims) {
+                finp.read(reinterpret_cast<char *>(&ne), sizeof(ne));
+            }
+            info.ne[i] = ne;
+            nelements *= ne;
+        }
+
+        info.name.resize(length);
+        finp.read(&info.name[0], length);
+
+        info.offs = finp.tellg();
+
+        bool quantize = qtype != GGML_TYPE_COUNT && n_dims == 2 && info.ne[0] % ggml_blck_size(qtype) == 0;
+
+        for (const auto & s : k_to_skip) {
+            if (std::regex_match(info.name, std::regex(s))) {
+                quantize = false;
+                break;
+            }
+        }
+
+        if (quantize) {
+            info.type_dst = qtype;
+        }
+
+        finp.seekg(nelements*ggml_type_size(info.type_src), std::ios::cur);
+
+        tensors.push_back(std::move(info));
+    }
+
+    if (tensors.empty()) {
+        fprintf(stderr, "%s: no tensors in the model file\n", __func__);
+        return false;
+    }
+
+    gguf_context * gguf = gguf_init_empty();
+
+    {
+        whisper_hparams hparams_dst = hparams;
+        hparams_dst.ftype = qtype == GGML_TYPE_COUNT ? ftype_src : ftype;
+
+        whisper_gguf_set_model_meta(gguf, hparams_dst, filters, tokens);
+    }
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ tensors.size()*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    for (const auto & info : tensors) {
+        ggml_tensor * t = ggml_new_tensor(ctx, info.type_dst, info.n_dims, info.ne);
+        ggml_set_name(t, info.name.c_str());
+
+        gguf_add_tensor(gguf, t);
+    }
+
+    ggml_free(ctx);
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        gguf_free(gguf);
+        return false;
+    }
+
+    // the metadata and the index, padded to the alignment of the data
+    {
+        std::vector<char> meta(gguf_get_meta_size(gguf));
+        gguf_get_meta_data(gguf, meta.data());
+
+        fout.write(meta.data(), meta.size());
+    }
+
+    const size_t alignment = gguf_get_alignment(gguf);
+
+    gguf_free(gguf);
+
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+
+    std::vector<char>  data_src;
+    std::vector<float> data_f32;
+    std::vector<char>  data_dst;
+
+    for (const auto & info : tensors) {
+        const int64_t nelements = info.ne[0]*info.ne[1]*info.ne[2]*info.ne[3];
+
+        printf("%64s - [%5d, %5d, %5d], type = %6s ", info.name.c_str(), (int) info.ne[0], (int) info.ne[1], (int) info.ne[2], ggml_type_name(info.type_src));
+
+        data_src.resize(nelements*ggml_type_size(info.type_src));
+
+        finp.clear();
+        finp.seekg(info.offs);
+        finp.read(data_src.data(), data_src.size());
+
+        if (!finp) {
+            fprintf(stderr, "%s: failed to read the data of tensor '%s'\n", __func__, info.name.c_str());
+            return false;
+        }
+
+        const char * data = data_src.data();
+        size_t       size = data_src.size();
+
+        if (info.type_dst != info.type_src) {
+            data_f32.resize(nelements);
+            if (info.type_src == GGML_TYPE_F16) {
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *) data_src.data(), data_f32.data(), nelements);
+            } else {
+                memcpy(data_f32.data(), data_src.data(), data_src.size());
+            }
+
+            data_dst.resize(ggml_row_size(info.type_dst, info.ne[0])*(nelements/info.ne[0]));
+
+            size = ggml_quantize_chunk(info.type_dst, data_f32.data(), data_dst.data(), 0, nelements/info.ne[0], info.ne[0], nullptr);
+            data = data_dst.data();
+
+            printf("size = %8.2f MB -> %8.2f MB\n", data_src.size()/1024.0/1024.0, size/1024.0/1024.0);
+        } else {
+            printf("size = %8.3f MB\n", size/1024.0/1024.0);
+        }
+
+        fout.write(data, size);
+
+        const size_t pad = GGML_PAD(size, alignment) - size;
+        if (pad > 0) {
+            const std::vector<char> zeros(pad, 0);
+            fout.write(zeros.data(), pad);
+        }
+
+        total_size_org += data_src.size();
+        total_size_new += size;
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    printf("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+
+    return true;
+}
 
 // quantize a model
+// the output is written as GGUF if its name ends with ".gguf"
 static bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype) {
     gpt_vocab vocab;
 
@@ -47,12 +256,6 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
         return false;
     }
 
-    auto fout = std::ofstream(fname_out, std::ios::binary);
-    if (!fout) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
-        return false;
-    }
-
     // verify magic
     {
         uint32_t magic;
@@ -61,12 +264,12 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
             fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp.c_str());
             return false;
         }
-
-        fout.write((char *) &magic, sizeof(magic));
     }
 
     whisper_hparams hparams;
 
+    const int32_t ftype_dst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype;
+
     // load hparams
     {
         finp.read((char *) &hparams.n_vocab,       sizeof(hparams.n_vocab));
@@ -82,7 +285,6 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
         finp.read((char *) &hparams.ftype,         sizeof(hparams.ftype));
 
         const int32_t qntvr_src =    hparams.ftype / GGML_QNT_VERSION_FACTOR;
-        const int32_t ftype_dst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype;
 
         fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
         fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
@@ -98,39 +300,25 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
         fprintf(stderr, "%s: qntvr (src)   = %d\n", __func__, qntvr_src);
         fprintf(stderr, "%s: ftype (dst)   = %d\n", __func__, ftype_dst);
         fprintf(stderr, "%s: qntvr (dst)   = %d\n", __func__, GGML_QNT_VERSION);
-
-        fout.write((const char *) &hparams.n_vocab,       sizeof(hparams.n_vocab));
-        fout.write((const char *) &hparams.n_audio_ctx,   sizeof(hparams.n_audio_ctx));
-        fout.write((const char *) &hparams.n_audio_state, sizeof(hparams.n_audio_state));
-        fout.write((const char *) &hparams.n_audio_head,  sizeof(hparams.n_audio_head));
-        fout.write((const char *) &hparams.n_audio_layer, sizeof(hparams.n_audio_layer));
-        fout.write((const char *) &hparams.n_text_ctx,    sizeof(hparams.n_text_ctx));
-        fout.write((const char *) &hparams.n_text_state,  sizeof(hparams.n_text_state));
-        fout.write((const char *) &hparams.n_text_head,   sizeof(hparams.n_text_head));
-        fout.write((const char *) &hparams.n_text_layer,  sizeof(hparams.n_text_layer));
-        fout.write((const char *) &hparams.n_mels,        sizeof(hparams.n_mels));
-        fout.write((const char *) &ftype_dst,             sizeof(hparams.ftype));
     }
 
     // load mel filters
-    {
-        whisper_filters filters;
+    whisper_filters filters;
 
-        finp.read ((char *) &filters.n_mel, sizeof(filters.n_mel));
-        fout.write((char *) &filters.n_mel, sizeof(filters.n_mel));
-        finp.read ((char *) &filters.n_fft, sizeof(filters.n_fft));
-        fout.write((char *) &filters.n_fft, sizeof(filters.n_fft));
+    {
+        finp.read((char *) &filters.n_mel, sizeof(filters.n_mel));
+        finp.read((char *) &filters.n_fft, sizeof(filters.n_fft));
 
         filters.data.resize(filters.n_mel * filters.n_fft);
-        finp.read ((char *) filters.data.data(), filters.data.size() * sizeof(float));
-        fout.write((char *) filters.data.data(), filters.data.size() * sizeof(float));
+        finp.read((char *) filters.data.data(), filters.data.size() * sizeof(float));
     }
 
     // load vocab
+    std::vector<std::string> tokens;
+
     {
         int32_t n_vocab = 0;
-        finp.read ((char *) &n_vocab, sizeof(n_vocab));
-        fout.write((char *) &n_vocab, sizeof(n_vocab));
+        finp.read((char *) &n_vocab, sizeof(n_vocab));
 
         //if (n_vocab != hparams.n_vocab) {
         //    fprintf(stderr, "%s: invalid model file '%s' (bad vocab size %d != %d)\n",
@@ -138,33 +326,72 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
         //    return false;
         //}
 
-        char word[129];
+        tokens.resize(n_vocab);
 
         for (int i = 0; i < n_vocab; i++) {
             uint32_t len;
-            finp.read ((char *) &len, sizeof(len));
-            fout.write((char *) &len, sizeof(len));
+            finp.read((char *) &len, sizeof(len));
 
-            word[len] = '\0';
+            tokens[i].resize(len);
+            finp.read(&tokens[i][0], len);
 
-            finp.read ((char *) word, len);
-            fout.write((char *) word, len);
+            vocab.token_to_id[tokens[i]] = i;
+            vocab.id_to_token[i] = tokens[i];
+        }
+    }
+
+    if (!finp) {
+        fprintf(stderr, "%s: invalid model file '%s' (truncated)\n", __func__, fname_inp.c_str());
+        return false;
+    }
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+    if (fname_out.size() > 5 && fname_out.compare(fname_out.size() - 5, 5, ".gguf") == 0) {
+        if (!whisper_model_write_gguf(finp, fname_out, hparams, filters, tokens, ftype)) {
+            fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
+            return false;
         }
+
+        return true;
     }
 
-    // regexes of tensor names to not be quantized
-    const std::vector<std::string> to_skip = {
-        //"encoder.*",
-        "encoder.conv1.bias",
-        "encoder.conv2.bias",
-        "encoder.positional_embedding",
-        "decoder.positional_embedding",
-    };
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    // write the header of the ggml file
+    {
+        const uint32_t magic = GGML_FILE_MAGIC;
+
+        fout.write((const char *) &magic,                 sizeof(magic));
+        fout.write((const char *) &hparams.n_vocab,       sizeof(hparams.n_vocab));
+        fout.write((const char *) &hparams.n_audio_ctx,   sizeof(hparams.n_audio_ctx));
+        fout.write((const char *) &hparams.n_audio_state, sizeof(hparams.n_audio_state));
+        fout.write((const char *) &hparams.n_audio_head,  sizeof(hparams.n_audio_head));
+        fout.write((const char *) &hparams.n_audio_layer, sizeof(hparams.n_audio_layer));
+        fout.write((const char *) &hparams.n_text_ctx,    sizeof(hparams.n_text_ctx));
+        fout.write((const char *) &hparams.n_text_state,  sizeof(hparams.n_text_state));
+        fout.write((const char *) &hparams.n_text_head,   sizeof(hparams.n_text_head));
+        fout.write((const char *) &hparams.n_text_layer,  sizeof(hparams.n_text_layer));
+        fout.write((const char *) &hparams.n_mels,        sizeof(hparams.n_mels));
+        fout.write((const char *) &ftype_dst,             sizeof(hparams.ftype));
+
+        fout.write((const char *) &filters.n_mel,      sizeof(filters.n_mel));
+        fout.write((const char *) &filters.n_fft,      sizeof(filters.n_fft));
+        fout.write((const char *) filters.data.data(), filters.data.size() * sizeof(float));
+
+        const int32_t n_vocab = tokens.size();
+        fout.write((const char *) &n_vocab, sizeof(n_vocab));
+
+        for (const auto & token : tokens) {
+            const uint32_t len = token.size();
+            fout.write((const char *) &len,        sizeof(len));
+            fout.write((const char *) token.data(), len);
+        }
+    }
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, k_to_skip)) {
         fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
         return false;
     }
@@ -178,6 +405,7 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
 int main(int argc, char ** argv) {
     if (argc != 4) {
         fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type\n", argv[0]);
+        fprintf(stderr, "  a model-quant.gguf output is written as GGUF, type 0 or 1 keeps the types of the input\n");
         ggml_print_ftypes(stderr);
         return 1;
     }
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "common-whisper.h"
+#include "common-ggml.h"
 
 #include "whisper.h"
 #include "httplib.h"
@@ -84,6 +85,8 @@ struct whisper_params {
     std::string prompt          = "";
     std::string font_path       = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model           = "models/ggml-base.en.bin";
+    std::string cache_type_k    = "f16";
+    std::string cache_type_v    = "f16";
 
     std::string response_format     = json_format;
 
@@ -130,6 +133,8 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
+    fprintf(stderr, "  -ctk TYPE, --cache-type-k TYPE [%-7s] KV cache type for K (f16, q8_0, q5_1, q5_0, q4_1, q4_0)\n", params.cache_type_k.c_str());
+    fprintf(stderr, "  -ctv TYPE, --cache-type-v TYPE [%-7s] KV cache type for V, quantized types require -fa\n", params.cache_type_v.c_str());
     // server params
     fprintf(stderr, "  -dtw MODEL --dtw MODEL         [%-7s] compute token-level timestamps\n", params.dtw.c_str());
     fprintf(stderr, "  --host HOST,                   [%-7s] Hostname/ip-adress for the server\n", sparams.hostname.c_str());
@@ -184,6 +189,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = argv[++i]; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
         else if (arg == "-fa"   || arg == "--flash-attn")      { params.flash_attn      = true; }
+        else if (arg == "-ctk"  || arg == "--cache-type-k")    { params.cache_type_k    = argv[++i]; }
+        else if (arg == "-ctv"  || arg == "--cache-type-v")    { params.cache_type_v    = argv[++i]; }
         else if (arg == "-sns"  || arg == "--suppress-nst")    { params.suppress_nst    = true; }
         else if (arg == "-nth"  || arg == "--no-speech-thold") { params.no_speech_thold = std::stof(argv[++i]); }
 
@@ -541,6 +548,13 @@ int main(int argc, char ** argv) {
 
     cparams.use_gpu    = params.use_gpu;
     cparams.flash_attn = params.flash_attn;
+    cparams.type_k     = ggml_parse_type(params.cache_type_k.c_str());
+    cparams.type_v     = ggml_parse_type(params.cache_type_v.c_str());
+
+    if (cparams.type_k == GGML_TYPE_COUNT || cparams.type_v == GGML_TYPE_COUNT) {
+        fprintf(stderr, "error: unknown KV cache type\n");
+        return 3;
+    }
 
     if (!params.dtw.empty()) {
         cparams.dtw_token_timestamps = true;
@@ -596,6 +610,9 @@ int main(int argc, char ** argv) {
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    // allocate the states of the parallel workers up-front, so that the first request does not have to
+    whisper_state_pool_reserve(ctx, params.n_processors - 1, 0);
+
     Server svr;
     svr.set_default_headers({{"Server", "whisper.cpp"},
                              {"Access-Control-Allow-Origin", "*"},
@@ -1018,6 +1035,9 @@ int main(int argc, char ** argv) {
         // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
         whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+        // allocate the states of the parallel workers up-front, so that the first request does not have to
+        whisper_state_pool_reserve(ctx, params.n_processors - 1, 0);
+
         const std::string success = "Load was successful!";
         res.set_content(success, "application/text");
 
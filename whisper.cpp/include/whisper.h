@@ -118,6 +118,26 @@ extern "C" {
         bool  flash_attn;
         int   gpu_device;  // CUDA device
 
+        // whisper_init_from_file_*() only: map the model file and use the CPU weights in place instead of reading them
+        // with mmap_prefetch, the whole file is read ahead (MAP_POPULATE) instead of on the first use of each page
+        bool  use_mmap;
+        bool  mmap_prefetch;
+
+        // [EXPERIMENTAL] type of the self- and cross-attention KV caches of each state
+        // F16 (default), F32, Q8_0, Q5_1, Q5_0, Q4_1 or Q4_0
+        // a quantized V cache requires flash_attn, otherwise F16 is used
+        enum ggml_type type_k;
+        enum ggml_type type_v;
+
+        // [EXPERIMENTAL] convert the F16/F32 weights of the model to this type while loading them, using n_threads_load
+        // threads (0 - all the cores). GGML_TYPE_COUNT (default) keeps the types of the model file
+        // F16, Q8_0, Q5_1, Q5_0, Q4_1, Q4_0 or a K-quant, if the rows of the model are a multiple of its block size
+        // whisper_init_from_file_*() with cache_type_w: save the converted model next to the model file, as
+        // "<path_model>.<type>.gguf", and load that instead as long as the model file has the same size and modification time
+        enum ggml_type type_w;
+        int   n_threads_load;
+        bool  cache_type_w;
+
         // [EXPERIMENTAL] Token-level timestamps with DTW
         bool dtw_token_timestamps;
         enum whisper_alignment_heads_preset dtw_aheads_preset;
@@ -125,6 +145,8 @@ extern "C" {
         int dtw_n_top;
         struct whisper_aheads dtw_aheads;
 
+        int dtw_band; // half-width of the DTW search band around the diagonal, in 20 ms audio tokens (0 - full cost matrix)
+
         size_t dtw_mem_size; // TODO: remove
     };
 
@@ -191,6 +213,7 @@ extern "C" {
 
     // Various functions for loading a ggml whisper model.
     // Allocate (almost) all memory needed for the model.
+    // whisper_init_from_file_*() also load GGUF models (see examples/quantize)
     // Return NULL on failure
     WHISPER_API struct whisper_context * whisper_init_from_file_with_params  (const char * path_model,              struct whisper_context_params params);
     WHISPER_API struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size,    struct whisper_context_params params);
@@ -229,6 +252,46 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // Memory used by a state, in bytes
+    struct whisper_state_memory {
+        size_t kv_self;  // self-attention KV cache (grows with the number of decoders)
+        size_t kv_cross; // cross-attention KV cache
+        size_t kv_pad;   // padded KV buffer of the encoder
+        size_t compute;  // compute buffers of the conv, encoder, cross and decoder graphs
+        size_t host;     // mel spectrogram, logits and input buffers in host memory
+        size_t total;
+    };
+
+    WHISPER_API struct whisper_state_memory whisper_get_state_memory(struct whisper_state * state);
+
+    // Pool of pre-allocated states, owned by the context
+    // An idle state is handed out without allocating anything - its KV caches, compute buffers and DTW masks are kept,
+    // only the per-call data (results, text context, detected language, timings) is reset when it is released.
+    // If no state is idle, a new one is allocated, unless the pool would exceed its memory limit - then nullptr is returned.
+    // The pool always admits at least one state. The functions are thread-safe.
+    // All acquired states must be released before whisper_free(), and must not be freed with whisper_free_state().
+    WHISPER_API struct whisper_state * whisper_state_acquire(struct whisper_context * ctx);
+    WHISPER_API void                   whisper_state_release(struct whisper_context * ctx, struct whisper_state * state);
+
+    // Set the memory limit of the pool and pre-allocate states, so that the first acquires do not have to
+    // n_states: minimum number of states in the pool, idle states that do not fit in mem_max are freed
+    // mem_max:  limit of the memory used by all states of the pool in bytes, 0 - no limit
+    // Returns the number of states in the pool
+    WHISPER_API int whisper_state_pool_reserve(struct whisper_context * ctx, int n_states, size_t mem_max);
+
+    struct whisper_state_pool_stats {
+        int n_states; // states owned by the pool
+        int n_idle;   // states ready to be acquired
+        int n_hit;    // acquires served by an idle state
+        int n_miss;   // acquires that allocated a new state
+        int n_fail;   // acquires refused because of the memory limit or a failed allocation
+
+        size_t mem;     // memory used by all states of the pool, in bytes
+        size_t mem_max; // 0 - no limit
+    };
+
+    WHISPER_API struct whisper_state_pool_stats whisper_state_pool_get_stats(struct whisper_context * ctx);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -398,9 +461,11 @@ extern "C" {
     WHISPER_API int whisper_model_type         (struct whisper_context * ctx);
 
     // Token logits obtained from the last call to whisper_decode()
-    // The logits for the last token are stored in the last row
-    // Rows: n_tokens
+    // Only the logits for the last token are computed
+    // Rows: 1
     // Cols: n_vocab
+    // After whisper_full(), these are the logits of its last decoding pass, one row per decoder, with row 0 for the
+    // first decoder. If that was the prompt pass, row 0 is the last prompt token and row 1, if present, the SOT token
     WHISPER_API float * whisper_get_logits           (struct whisper_context * ctx);
     WHISPER_API float * whisper_get_logits_from_state(struct whisper_state * state);
 
@@ -430,6 +495,10 @@ extern "C" {
         float decode_ms;
         float batchd_ms;
         float prompt_ms;
+        int   audio_ctx; // encoder context size used by the last encode
+        int   n_draft;          // speculative decoding: number of draft tokens verified
+        int   n_draft_accepted; // speculative decoding: number of draft tokens accepted
+        float dtw_ms;           // token-level timestamps: DTW alignment time per run
     };
     WHISPER_API struct whisper_timings * whisper_get_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
@@ -502,6 +571,7 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_dynamic; // pick the smallest encoder length bucket that covers the audio in each window (ignored if audio_ctx > 0)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -521,6 +591,12 @@ extern "C" {
         const char * language;
         bool detect_language;
 
+        // [EXPERIMENTAL] language auto-detection
+        // detect_audio_ctx: audio_ctx used for the detection (0 - same as the first window, its encoder output is reused)
+        // detect_n_reuse:   reuse the language detected on the state for the next N calls, e.g. for streaming (0 - detect on every call)
+        int detect_audio_ctx;
+        int detect_n_reuse;
+
         // common decoding parameters:
         bool suppress_blank; // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L89
         bool suppress_nst;   // non-speech tokens, ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
@@ -535,6 +611,7 @@ extern "C" {
         float entropy_thold;    // similar to OpenAI's "compression_ratio_threshold"
         float logprob_thold;
         float no_speech_thold;
+        float no_speech_margin; // skip the decoding of a window when no_speech_prob > no_speech_thold + no_speech_margin (< 0 - disabled)
 
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
@@ -570,6 +647,13 @@ extern "C" {
         size_t                           n_grammar_rules;
         size_t                           i_start_rule;
         float                            grammar_penalty;
+
+        // [EXPERIMENTAL] speculative decoding
+        // a smaller model with the same vocabulary drafts up to draft_n_max (at most 8) tokens, which are verified in a single decode
+        // only the tokens that greedy decoding would pick are accepted
+        // used for greedy sampling at temperature 0 without grammar, ignored otherwise
+        struct whisper_context * draft_ctx; // not owned, must outlive the whisper_full() calls (nullptr - disabled)
+        int                      draft_n_max;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
@@ -594,11 +678,12 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
-    // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
+    // Split the input audio in ~30 s jobs at low-energy points and process them on n_processors workers using whisper_full_with_state()
+    // Idle workers steal the remaining jobs of the busiest worker. The states of the workers are kept in the context and reused.
+    // Each job overlaps the next one by 1 s when the segments have timestamps - the duplicated segments are dropped when the
+    // results are stitched together.
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -660,6 +745,23 @@ extern "C" {
     WHISPER_API const char * whisper_bench_memcpy_str      (int n_threads);
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
+    WHISPER_API int          whisper_bench_conv_stem       (int n_threads);
+    WHISPER_API const char * whisper_bench_conv_stem_str   (int n_threads);
+    WHISPER_API int          whisper_bench_logits          (int n_threads);
+    WHISPER_API const char * whisper_bench_logits_str      (int n_threads);
+
+    // Per-token cost of single-token decoding steps of the given model, with the decoder graph rebuilt on each step
+    // and with the graph reused between steps
+    WHISPER_API int          whisper_bench_decoder         (struct whisper_context * ctx, int n_threads);
+    WHISPER_API const char * whisper_bench_decoder_str     (struct whisper_context * ctx, int n_threads);
+
+    // Throughput of whisper_tokenize() with the vocabulary of the given model, compared to the std::regex reference
+    WHISPER_API int          whisper_bench_tokenizer       (struct whisper_context * ctx, int n_threads);
+    WHISPER_API const char * whisper_bench_tokenizer_str   (struct whisper_context * ctx, int n_threads);
+
+    // Per-window cost of encoding several states in one batched encoder graph, compared to encoding them one by one
+    WHISPER_API int          whisper_bench_encoder_batch    (struct whisper_context * ctx, int n_threads);
+    WHISPER_API const char * whisper_bench_encoder_batch_str(struct whisper_context * ctx, int n_threads);
 
     // Control logging output; default behavior is to print to stderr
 
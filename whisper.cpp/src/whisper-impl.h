@@ -0,0 +1,227 @@
+#pragma once
+
+// internal interface of the library, used by the benchmarks and the unit tests
+// not part of the public API in whisper.h and may change at any time
+
+#include "whisper.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct gguf_context;
+
+//
+// model
+//
+
+// default hparams (Whisper tiny)
+struct whisper_hparams {
+    int32_t n_vocab       = 51864;
+    int32_t n_audio_ctx   = 1500;
+    int32_t n_audio_state = 384;
+    int32_t n_audio_head  = 6;
+    int32_t n_audio_layer = 4;
+    int32_t n_text_ctx    = 448;
+    int32_t n_text_state  = 384;
+    int32_t n_text_head   = 6;
+    int32_t n_text_layer  = 4;
+    int32_t n_mels        = 80;
+    int32_t ftype         = 1;
+    float   eps           = 1e-5f;
+};
+
+struct whisper_filters {
+    int32_t n_mel;
+    int32_t n_fft;
+
+    std::vector<float> data;
+};
+
+// set the metadata of a GGUF model as read by whisper_model_load(): the hparams, the mel filters and the tokens of the
+// vocabulary in the order of their ids. used by the cache of converted models and by examples/quantize
+void whisper_gguf_set_model_meta(
+        struct gguf_context            * gguf,
+        const whisper_hparams          & hparams,
+        const whisper_filters          & filters,
+        const std::vector<std::string> & tokens);
+
+//
+// encoder
+//
+
+// Run the Whisper encoder on the spectrograms of several states at once.
+// The mel windows of all states are encoded in a single graph, so the encoder weights are read once for
+// the whole batch. The results are stored in each state as if whisper_encode_with_state() was called.
+// All states must be created from ctx and use the same audio context size.
+// offsets[i] is the offset of the first frame in the spectrogram of states[i] (NULL - all 0)
+// Returns 0 on success
+int whisper_encode_batch(
+        struct whisper_context * ctx,
+         struct whisper_state ** states,
+                     const int * offsets,
+                           int   n_states,
+                           int   n_threads);
+
+//
+// tokenizer
+//
+
+// byte trie over the tokens of the vocabulary, used to find the longest token that is a prefix of a word
+struct whisper_vocab_trie {
+    // node 0 is the root, node_tok[i] is the token that ends at node i or -1
+    std::vector<int32_t> node_tok;
+
+    // the children of node i are edge_byte / edge_node[node_edge[i], node_edge[i + 1]), sorted by byte
+    std::vector<uint32_t> node_edge;
+    std::vector<uint8_t>  edge_byte;
+    std::vector<int32_t>  edge_node;
+};
+
+struct whisper_vocab {
+    using id    = int32_t;
+    using token = std::string;
+
+    int n_vocab = 51864;
+
+    std::map<token, id> token_to_id;
+    std::map<id, token> id_to_token;
+
+    // built from token_to_id once the vocabulary is loaded, see tokenize()
+    whisper_vocab_trie trie;
+
+    // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
+    id token_eot        = 50256;
+    id token_sot        = 50257;
+    // task tokens (used only for multilingual models)
+    id token_translate  = 50357;
+    id token_transcribe = 50358;
+    // other special tokens
+    id token_solm       = 50359; // [TDRZ] used by tinydiarize models to indicate speaker turn
+    id token_prev       = 50360;
+    id token_nosp       = 50361;
+    id token_not        = 50362; // no timestamps
+    id token_beg        = 50363; // begin timestamps
+
+    bool is_multilingual() const {
+        return n_vocab >= 51865;
+    }
+
+    int num_languages() const {
+        return n_vocab - 51765 - (is_multilingual() ? 1 : 0);
+    }
+};
+
+// build the trie of the vocabulary from its tokens
+void whisper_vocab_trie_build(whisper_vocab_trie & trie, const std::map<whisper_vocab::token, whisper_vocab::id> & token_to_id);
+
+// split the text into words and the words into the longest tokens of the vocabulary, using the trie
+std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text);
+
+// the same with std::regex and lookups of the token_to_id map, as the original tokenizer - slow, for reference only
+std::vector<whisper_vocab::id> tokenize_regex(const whisper_vocab & vocab, const std::string & text);
+
+//
+// grammar
+//
+
+struct whisper_partial_utf8 {
+    uint32_t value;    // bit value so far (unshifted)
+    int      n_remain; // num bytes remaining; -1 indicates invalid sequence
+};
+
+struct whisper_grammar {
+    // shared by the copies of the grammar, the stacks point into it
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>> rules;
+    std::vector<std::vector<const whisper_grammar_element *>>                stacks;
+
+    // buffer for partially generated UTF-8 sequence from accepted tokens
+    whisper_partial_utf8 partial_utf8;
+};
+
+// prefix trie over the code points of the text tokens, built once per model
+// the grammar stacks are advanced along the trie, so a code point that no stack accepts rejects all tokens below it
+struct whisper_grammar_trie {
+    // the children of node i are edge_chr / edge_node[node_edge[i], node_edge[i + 1]), sorted by code point
+    std::vector<uint32_t> node_edge;
+    std::vector<uint32_t> edge_chr;
+    std::vector<int32_t>  edge_node;
+
+    // the tokens whose code points end at node i are tok_id / tok_partial[node_tok[i], node_tok[i + 1])
+    // tok_partial is the incomplete UTF-8 sequence at the end of the token, if any
+    std::vector<uint32_t>             node_tok;
+    std::vector<whisper_token>        tok_id;
+    std::vector<whisper_partial_utf8> tok_partial;
+
+    // mask of the tokens that are checked against the grammar, the tokens with invalid UTF-8 are never accepted
+    std::vector<uint64_t> candidates;
+};
+
+// decode a UTF-8 string which may end in an incomplete sequence, the code points end with a 0
+std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
+        const char           * src,
+        whisper_partial_utf8   partial_start);
+
+struct whisper_grammar whisper_grammar_init(
+        const whisper_grammar_element ** rules,
+                               size_t    n_rules,
+                               size_t    i_start_rule);
+
+// the stacks after accepting the code point chr
+std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        uint32_t                                                          chr);
+
+// build the trie of the text tokens of the vocabulary
+void whisper_grammar_trie_build(whisper_grammar_trie & trie, const whisper_vocab & vocab);
+
+// mask of the text tokens that the grammar rejects, as bits of 64-bit words
+// the trie version advances the stacks once per code point shared by the tokens, it requires grammar.partial_utf8 to
+// be empty; whisper_grammar_reject_tokens() checks every token against the stacks
+std::vector<uint64_t> whisper_grammar_trie_reject_tokens(const whisper_grammar_trie & trie, const whisper_grammar & grammar);
+std::vector<uint64_t> whisper_grammar_reject_tokens(const whisper_vocab & vocab, const whisper_grammar & grammar);
+
+//
+// DTW token timestamps
+//
+
+// scratch memory of the DTW alignment, reused across segments
+// the cells of the band are stored by anti-diagonal d = i + j, so that every anti-diagonal is contiguous
+struct whisper_dtw_buffers {
+    std::vector<float>   qks;    // normalized alignment head weights [n_heads][n_tokens][n_audio]
+    std::vector<double>  sum;    // per audio token sums, over the tokens or over the heads [n_audio]
+    std::vector<float>   mean;   // mean of the weights of each audio token over the tokens [n_audio]
+    std::vector<float>   scale;  // 1/stddev of the weights of each audio token over the tokens [n_audio]
+    std::vector<float>   med;    // median-filtered weights of one token and head [n_audio]
+    std::vector<float>   filter; // window of the median filter
+    std::vector<float>   x;      // cost of each cell of the band
+    std::vector<float>   cost;   // accumulated cost of the last 3 anti-diagonals
+    std::vector<int8_t>  trace;  // step into each cell of the band: 0 - diagonal, 1 - token, 2 - audio
+    std::vector<int32_t> lo;     // first token row of each anti-diagonal in the band
+    std::vector<int64_t> off;    // offset of each anti-diagonal in x and trace
+
+    std::vector<std::pair<int32_t, int32_t>> path; // (token, audio) pairs of the alignment
+};
+
+// cost of each cell of the DTW band from the alignment head QKs [n_heads][n_audio_ctx][n_tokens]
+// the first n_sot tokens and the last token are not aligned, band = 0 - the full cost matrix
+void whisper_dtw_cost(
+        whisper_dtw_buffers & dtw,
+                const float * qks,
+                      int64_t n_tokens,
+                      int64_t n_audio_ctx,
+                      int64_t n_audio_tokens,
+                      int64_t n_heads,
+                      int64_t n_sot,
+                          int medfilt_width,
+                          int band);
+
+// minimum cost path through the band of the (N + 1)x(M + 1) cost matrix, into buf.path
+void whisper_dtw_and_backtrace(whisper_dtw_buffers & buf, int64_t N, int64_t M);
+
+// is cell (i, j) of the cost matrix in the band of the last whisper_dtw_cost()
+bool whisper_dtw_in_band(const whisper_dtw_buffers & buf, int64_t i, int64_t j);
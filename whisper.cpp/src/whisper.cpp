@@ -1,10 +1,12 @@
 #include "whisper.h"
 #include "whisper-arch.h"
+#include "whisper-impl.h"
 
 #include "ggml.h"
 #include "ggml-cpp.h"
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
+#include "gguf.h"
 
 #ifdef WHISPER_USE_COREML
 #include "coreml/whisper-encoder.h"
@@ -23,18 +25,33 @@
 #include <codecvt>
 #include <cstdarg>
 #include <cstdio>
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <regex>
 #include <set>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// the weights can be used in place only if their layout in the file matches the memory layout
+#if defined(_POSIX_MAPPED_FILES) && !defined(WHISPER_BIG_ENDIAN)
+#define WHISPER_HAS_MMAP
+#endif
+
 // dummy
 
 #if defined(_MSC_VER)
@@ -143,7 +160,19 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
     } while (0)
 
 #define WHISPER_MAX_DECODERS 8
+
+// speculative decoding verifies up to this many draft tokens, plus the last accepted token, in one decode
+#define WHISPER_MAX_DRAFT 8
+
+// sequence that keeps the KV cells of the prompt for the temperature fallbacks of a window
+// the ids in [WHISPER_MAX_DECODERS, 2*WHISPER_MAX_DECODERS) are used temporarily by the beam search
+#define WHISPER_SEQ_ID_PROMPT (2*WHISPER_MAX_DECODERS)
 #define WHISPER_MAX_NODES 4096
+#define WHISPER_AUDIO_CTX_N_BUCKETS 4
+
+// the number of KV cells used by the decoder is rounded up to a multiple of this, so that the consecutive
+// decoding steps can reuse the same graph, see whisper_decoder_graph_cache
+#define WHISPER_KV_N_BUCKET 32u
 
 static std::string format(const char * fmt, ...) {
     va_list ap;
@@ -187,10 +216,12 @@ static bool ggml_graph_compute_helper(
     return ggml_backend_graph_compute(backend.get(), graph) == GGML_STATUS_SUCCESS;
 }
 
+// if reset is false, the graph allocation is kept alive so that the same graph can be computed again
 static bool ggml_graph_compute_helper(
       ggml_backend_sched_t   sched,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+                      bool   reset = true) {
 
     for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
         ggml_backend_t backend = ggml_backend_sched_get_backend(sched, i);
@@ -204,7 +235,9 @@ static bool ggml_graph_compute_helper(
     }
 
     bool t = ggml_backend_sched_graph_compute(sched, graph) == GGML_STATUS_SUCCESS;
-    ggml_backend_sched_reset(sched);
+    if (reset) {
+        ggml_backend_sched_reset(sched);
+    }
     return t;
 }
 
@@ -217,52 +250,6 @@ static void whisper_load_backends() {
 #endif
 }
 
-// TODO: move these functions to ggml-base with support for ggml-backend?
-
-static ggml_tensor * whisper_set_f32(struct ggml_tensor * t, float v) {
-    GGML_ASSERT(t->type == GGML_TYPE_F32);
-    GGML_ASSERT(ggml_is_contiguous(t));
-    size_t nels = ggml_nelements(t);
-    for (size_t i = 0; i < nels; ++i) {
-        ((float *) t->data)[i] = v;
-    }
-    return t;
-}
-
-static ggml_tensor * whisper_set_i32(struct ggml_tensor * t, int32_t v) {
-    GGML_ASSERT(t->type == GGML_TYPE_I32);
-    GGML_ASSERT(ggml_is_contiguous(t));
-    size_t nels = ggml_nelements(t);
-    for (size_t i = 0; i < nels; ++i) {
-        ((int32_t *) t->data)[i] = v;
-    }
-    return t;
-}
-
-static float whisper_get_f32_nd(const struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-    GGML_ASSERT(t->type == GGML_TYPE_F32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    return *(float *) data;
-}
-
-static void whisper_set_f32_nd(struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3, float v) {
-    GGML_ASSERT(t->type == GGML_TYPE_F32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    *(float *) data = v;
-}
-
-static int32_t whisper_get_i32_nd(const struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-    GGML_ASSERT(t->type == GGML_TYPE_I32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    return *(int32_t *) data;
-}
-
-static void whisper_set_i32_nd(struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3, int32_t v) {
-    GGML_ASSERT(t->type == GGML_TYPE_I32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    *(int32_t *) data = v;
-}
-
 // faster matrix multiplications for tensors that do not have dimension 0 divisible by "pad"
 // the idea is to represent the original matrix multiplication:
 //
@@ -463,44 +450,6 @@ struct whisper_mel {
     std::vector<float> data;
 };
 
-struct whisper_filters {
-    int32_t n_mel;
-    int32_t n_fft;
-
-    std::vector<float> data;
-};
-
-struct whisper_vocab {
-    using id    = int32_t;
-    using token = std::string;
-
-    int n_vocab = 51864;
-
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
-
-    // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
-    id token_eot        = 50256;
-    id token_sot        = 50257;
-    // task tokens (used only for multilingual models)
-    id token_translate  = 50357;
-    id token_transcribe = 50358;
-    // other special tokens
-    id token_solm       = 50359; // [TDRZ] used by tinydiarize models to indicate speaker turn
-    id token_prev       = 50360;
-    id token_nosp       = 50361;
-    id token_not        = 50362; // no timestamps
-    id token_beg        = 50363; // begin timestamps
-
-    bool is_multilingual() const {
-        return n_vocab >= 51865;
-    }
-
-    int num_languages() const {
-        return n_vocab - 51765 - (is_multilingual() ? 1 : 0);
-    }
-};
-
 struct whisper_segment {
     int64_t t0;
     int64_t t1;
@@ -566,6 +515,15 @@ static void whisper_batch_prep_legacy(whisper_batch & batch, const whisper_token
     batch.logits[n_tokens - 1] = 1;
 }
 
+// number of tokens in the batch for which logits are computed
+static int whisper_batch_n_outputs(const whisper_batch & batch) {
+    int n_outputs = 0;
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        n_outputs += batch.logits[i] != 0;
+    }
+    return n_outputs;
+}
+
 // replace std::pair by using customized pair struct (reason: std::pair is very slow)
 template<typename A, typename B>
 struct whisper_pair {
@@ -585,7 +543,82 @@ struct whisper_sched {
     std::vector<uint8_t> meta;
 };
 
+// the conv, encoder and cross graphs only depend on the audio context size and on the attention kind,
+// so once built and allocated they can be re-evaluated with new mel data without rebuilding them
+// the graphs live in the `meta` buffers of the corresponding schedulers
+struct whisper_encoder_graph_cache {
+    int32_t n_ctx      = -1; // -1 - invalid
+    bool    flash_attn = false;
+
+    ggml_cgraph * gf_conv   = nullptr;
+    ggml_cgraph * gf_encode = nullptr;
+    ggml_cgraph * gf_cross  = nullptr;
+
+    bool valid(int32_t n_ctx, bool flash_attn) const {
+        return this->n_ctx == n_ctx && this->flash_attn == flash_attn;
+    }
+};
+
+// the decoder graph depends only on the number of tokens and outputs of the batch, on the padded KV size and on the
+// audio context size, so consecutive decoding steps that fall in the same bucket re-evaluate the last allocated graph
+// the only KV head dependent parts of the graph are the views that store the new K and V rows - they are moved in place
+// the graph lives in the `meta` buffer of the decoder scheduler
+struct whisper_decoder_graph_cache {
+    int32_t n_tokens    = -1; // -1 - invalid
+    int32_t n_outputs   = -1;
+    int32_t n_kv        = -1;
+    int32_t n_audio_ctx = -1;
+
+    bool save_alignment_heads_QKs = false;
+
+    // KV head the store views currently point to
+    uint32_t kv_head = 0;
+
+    ggml_cgraph * gf = nullptr;
+
+    // the K and V store ops of the graph and the size in bytes of one KV cell in their destination
+    std::vector<std::pair<ggml_tensor *, size_t>> kv_store;
+
+    bool valid(int32_t n_tokens, int32_t n_outputs, int32_t n_kv, int32_t n_audio_ctx, bool save_alignment_heads_QKs) const {
+        return this->n_tokens    == n_tokens    &&
+               this->n_outputs   == n_outputs   &&
+               this->n_kv        == n_kv        &&
+               this->n_audio_ctx == n_audio_ctx &&
+               this->save_alignment_heads_QKs == save_alignment_heads_QKs;
+    }
+};
+
+// parameters of the fused conv1d + GELU op, see whisper_conv1d_gelu()
+struct whisper_conv1d_gelu_params {
+    int s0; // stride
+
+    // the output frames [skip0, skip1) are not computed - the caller fills them in
+    int64_t skip0;
+    int64_t skip1;
+};
+
+// conv stem input and output of the last encoded window
+// the conv layers have a kernel size of 3, so an output frame depends only on a few mel frames. when the next window
+// overlaps with this one (sliding or streaming windows), the outputs of the overlap are copied instead of recomputed
+struct whisper_conv_cache {
+    int32_t n_ctx = -1; // -1 - invalid
+
+    std::vector<float>    mel;  // [n_mels][2*n_ctx]
+    std::vector<float>    out;  // [n_state][n_ctx]
+    std::vector<uint64_t> hash; // [2*n_ctx] hash of each mel frame
+
+    // plan for the current window, see whisper_conv_cache_plan()
+    // the conv outputs [skip0, skip1) are copied from the cached outputs [skip0 + shift, skip1 + shift)
+    int64_t skip0 = 0;
+    int64_t skip1 = 0;
+    int64_t shift = 0;
+};
+
 static size_t whisper_sched_size(struct whisper_sched & allocr) {
+    if (allocr.sched == nullptr) {
+        return 0;
+    }
+
     size_t size = allocr.meta.size();
     for (int i = 0; i < ggml_backend_sched_get_n_backends(allocr.sched); ++i) {
         ggml_backend_t backend = ggml_backend_sched_get_backend(allocr.sched, i);
@@ -630,22 +663,6 @@ static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<
 // 'n_text_layer': 24
 // }
 //
-// default hparams (Whisper tiny)
-struct whisper_hparams {
-    int32_t n_vocab       = 51864;
-    int32_t n_audio_ctx   = 1500;
-    int32_t n_audio_state = 384;
-    int32_t n_audio_head  = 6;
-    int32_t n_audio_layer = 4;
-    int32_t n_text_ctx    = 448;
-    int32_t n_text_state  = 384;
-    int32_t n_text_head   = 6;
-    int32_t n_text_layer  = 4;
-    int32_t n_mels        = 80;
-    int32_t ftype         = 1;
-    float   eps           = 1e-5f;
-};
-
 // audio encoding layer
 struct whisper_layer_encoder {
     // encoder.blocks.*.attn_ln
@@ -733,15 +750,14 @@ struct whisper_layer_decoder {
     struct ggml_tensor * mlp_1_b;
 };
 
-struct whisper_kv_cell {
-    whisper_pos pos = -1;
+// the sequences that a KV cell belongs to, one bit per sequence id
+typedef uint32_t whisper_seq_mask;
 
-    std::set<whisper_seq_id> seq_id;
+static_assert(WHISPER_SEQ_ID_PROMPT < 8*sizeof(whisper_seq_mask), "whisper_seq_mask is too small for the sequence ids");
 
-    bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
-    }
-};
+static inline whisper_seq_mask whisper_seq_bit(whisper_seq_id id) {
+    return whisper_seq_mask(1) << id;
+}
 
 struct whisper_kv_cache {
     uint32_t head = 0;
@@ -750,7 +766,10 @@ struct whisper_kv_cache {
     // computed before each graph build
     uint32_t n = 0;
 
-    std::vector<whisper_kv_cell> cells;
+    // the cells, one entry per cell in each array
+    // a cell is free if its pos is -1, in which case it does not belong to any sequence
+    std::vector<whisper_pos>      cell_pos;
+    std::vector<whisper_seq_mask> cell_seq;
 
     struct ggml_tensor * k;
     struct ggml_tensor * v;
@@ -802,20 +821,11 @@ struct whisper_model {
 
     // tensors
     int n_loaded;
+    int n_converted = 0; // converted to whisper_context_params.type_w while loading
     std::map<std::string, struct ggml_tensor *> tensors;
-};
-
-struct whisper_partial_utf8 {
-    uint32_t value;    // bit value so far (unshifted)
-    int      n_remain; // num bytes remaining; -1 indicates invalid sequence
-};
-
-struct whisper_grammar {
-    /*const*/ std::vector<std::vector<whisper_grammar_element>> rules;
-    std::vector<std::vector<const whisper_grammar_element *>>   stacks;
 
-    // buffer for partially generated UTF-8 sequence from accepted tokens
-    whisper_partial_utf8 partial_utf8;
+    // the mapped model file, if some of the weights point into it
+    struct whisper_mmap * mapping = nullptr;
 };
 
 struct whisper_grammar_candidate {
@@ -824,6 +834,18 @@ struct whisper_grammar_candidate {
     whisper_partial_utf8   partial_utf8;
 };
 
+// rejected tokens of the grammar states seen so far, see whisper_suppress_invalid_grammar()
+// the decoders are processed in parallel, so the cache is guarded by a mutex
+struct whisper_grammar_cache {
+    // the rules that the stacks in the keys point into
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>> rules;
+
+    // key: the grammar stacks, separated by nullptr
+    std::map<std::vector<const whisper_grammar_element *>, std::vector<uint64_t>> rejects;
+
+    std::mutex mutex;
+};
+
 struct whisper_sequence {
     std::vector<whisper_token_data> tokens;
 
@@ -837,6 +859,16 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+// token suppression rules of the whisper_full_params, compiled once per whisper_full call
+// each mask is a bitset over the vocabulary, see whisper_suppress_init()
+struct whisper_suppress {
+    std::vector<uint64_t> pre;   // applied before the logits filter callback
+    std::vector<uint64_t> post;  // applied after it (suppress_regex, suppress_nst)
+    std::vector<uint64_t> blank; // applied at the beginning of a segment (suppress_blank)
+
+    bool has_post = false;
+};
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // the currently generated sequence of tokens
@@ -845,7 +877,7 @@ struct whisper_decoder {
     // grammar parse state of generated sequence of tokens
     whisper_grammar  grammar;
 
-    int i_batch;    // the index of the token in the current batch
+    int i_batch;    // the index of the token's logits in the output of the current batch
     int seek_delta; // the window shift found so far based on the decoded timestamp tokens
 
     bool failed;    // has the current segment failed to decode?
@@ -870,12 +902,144 @@ struct whisper_aheads_masks {
     ggml_backend_buffer_t buffer = nullptr;
 };
 
+// persistent worker threads for the per-decoder work of whisper_full_with_state()
+// the threads are created on first use and live until the state is freed
+struct whisper_worker_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    // current job, see whisper_worker_pool_run()
+    const std::function<void(int)> * fn = nullptr;
+
+    int n_items = 0;
+    int n_run   = 0; // number of pool threads that take part in the job
+    int n_busy  = 0; // number of those that have not finished yet
+
+    std::atomic<int> i_item { 0 };
+
+    uint64_t job  = 0;
+    bool     stop = false;
+};
+
+static void whisper_worker_pool_process(whisper_worker_pool & pool) {
+    while (true) {
+        const int i = pool.i_item.fetch_add(1);
+
+        if (i >= pool.n_items) {
+            break;
+        }
+
+        (*pool.fn)(i);
+    }
+}
+
+static void whisper_worker_pool_thread(whisper_worker_pool & pool, int ith) {
+    uint64_t job = 0;
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+
+        pool.cv_work.wait(lock, [&] { return pool.stop || pool.job != job; });
+
+        if (pool.stop) {
+            return;
+        }
+
+        job = pool.job;
+
+        if (ith >= pool.n_run) {
+            continue;
+        }
+
+        lock.unlock();
+
+        whisper_worker_pool_process(pool);
+
+        lock.lock();
+
+        if (--pool.n_busy == 0) {
+            pool.cv_done.notify_one();
+        }
+    }
+}
+
+// calls fn(i) for i in [0, n_items) on up to n_threads threads, including the calling one
+static void whisper_worker_pool_run(whisper_worker_pool & pool, int n_threads, int n_items, const std::function<void(int)> & fn) {
+    n_threads = std::min(n_threads, n_items);
+
+    if (n_threads <= 1) {
+        for (int i = 0; i < n_items; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    while ((int) pool.threads.size() < n_threads - 1) {
+        pool.threads.emplace_back(whisper_worker_pool_thread, std::ref(pool), (int) pool.threads.size());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        pool.fn      = &fn;
+        pool.n_items = n_items;
+        pool.n_run   = n_threads - 1;
+        pool.n_busy  = n_threads - 1;
+        pool.i_item  = 0;
+        pool.job++;
+    }
+
+    pool.cv_work.notify_all();
+
+    whisper_worker_pool_process(pool);
+
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+
+        pool.cv_done.wait(lock, [&] { return pool.n_busy == 0; });
+
+        pool.fn = nullptr;
+    }
+}
+
+static void whisper_worker_pool_free(whisper_worker_pool & pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stop = true;
+    }
+
+    pool.cv_work.notify_all();
+
+    for (auto & t : pool.threads) {
+        t.join();
+    }
+
+    pool.threads.clear();
+}
+
+// [EXPERIMENTAL] speculative decoding
+// the draft model of whisper_full_params.draft_ctx, see whisper_draft_propose()
+struct whisper_draft {
+    whisper_context * ctx   = nullptr; // not owned
+    whisper_state   * state = nullptr;
+
+    // the tokens that are currently in the KV cache of the draft state
+    std::vector<whisper_token> tokens;
+
+    int seek = -1; // the window that the draft state has encoded
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
     int64_t t_decode_us = 0;
     int64_t t_batchd_us = 0;
     int64_t t_prompt_us = 0;
+    int64_t t_draft_us = 0;
+    int64_t t_dtw_us = 0;
     int64_t t_mel_us = 0;
 
     int32_t n_sample = 0; // number of tokens sampled
@@ -885,6 +1049,11 @@ struct whisper_state {
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
+    int32_t n_draft  = 0; // number of draft tokens verified
+    int32_t n_accept = 0; // number of draft tokens accepted
+    int32_t n_dtw    = 0; // number of DTW alignments
+
+    int32_t n_audio_ctx_enc = 0; // encoder context size used by the last encoder call
 
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
@@ -905,14 +1074,42 @@ struct whisper_state {
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS];
 
+    whisper_suppress suppress;
+
+    whisper_grammar_cache grammar_cache;
+
+    // runs the per-decoder sampling and logits processing of the decoding loop
+    whisper_worker_pool workers;
+
+    whisper_draft draft;
+
     std::vector<ggml_backend_t> backends;
 
+    // compute the encoder conv stem with the fused CPU kernel instead of im2col + mul_mat, see whisper_conv1d_gelu()
+    bool conv_direct = false;
+
+    // used only with conv_direct - the conv outputs of overlapping windows are reused only by the fused kernel, so
+    // there is no reuse for the models wider than WHISPER_CONV_DIRECT_MAX_STATE (small and up)
+    whisper_conv1d_gelu_params conv_params[2] = { { 1, 0, 0 }, { 2, 0, 0 } };
+    whisper_conv_cache         conv_cache;
+
     // - stores meta info about the intermediate tensors into the `meta` buffers
     whisper_sched sched_conv;
     whisper_sched sched_encode;
     whisper_sched sched_cross;
     whisper_sched sched_decode;
 
+    // conv, encoder and cross graphs that are currently allocated in the schedulers above
+    whisper_encoder_graph_cache enc_graphs;
+
+    // decoder graph that is currently allocated in sched_decode
+    whisper_decoder_graph_cache dec_graph;
+
+    // batched encoder, see whisper_encode_batch()
+    // the scheduler is owned by the first state of the batch and is sized for up to n_encode_batch_max states
+    whisper_sched sched_encode_batch;
+    int32_t n_encode_batch_max = 0;
+
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
@@ -921,14 +1118,22 @@ struct whisper_state {
     std::vector<float> inp_mel;
     std::vector<float> inp_mask;
 
-    // decode output (2-dimensional array: [n_tokens][n_vocab])
+    // decode output, one row per token with batch.logits set (2-dimensional array: [n_outputs][n_vocab])
     std::vector<float> logits;
 
+    // the prompt of the current window and its logits, its KV cells are kept in WHISPER_SEQ_ID_PROMPT
+    std::vector<whisper_token> prompt_kv;
+    std::vector<float>         prompt_kv_logits;
+
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
     int lang_id = 0; // english by default
 
+    // [EXPERIMENTAL] the language of the last auto-detection and the number of whisper_full() calls that can still reuse it
+    int lang_id_detected = -1;
+    int lang_n_reuse     = 0;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 
 #ifdef WHISPER_USE_COREML
@@ -952,11 +1157,29 @@ struct whisper_state {
     whisper_aheads_masks aheads_masks;
     ggml_tensor * aheads_cross_QKs = nullptr;
     std::vector<float> aheads_cross_QKs_data;
+    whisper_dtw_buffers dtw;
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 };
 
+// states that are kept allocated between the uses, see whisper_state_acquire()
+struct whisper_state_pool {
+    std::mutex mutex;
+
+    std::vector<whisper_state *> states; // all states owned by the pool
+    std::vector<whisper_state *> idle;   // states that are ready to be acquired
+
+    // memory used by each state, updated when the state is released
+    std::unordered_map<whisper_state *, size_t> mem_state;
+
+    size_t mem_max = 0; // 0 - no limit
+
+    int32_t n_hit  = 0;
+    int32_t n_miss = 0;
+    int32_t n_fail = 0;
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
@@ -969,8 +1192,13 @@ struct whisper_context {
     whisper_model model;
     whisper_vocab vocab;
 
+    whisper_grammar_trie grammar_trie;
+
     whisper_state * state = nullptr;
 
+    // pre-allocated states handed out by whisper_state_acquire(), also used by the workers of whisper_full_parallel()
+    whisper_state_pool pool;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 };
 
@@ -982,118 +1210,374 @@ struct whisper_global {
 
 static whisper_global g_state;
 
-template<typename T>
-static void read_safe(whisper_model_loader * loader, T & dest) {
-    loader->read(loader->context, &dest, sizeof(T));
-    BYTESWAP_VALUE(dest);
-}
+// read-only mapping of a model file, see whisper_context_params.use_mmap
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
 
-static bool whisper_kv_cache_init(
-             struct whisper_kv_cache & cache,
-                      ggml_backend_t   backend,
-                           ggml_type   wtype,
-                             int64_t   n_text_state,
-                             int64_t   n_text_layer,
-                                 int   n_ctx) {
-    const int64_t n_mem      = n_text_layer*n_ctx;
-    const int64_t n_elements = n_text_state*n_mem;
+    size_t pos = 0; // read position of the model loader
+};
 
-    cache.ctx_buf.resize(2*ggml_tensor_overhead());
+static whisper_mmap * whisper_mmap_open(const char * path, bool prefetch) {
+#ifdef WHISPER_HAS_MMAP
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ cache.ctx_buf.size(),
-        /*.mem_buffer =*/ cache.ctx_buf.data(),
-        /*.no_alloc   =*/ true,
-    };
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
 
-    cache.head = 0;
-    cache.size = n_ctx;
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (prefetch) {
+        flags |= MAP_POPULATE;
+    }
+#endif
 
-    cache.cells.clear();
-    cache.cells.resize(n_ctx);
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
 
-    struct ggml_context * ctx = ggml_init(params);
+    // the mapping keeps a reference to the file
+    close(fd);
 
-    if (!ctx) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the kv cache context\n", __func__);
-        return false;
+    if (addr == MAP_FAILED) {
+        return nullptr;
     }
 
-    cache.k = ggml_new_tensor_1d(ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(ctx, wtype, n_elements);
-
-    cache.buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
-    if (!cache.buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the kv cache\n", __func__);
-        return false;
+    if (prefetch) {
+        posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED);
     }
 
-    ggml_backend_buffer_clear(cache.buffer, 0);
+    whisper_mmap * mapping = new whisper_mmap;
 
-    ggml_free(ctx);
+    mapping->addr = addr;
+    mapping->size = st.st_size;
 
-    return true;
+    return mapping;
+#else
+    GGML_UNUSED(path);
+    GGML_UNUSED(prefetch);
+
+    return nullptr;
+#endif
 }
 
-static void whisper_kv_cache_free(struct whisper_kv_cache & cache) {
-    ggml_backend_buffer_free(cache.buffer);
+static void whisper_mmap_free(whisper_mmap * mapping) {
+    if (mapping) {
+#ifdef WHISPER_HAS_MMAP
+        munmap(mapping->addr, mapping->size);
+#endif
+        delete mapping;
+    }
 }
 
-static bool whisper_kv_cache_find_slot(
-           struct whisper_kv_cache & cache,
-        const struct whisper_batch & batch) {
-    const uint32_t n_ctx    = cache.size;
-    const uint32_t n_tokens = batch.n_tokens;
+// index of a GGUF model file - the metadata and the tensor infos, without the tensor data
+struct whisper_gguf {
+    gguf_context * ctx  = nullptr;
+    ggml_context * meta = nullptr; // the tensors of the file, with their shapes
+};
 
-    if (n_tokens > n_ctx) {
-        WHISPER_LOG_ERROR("%s: n_tokens=%d > n_ctx=%d\n", __func__, n_tokens, n_ctx);
+static bool whisper_is_gguf(const char * path) {
+    char magic[4] = { 0 };
+
+    FILE * f = ggml_fopen(path, "rb");
+    if (f == nullptr) {
         return false;
     }
 
-    uint32_t n_tested = 0;
+    const bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic);
 
-    while (true) {
-        if (cache.head + n_tokens > n_ctx) {
-            n_tested += n_ctx - cache.head;
-            cache.head = 0;
-            continue;
-        }
+    fclose(f);
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
-                break;
-            }
-        }
+    return ok && memcmp(magic, GGUF_MAGIC, sizeof(magic)) == 0;
+}
 
-        if (found) {
-            break;
-        }
+static whisper_gguf * whisper_gguf_init(const char * path) {
+    whisper_gguf * gguf = new whisper_gguf;
 
-        if (n_tested >= n_ctx) {
-            //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
-        }
+    gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ &gguf->meta,
+    };
+
+    gguf->ctx = gguf_init_from_file(path, params);
+    if (gguf->ctx == nullptr) {
+        delete gguf;
+        return nullptr;
     }
 
-    for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+    return gguf;
+}
 
-        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
-        }
+static void whisper_gguf_free(whisper_gguf * gguf) {
+    if (gguf) {
+        gguf_free(gguf->ctx);
+        ggml_free(gguf->meta);
+        delete gguf;
     }
-
-    return true;
 }
 
-// find how many cells are currently in use
-static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
+// the integer hparams are stored as u32, but i32 is accepted as well
+static bool whisper_gguf_get_i32(const gguf_context * ctx, const char * key, int32_t & dst) {
+    const int64_t id = gguf_find_key(ctx, key);
+    if (id < 0) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in model file\n", __func__, key);
+        return false;
+    }
+
+    switch (gguf_get_kv_type(ctx, id)) {
+        case GGUF_TYPE_UINT32: dst = (int32_t) gguf_get_val_u32(ctx, id); break;
+        case GGUF_TYPE_INT32:  dst =           gguf_get_val_i32(ctx, id); break;
+        default:
+            {
+                WHISPER_LOG_ERROR("%s: key '%s' has wrong type %s in model file\n", __func__, key, gguf_type_name(gguf_get_kv_type(ctx, id)));
+                return false;
+            }
+    }
+
+    return true;
+}
+
+static const void * whisper_gguf_get_arr(const gguf_context * ctx, const char * key, gguf_type type, size_t & n) {
+    const int64_t id = gguf_find_key(ctx, key);
+    if (id < 0) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in model file\n", __func__, key);
+        return nullptr;
+    }
+
+    if (gguf_get_kv_type(ctx, id) != GGUF_TYPE_ARRAY || gguf_get_arr_type(ctx, id) != type) {
+        WHISPER_LOG_ERROR("%s: key '%s' is not an array of %s in model file\n", __func__, key, gguf_type_name(type));
+        return nullptr;
+    }
+
+    n = gguf_get_arr_n(ctx, id);
+
+    return gguf_get_arr_data(ctx, id);
+}
+
+// the ftype of a model with weights of the given type, GGML_FTYPE_UNKNOWN if the weights cannot be converted to it
+static ggml_ftype whisper_type_w_to_ftype(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F16:  return GGML_FTYPE_MOSTLY_F16;
+        case GGML_TYPE_Q4_0: return GGML_FTYPE_MOSTLY_Q4_0;
+        case GGML_TYPE_Q4_1: return GGML_FTYPE_MOSTLY_Q4_1;
+        case GGML_TYPE_Q5_0: return GGML_FTYPE_MOSTLY_Q5_0;
+        case GGML_TYPE_Q5_1: return GGML_FTYPE_MOSTLY_Q5_1;
+        case GGML_TYPE_Q8_0: return GGML_FTYPE_MOSTLY_Q8_0;
+        case GGML_TYPE_Q2_K: return GGML_FTYPE_MOSTLY_Q2_K;
+        case GGML_TYPE_Q3_K: return GGML_FTYPE_MOSTLY_Q3_K;
+        case GGML_TYPE_Q4_K: return GGML_FTYPE_MOSTLY_Q4_K;
+        case GGML_TYPE_Q5_K: return GGML_FTYPE_MOSTLY_Q5_K;
+        case GGML_TYPE_Q6_K: return GGML_FTYPE_MOSTLY_Q6_K;
+        default:             return GGML_FTYPE_UNKNOWN;
+    }
+}
+
+// F32/F16 weights to convert to another type, see whisper_context_params.type_w
+// the quantization dominates the load time of a converted model, so the tensors are queued while the model is read and
+// converted together by whisper_convert_weights()
+struct whisper_convert_job {
+    ggml_tensor * tensor;
+    ggml_type     type_src;
+    const void  * src;
+    void        * dst;
+
+    std::vector<char> buf_src; // copy of the source, if the model file is not mapped
+    std::vector<char> buf_dst; // if the tensor is not in host memory
+};
+
+// convert the queued tensors with n_threads workers, each pulling the next tensor from a shared counter
+// the largest tensors go first, so that the last ones to finish are small
+static void whisper_convert_weights(std::vector<whisper_convert_job> & jobs, int n_threads) {
+    std::vector<size_t> order(jobs.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return ggml_nelements(jobs[a].tensor) > ggml_nelements(jobs[b].tensor);
+    });
+
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        std::vector<float> tmp;
+
+        for (size_t i = next++; i < order.size(); i = next++) {
+            const auto & job = jobs[order[i]];
+
+            const int64_t n_per_row = job.tensor->ne[0];
+            const int64_t n_rows    = ggml_nrows(job.tensor);
+
+            const float * x = (const float *) job.src;
+
+            if (job.type_src == GGML_TYPE_F16) {
+                tmp.resize(n_rows*n_per_row);
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *) job.src, tmp.data(), tmp.size());
+                x = tmp.data();
+            }
+
+            ggml_quantize_chunk(job.tensor->type, x, job.dst, 0, n_rows, n_per_row, nullptr);
+        }
+    };
+
+    n_threads = (int) std::max<size_t>(1, std::min<size_t>(n_threads, jobs.size()));
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+template<typename T>
+static void read_safe(whisper_model_loader * loader, T & dest) {
+    loader->read(loader->context, &dest, sizeof(T));
+    BYTESWAP_VALUE(dest);
+}
+
+static bool whisper_kv_cache_init(
+             struct whisper_kv_cache & cache,
+                      ggml_backend_t   backend,
+                           ggml_type   type_k,
+                           ggml_type   type_v,
+                             int64_t   n_text_state,
+                             int64_t   n_text_layer,
+                                 int   n_ctx) {
+    const int64_t n_mem      = n_text_layer*n_ctx;
+    const int64_t n_elements = n_text_state*n_mem;
+
+    cache.ctx_buf.resize(2*ggml_tensor_overhead());
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ cache.ctx_buf.size(),
+        /*.mem_buffer =*/ cache.ctx_buf.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    cache.head = 0;
+    cache.size = n_ctx;
+
+    cache.cell_pos.assign(n_ctx, -1);
+    cache.cell_seq.assign(n_ctx, 0);
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    if (!ctx) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for the kv cache context\n", __func__);
+        return false;
+    }
+
+    cache.k = ggml_new_tensor_1d(ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(ctx, type_v, n_elements);
+
+    cache.buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    if (!cache.buffer) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for the kv cache\n", __func__);
+        return false;
+    }
+
+    ggml_backend_buffer_clear(cache.buffer, 0);
+
+    ggml_free(ctx);
+
+    return true;
+}
+
+static void whisper_kv_cache_free(struct whisper_kv_cache & cache) {
+    ggml_backend_buffer_free(cache.buffer);
+}
+
+static size_t whisper_kv_cache_nbytes(const struct whisper_kv_cache & cache) {
+    return cache.buffer ? ggml_backend_buffer_get_size(cache.buffer) : 0;
+}
+
+// [EXPERIMENTAL] quantized KV caches
+// the K and V caches are written with ggml_cpy and read per attention head, so the quantization blocks must not
+// cross the rows of the heads (n_state_head = 64 for all models)
+static bool whisper_kv_cache_type_supported(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q4_0:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool whisper_kv_cache_find_slot(
+           struct whisper_kv_cache & cache,
+        const struct whisper_batch & batch) {
+    const uint32_t n_ctx    = cache.size;
+    const uint32_t n_tokens = batch.n_tokens;
+
+    if (n_tokens > n_ctx) {
+        WHISPER_LOG_ERROR("%s: n_tokens=%d > n_ctx=%d\n", __func__, n_tokens, n_ctx);
+        return false;
+    }
+
+    uint32_t n_tested = 0;
+
+    while (true) {
+        if (cache.head + n_tokens > n_ctx) {
+            n_tested += n_ctx - cache.head;
+            cache.head = 0;
+            continue;
+        }
+
+        bool found = true;
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            if (cache.cell_pos[cache.head + i] >= 0) {
+                found = false;
+                cache.head += i + 1;
+                n_tested   += i + 1;
+                break;
+            }
+        }
+
+        if (found) {
+            break;
+        }
+
+        if (n_tested >= n_ctx) {
+            //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        whisper_seq_mask seq = 0;
+
+        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+            seq |= whisper_seq_bit(batch.seq_id[i][j]);
+        }
+
+        cache.cell_pos[cache.head + i] = batch.pos[i];
+        cache.cell_seq[cache.head + i] = seq;
+    }
+
+    return true;
+}
+
+// find how many cells are currently in use
+static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
+    for (uint32_t i = cache.size - 1; i > 0; --i) {
+        if (cache.cell_pos[i] >= 0 && cache.cell_seq[i] != 0) {
             return i + 1;
         }
     }
@@ -1102,10 +1586,8 @@ static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache)
 }
 
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
-    }
+    std::fill(cache.cell_pos.begin(), cache.cell_pos.end(), -1);
+    std::fill(cache.cell_seq.begin(), cache.cell_seq.end(),  0);
     cache.head = 0;
 
     ggml_backend_buffer_clear(cache.buffer, 0);
@@ -1121,17 +1603,14 @@ static void whisper_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
+    // seq_id < 0 removes the cells from all sequences
+    const whisper_seq_mask keep = seq_id < 0 ? 0 : ~whisper_seq_bit(seq_id);
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
-            }
-            if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
+        if (cache.cell_pos[i] >= p0 && cache.cell_pos[i] < p1 && (cache.cell_seq[i] & ~keep) != 0) {
+            cache.cell_seq[i] &= keep;
+            if (cache.cell_seq[i] == 0) {
+                cache.cell_pos[i] = -1;
                 if (new_head == cache.size) new_head = i;
             }
         }
@@ -1141,6 +1620,28 @@ static void whisper_kv_cache_seq_rm(
     if (new_head != cache.size) cache.head = new_head;
 }
 
+// remove all cells that are not part of seq_id
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id) {
+    uint32_t new_head = cache.size;
+
+    const whisper_seq_mask bit = whisper_seq_bit(seq_id);
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if ((cache.cell_seq[i] & bit) == 0) {
+            cache.cell_pos[i] = -1;
+            cache.cell_seq[i] = 0;
+            if (new_head == cache.size) new_head = i;
+        } else {
+            cache.cell_seq[i] = bit;
+        }
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size) cache.head = new_head;
+}
+
 static void whisper_kv_cache_seq_cp(
         struct whisper_kv_cache & cache,
                  whisper_seq_id   seq_id_src,
@@ -1152,10 +1653,17 @@ static void whisper_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
-        }
+    const whisper_seq_mask bit_src = whisper_seq_bit(seq_id_src);
+    const whisper_seq_mask bit_dst = whisper_seq_bit(seq_id_dst);
+
+    const uint32_t n_ctx = cache.size;
+
+    const whisper_pos * cell_pos = cache.cell_pos.data();
+    whisper_seq_mask  * cell_seq = cache.cell_seq.data();
+
+    for (uint32_t i = 0; i < n_ctx; ++i) {
+        const bool cp = ((cell_seq[i] & bit_src) != 0) & (cell_pos[i] >= p0) & (cell_pos[i] < p1);
+        cell_seq[i] |= cp ? bit_dst : 0;
     }
 }
 
@@ -1484,154 +1992,525 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
-// load the model from a ggml file
-//
-// file format:
-//
-//   - hparams
-//   - pre-computed mel filters
-//   - vocab
-//   - weights
-//
-// see the convert-pt-to-ggml.py script for details
-//
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
-    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+void whisper_vocab_trie_build(whisper_vocab_trie & trie, const std::map<whisper_vocab::token, whisper_vocab::id> & token_to_id) {
+    std::vector<int32_t> parent = { -1 };
+    std::vector<uint8_t> byte   = {  0 };
 
-    const int64_t t_start_us = ggml_time_us();
+    trie.node_tok = { -1 };
 
-    wctx.t_start_us = t_start_us;
+    // the map compares the tokens as unsigned bytes, so the children of each node are created in byte order
+    // path[k] is the node of the first k bytes of the previous token
+    std::vector<int32_t> path = { 0 };
+    std::string prev;
 
-    auto & model = wctx.model;
-    auto & vocab = wctx.vocab;
+    for (const auto & it : token_to_id) {
+        const auto & token = it.first;
 
-    // verify magic
-    {
-        uint32_t magic;
-        read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
-            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
-            return false;
+        size_t n_common = 0;
+        while (n_common < prev.size() && n_common < token.size() && prev[n_common] == token[n_common]) {
+            ++n_common;
         }
-    }
-
-    //load hparams
-    {
-        auto & hparams = model.hparams;
-
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
-
-        assert(hparams.n_text_state == hparams.n_audio_state);
 
-        std::string mver = "";
-
-        if (hparams.n_audio_layer == 4) {
-            model.type = e_model::MODEL_TINY;
-        }
+        path.resize(n_common + 1);
 
-        if (hparams.n_audio_layer == 6) {
-            model.type = e_model::MODEL_BASE;
-        }
+        for (size_t k = n_common; k < token.size(); ++k) {
+            parent.push_back(path.back());
+            byte.push_back(token[k]);
+            trie.node_tok.push_back(-1);
 
-        if (hparams.n_audio_layer == 12) {
-            model.type = e_model::MODEL_SMALL;
+            path.push_back(trie.node_tok.size() - 1);
         }
 
-        if (hparams.n_audio_layer == 24) {
-            model.type = e_model::MODEL_MEDIUM;
+        // the empty token can never be matched
+        if (!token.empty()) {
+            trie.node_tok[path.back()] = it.second;
         }
 
-        if (hparams.n_audio_layer == 32) {
-            model.type = e_model::MODEL_LARGE;
+        prev = token;
+    }
 
-            if (hparams.n_vocab == 51866) {
-                mver = " v3";
-            }
-        }
+    const int n_nodes = trie.node_tok.size();
 
-        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+    trie.node_edge.assign(n_nodes + 1, 0);
+    for (int i = 1; i < n_nodes; ++i) {
+        trie.node_edge[parent[i] + 1]++;
+    }
+    for (int i = 0; i < n_nodes; ++i) {
+        trie.node_edge[i + 1] += trie.node_edge[i];
+    }
 
-        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+    trie.edge_byte.resize(n_nodes - 1);
+    trie.edge_node.resize(n_nodes - 1);
 
-        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
-        // in order to save memory and also to speed up the computation
-        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
-        if (wctx.wtype == GGML_TYPE_COUNT) {
-            WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
-            return false;
-        }
+    std::vector<uint32_t> cur(trie.node_edge.begin(), trie.node_edge.end() - 1);
+    for (int i = 1; i < n_nodes; ++i) {
+        const uint32_t e = cur[parent[i]]++;
 
-        WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
-        WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
-        WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
-        WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
-        WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
-        WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
-        WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
-        WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
-        WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
-        WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
-        WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
-        WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
+        trie.edge_byte[e] = byte[i];
+        trie.edge_node[e] = i;
+    }
+}
+
+// size and modification time of a model file
+// the converted model stores the stamp of the model file it was made from, and is used only while it matches
+struct whisper_file_stamp {
+    uint64_t size     = 0;
+    int64_t  mtime_ns = 0; // 0 where the modification time is not available
+};
+
+static bool whisper_file_stamp_get(const char * path, whisper_file_stamp & stamp) {
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+
+    stamp.size = st.st_size;
+#if defined(__APPLE__)
+    stamp.mtime_ns = (int64_t) st.st_mtimespec.tv_sec*1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    stamp.mtime_ns = (int64_t) st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+#endif
+
+    return true;
+#else
+    FILE * f = ggml_fopen(path, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+
+#if defined(_WIN32)
+    _fseeki64(f, 0, SEEK_END);
+    stamp.size = _ftelli64(f);
+#else
+    fseek(f, 0, SEEK_END);
+    stamp.size = ftell(f);
+#endif
+    stamp.mtime_ns = 0;
+
+    fclose(f);
+
+    return true;
+#endif
+}
+
+void whisper_gguf_set_model_meta(
+        gguf_context                   * gguf,
+        const whisper_hparams          & hparams,
+        const whisper_filters          & filters,
+        const std::vector<std::string> & tokens) {
+    gguf_set_val_str(gguf, "general.architecture", "whisper");
+    gguf_set_val_u32(gguf, "general.file_type",            hparams.ftype);
+    gguf_set_val_u32(gguf, "general.quantization_version", GGML_QNT_VERSION);
+
+    gguf_set_val_u32(gguf, "whisper.vocab_size",                 hparams.n_vocab);
+    gguf_set_val_u32(gguf, "whisper.audio.context_length",       hparams.n_audio_ctx);
+    gguf_set_val_u32(gguf, "whisper.audio.embedding_length",     hparams.n_audio_state);
+    gguf_set_val_u32(gguf, "whisper.audio.attention.head_count", hparams.n_audio_head);
+    gguf_set_val_u32(gguf, "whisper.audio.block_count",          hparams.n_audio_layer);
+    gguf_set_val_u32(gguf, "whisper.text.context_length",        hparams.n_text_ctx);
+    gguf_set_val_u32(gguf, "whisper.text.embedding_length",      hparams.n_text_state);
+    gguf_set_val_u32(gguf, "whisper.text.attention.head_count",  hparams.n_text_head);
+    gguf_set_val_u32(gguf, "whisper.text.block_count",           hparams.n_text_layer);
+    gguf_set_val_u32(gguf, "whisper.audio.mel_count",            hparams.n_mels);
+
+    gguf_set_val_u32(gguf, "whisper.mel_filters.n_mel", filters.n_mel);
+    gguf_set_val_u32(gguf, "whisper.mel_filters.n_fft", filters.n_fft);
+    gguf_set_arr_data(gguf, "whisper.mel_filters", GGUF_TYPE_FLOAT32, filters.data.data(), filters.data.size());
+
+    // the tokens are arbitrary bytes, so they are not stored as strings
+    {
+        std::vector<uint32_t> lengths;
+        std::string bytes;
+
+        for (const auto & token : tokens) {
+            lengths.push_back(token.size());
+            bytes += token;
+        }
+
+        gguf_set_arr_data(gguf, "whisper.vocab.token_lengths", GGUF_TYPE_UINT32, lengths.data(), lengths.size());
+        gguf_set_arr_data(gguf, "whisper.vocab.token_bytes",   GGUF_TYPE_UINT8,  bytes.data(),   bytes.size());
+    }
+}
+
+// where to save the converted model, see whisper_context_params.cache_type_w
+struct whisper_cache_target {
+    std::string        path;
+    whisper_file_stamp source; // of the model file
+};
+
+// saves the converted model as GGUF while it is loaded, with the metadata of whisper_gguf_set_model_meta()
+// see whisper_context_params.cache_type_w - the repacked CPU buffers cannot be read back after loading, so each tensor
+// is written when its data is read from the model file. the file is written under a temporary name and renamed when
+// complete, so that a partial file is never loaded
+struct whisper_cache_writer {
+    std::string path;
+    std::string path_tmp; // unique to the process and thread, several of them may convert the same model
+    std::ofstream fout;
+
+    std::map<const ggml_tensor *, size_t> offs; // of the data of each tensor in the file
+
+    size_t size = 0; // of the complete file
+
+    ~whisper_cache_writer() {
+        if (fout.is_open()) {
+            fout.close();
+            std::remove(path_tmp.c_str());
+        }
+    }
+};
+
+static bool whisper_cache_writer_init(whisper_cache_writer & writer, const whisper_context & wctx, const whisper_cache_target & target) {
+    const auto & model = wctx.model;
+    const auto & vocab = wctx.vocab;
+
+    std::vector<std::string> tokens(vocab.n_vocab);
+    for (int i = 0; i < vocab.n_vocab; ++i) {
+        tokens[i] = vocab.id_to_token.at(i);
+    }
+
+    gguf_context * gguf = gguf_init_empty();
+
+    whisper_gguf_set_model_meta(gguf, model.hparams, model.filters, tokens);
+
+    gguf_set_val_u64(gguf, "whisper.cache.source_size",  target.source.size);
+    gguf_set_val_i64(gguf, "whisper.cache.source_mtime", target.source.mtime_ns);
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ model.tensors.size()*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    for (const auto & it : model.tensors) {
+        ggml_tensor * t = ggml_new_tensor(ctx, it.second->type, GGML_MAX_DIMS, it.second->ne);
+        ggml_set_name(t, it.first.c_str());
+
+        gguf_add_tensor(gguf, t);
+    }
+
+    ggml_free(ctx);
+
+    std::vector<char> meta(gguf_get_meta_size(gguf));
+    gguf_get_meta_data(gguf, meta.data());
+
+    for (const auto & it : model.tensors) {
+        writer.offs[it.second] = meta.size() + gguf_get_tensor_offset(gguf, gguf_find_tensor(gguf, it.first.c_str()));
+        writer.size = std::max(writer.size, writer.offs[it.second] + GGML_PAD(ggml_nbytes(it.second), gguf_get_alignment(gguf)));
+    }
+
+    gguf_free(gguf);
+
+    writer.path     = target.path;
+    writer.path_tmp = target.path + ".tmp";
+#if defined(__unix__) || defined(__APPLE__)
+    writer.path_tmp += "." + std::to_string((long long) getpid());
+#endif
+    writer.path_tmp += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    writer.fout.open(writer.path_tmp, std::ios::binary);
+    writer.fout.write(meta.data(), meta.size());
+
+    return (bool) writer.fout;
+}
+
+// the padding between the tensors is left as a hole, which reads as zeros
+static void whisper_cache_writer_write(whisper_cache_writer & writer, const ggml_tensor * tensor, const void * data) {
+    writer.fout.seekp(writer.offs.at(tensor));
+    writer.fout.write((const char *) data, ggml_nbytes(tensor));
+}
+
+static bool whisper_cache_writer_finish(whisper_cache_writer & writer) {
+    // pad the last tensor
+    writer.fout.seekp(0, std::ios::end);
+
+    const size_t size = writer.fout.tellp();
+    if (size < writer.size) {
+        const std::vector<char> zeros(writer.size - size, 0);
+        writer.fout.write(zeros.data(), zeros.size());
+    }
+
+    writer.fout.close();
+
+    bool ok = !writer.fout.fail();
+
+    if (ok) {
+        std::remove(writer.path.c_str());
+        ok = std::rename(writer.path_tmp.c_str(), writer.path.c_str()) == 0;
+    }
+
+    if (!ok) {
+        std::remove(writer.path_tmp.c_str());
+    }
+
+    return ok;
+}
+
+// load the model from a ggml file
+//
+// file format:
+//
+//   - hparams
+//   - pre-computed mel filters
+//   - vocab
+//   - weights
+//
+// see the convert-pt-to-ggml.py script for details
+//
+// a GGUF file (see examples/quantize) stores the hparams, the mel filters and the vocab as metadata, followed by an
+// index of the tensors and the aligned tensor data. the index is parsed up front into gguf and the loader is used
+// only for reading the tensor data, in the order of the index
+//
+// with target, the converted weights are saved there as they are loaded, see whisper_cache_writer
+//
+static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx, const whisper_gguf * gguf, const whisper_cache_target * target) {
+    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    wctx.t_start_us = t_start_us;
+
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
+
+    // verify magic
+    {
+        uint32_t magic;
+        read_safe(loader, magic);
+        if (gguf == nullptr && magic != GGML_FILE_MAGIC) {
+            if (memcmp(&magic, GGUF_MAGIC, sizeof(magic)) == 0) {
+                WHISPER_LOG_ERROR("%s: GGUF models can only be loaded from a file\n", __func__);
+            } else {
+                WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
+            }
+            return false;
+        }
+    }
+
+    //load hparams
+    {
+        auto & hparams = model.hparams;
+
+        if (gguf) {
+            const int64_t id_arch = gguf_find_key(gguf->ctx, "general.architecture");
+            if (id_arch < 0 || gguf_get_kv_type(gguf->ctx, id_arch) != GGUF_TYPE_STRING || strcmp(gguf_get_val_str(gguf->ctx, id_arch), "whisper") != 0) {
+                WHISPER_LOG_ERROR("%s: invalid model file (not a whisper model)\n", __func__);
+                return false;
+            }
+
+            int32_t qntvr = 0;
+
+            const std::pair<const char *, int32_t *> keys[] = {
+                { "whisper.vocab_size",                   &hparams.n_vocab       },
+                { "whisper.audio.context_length",         &hparams.n_audio_ctx   },
+                { "whisper.audio.embedding_length",       &hparams.n_audio_state },
+                { "whisper.audio.attention.head_count",   &hparams.n_audio_head  },
+                { "whisper.audio.block_count",            &hparams.n_audio_layer },
+                { "whisper.text.context_length",          &hparams.n_text_ctx    },
+                { "whisper.text.embedding_length",        &hparams.n_text_state  },
+                { "whisper.text.attention.head_count",    &hparams.n_text_head   },
+                { "whisper.text.block_count",             &hparams.n_text_layer  },
+                { "whisper.audio.mel_count",              &hparams.n_mels        },
+                { "general.file_type",                    &hparams.ftype         },
+                { "general.quantization_version",         &qntvr                 },
+            };
+
+            for (const auto & key : keys) {
+                if (!whisper_gguf_get_i32(gguf->ctx, key.first, *key.second)) {
+                    return false;
+                }
+            }
+
+            hparams.ftype += qntvr*GGML_QNT_VERSION_FACTOR;
+
+            WHISPER_LOG_INFO("%s: GGUF v%d, %d tensors, alignment = %zu\n", __func__,
+                    (int) gguf_get_version(gguf->ctx), (int) gguf_get_n_tensors(gguf->ctx), gguf_get_alignment(gguf->ctx));
+        } else {
+            read_safe(loader, hparams.n_vocab);
+            read_safe(loader, hparams.n_audio_ctx);
+            read_safe(loader, hparams.n_audio_state);
+            read_safe(loader, hparams.n_audio_head);
+            read_safe(loader, hparams.n_audio_layer);
+            read_safe(loader, hparams.n_text_ctx);
+            read_safe(loader, hparams.n_text_state);
+            read_safe(loader, hparams.n_text_head);
+            read_safe(loader, hparams.n_text_layer);
+            read_safe(loader, hparams.n_mels);
+            read_safe(loader, hparams.ftype);
+        }
+
+        assert(hparams.n_text_state == hparams.n_audio_state);
+
+        std::string mver = "";
+
+        if (hparams.n_audio_layer == 4) {
+            model.type = e_model::MODEL_TINY;
+        }
+
+        if (hparams.n_audio_layer == 6) {
+            model.type = e_model::MODEL_BASE;
+        }
+
+        if (hparams.n_audio_layer == 12) {
+            model.type = e_model::MODEL_SMALL;
+        }
+
+        if (hparams.n_audio_layer == 24) {
+            model.type = e_model::MODEL_MEDIUM;
+        }
+
+        if (hparams.n_audio_layer == 32) {
+            model.type = e_model::MODEL_LARGE;
+
+            if (hparams.n_vocab == 51866) {
+                mver = " v3";
+            }
+        }
+
+        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+
+        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+
+        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
+        // in order to save memory and also to speed up the computation
+        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
+        if (wctx.wtype == GGML_TYPE_COUNT) {
+            WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
+            return false;
+        }
+
+        WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
+        WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
+        WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
+        WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
+        WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
+        WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
+        WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
+        WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
+        WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
+        WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
+        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
+        WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
+        WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
+    }
+
+    // convert the weights while loading them, see whisper_context_params.type_w
+    if (wctx.params.type_w != GGML_TYPE_COUNT && wctx.params.type_w != wctx.wtype) {
+        auto & hparams = model.hparams;
+
+        const ggml_type  type_w  = wctx.params.type_w;
+        const ggml_ftype ftype_w = whisper_type_w_to_ftype(type_w);
+
+        if (ftype_w == GGML_FTYPE_UNKNOWN) {
+            WHISPER_LOG_WARN("%s: cannot convert the weights to %s - keeping %s\n", __func__, ggml_type_name(type_w), ggml_type_name(wctx.wtype));
+        } else if (wctx.wtype != GGML_TYPE_F32 && wctx.wtype != GGML_TYPE_F16) {
+            WHISPER_LOG_WARN("%s: cannot convert quantized %s weights to %s\n", __func__, ggml_type_name(wctx.wtype), ggml_type_name(type_w));
+        } else if (hparams.n_audio_state % ggml_blck_size(type_w) != 0 || hparams.n_text_state % ggml_blck_size(type_w) != 0) {
+            WHISPER_LOG_WARN("%s: cannot convert the weights to %s - the rows (%d) are not a multiple of its block size (%d)\n",
+                    __func__, ggml_type_name(type_w), hparams.n_text_state, (int) ggml_blck_size(type_w));
+        } else {
+            WHISPER_LOG_INFO("%s: converting the %s weights to %s\n", __func__, ggml_type_name(wctx.wtype), ggml_type_name(type_w));
+
+            wctx.wtype    = type_w;
+            hparams.ftype = ftype_w;
+        }
     }
 
     // load mel filters
     {
         auto & filters = wctx.model.filters;
 
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+        if (gguf) {
+            if (!whisper_gguf_get_i32(gguf->ctx, "whisper.mel_filters.n_mel", filters.n_mel) ||
+                !whisper_gguf_get_i32(gguf->ctx, "whisper.mel_filters.n_fft", filters.n_fft)) {
+                return false;
+            }
+
+            size_t n = 0;
+            const float * data = (const float *) whisper_gguf_get_arr(gguf->ctx, "whisper.mel_filters", GGUF_TYPE_FLOAT32, n);
+            if (data == nullptr || n != (size_t) filters.n_mel*filters.n_fft) {
+                WHISPER_LOG_ERROR("%s: invalid model file (bad mel filters)\n", __func__);
+                return false;
+            }
+
+            filters.data.assign(data, data + n);
+        } else {
+            read_safe(loader, filters.n_mel);
+            read_safe(loader, filters.n_fft);
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+            filters.data.resize(filters.n_mel * filters.n_fft);
+            loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+            BYTESWAP_FILTERS(filters);
+        }
     }
 
     // load vocab
     {
         int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
-
-        //if (n_vocab != model.hparams.n_vocab) {
-        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-        //    return false;
-        //}
 
         std::string word;
-        std::vector<char> tmp;
 
-        tmp.reserve(128);
+        if (gguf) {
+            // the tokens are arbitrary bytes (e.g. "\0"), so they are stored as their lengths and their concatenated
+            // bytes instead of GGUF strings
+            size_t n_len   = 0;
+            size_t n_bytes = 0;
 
-        for (int i = 0; i < n_vocab; i++) {
-            uint32_t len;
-            read_safe(loader, len);
+            const uint32_t * lens  = (const uint32_t *) whisper_gguf_get_arr(gguf->ctx, "whisper.vocab.token_lengths", GGUF_TYPE_UINT32, n_len);
+            const char     * bytes = (const char     *) whisper_gguf_get_arr(gguf->ctx, "whisper.vocab.token_bytes",   GGUF_TYPE_UINT8,  n_bytes);
+            if (lens == nullptr || bytes == nullptr) {
+                return false;
+            }
 
-            if (len > 0) {
-                tmp.resize(len);
-                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
+            n_vocab = n_len;
+
+            size_t offs = 0;
+            for (int i = 0; i < n_vocab; i++) {
+                if (offs + lens[i] > n_bytes) {
+                    WHISPER_LOG_ERROR("%s: invalid model file (bad vocab)\n", __func__);
+                    return false;
+                }
+
+                word.assign(bytes + offs, lens[i]);
+                offs += lens[i];
+
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
             }
+        } else {
+            read_safe(loader, n_vocab);
+
+            //if (n_vocab != model.hparams.n_vocab) {
+            //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
+            //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
+            //    return false;
+            //}
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            std::vector<char> tmp;
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+            tmp.reserve(128);
+
+            for (int i = 0; i < n_vocab; i++) {
+                uint32_t len;
+                read_safe(loader, len);
+
+                if (len > 0) {
+                    tmp.resize(len);
+                    loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                    word.assign(&tmp[0], tmp.size());
+                } else {
+                    // seems like we have an empty-string token in multi-language models (i = 50256)
+                    //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
+                    word = "";
+                }
+
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
+
+                //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+            }
         }
 
         vocab.n_vocab = model.hparams.n_vocab;
@@ -1685,6 +2564,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
 
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
+
+        whisper_vocab_trie_build(vocab.trie, vocab.token_to_id);
+
+        whisper_grammar_trie_build(wctx.grammar_trie, vocab);
     }
 
     const ggml_type wtype = wctx.wtype;
@@ -1858,99 +2741,395 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         ggml_free(ctx);
     }
 
-    // allocate tensors in the backend buffers
-    for (auto & p : ctx_map) {
-        ggml_backend_buffer_type_t buft = p.first;
-        ggml_context * ctx = p.second;
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
-        if (buf) {
-            model.buffers.emplace_back(buf);
-
-            size_t size_main = ggml_backend_buffer_get_size(buf);
-            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
-        }
-    }
+    // with a mapped model file, the CPU weights that are aligned in the file use its pages in place instead of a copy
+    // the pages are read on first use and are shared through the page cache by all the processes that map the file
+    ggml_backend_buffer_t buf_mapped = nullptr;
 
-    // load weights
-    {
-        size_t total_size = 0;
+    if (model.mapping != nullptr && ctx_map.count(ggml_backend_cpu_buffer_type()) > 0) {
+        const auto & mapping = *model.mapping;
 
-        model.n_loaded = 0;
+        std::set<const ggml_tensor *> tensors_cpu;
 
-        std::vector<char> read_buf;
+        ggml_context * ctx_cpu = ctx_map.at(ggml_backend_cpu_buffer_type());
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx_cpu); t != nullptr; t = ggml_get_next_tensor(ctx_cpu, t)) {
+            tensors_cpu.insert(t);
+        }
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+        size_t n_mapped    = 0;
+        size_t size_mapped = 0;
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+        auto map_tensor = [&](ggml_tensor * tensor, size_t offs) {
+            // the natural alignment of the elements or blocks of the type
+            const size_t align = ggml_type_size(tensor->type) % 4 == 0 ? 4 : 2;
 
-            if (loader->eof(loader->context)) {
-                break;
+            if (tensors_cpu.count(tensor) == 0 || offs % align != 0) {
+                return;
             }
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
+            if (buf_mapped == nullptr) {
+                buf_mapped = ggml_backend_cpu_buffer_from_ptr(mapping.addr, mapping.size);
+                model.buffers.emplace_back(buf_mapped);
             }
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+            ggml_backend_tensor_alloc(buf_mapped, tensor, (char *) mapping.addr + offs);
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
-            }
+            n_mapped    += 1;
+            size_mapped += ggml_nbytes(tensor);
+        };
 
-            auto tensor = model.tensors[name.data()];
+        if (gguf) {
+            // the index gives the offsets of the tensor data directly - the data section is aligned, so all the
+            // tensors can be mapped
+            const size_t offs_data = gguf_get_data_offset(gguf->ctx);
 
-            if (ggml_nelements(tensor) != nelements) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
-                return false;
-            }
+            for (const auto & it : model.tensors) {
+                const int64_t id = gguf_find_tensor(gguf->ctx, it.first.c_str());
+                if (id < 0 || gguf_get_tensor_type(gguf->ctx, id) != it.second->type || gguf_get_tensor_size(gguf->ctx, id) != ggml_nbytes(it.second)) {
+                    continue; // reported when the weights are loaded below
+                }
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
-                return false;
+                const size_t offs = offs_data + gguf_get_tensor_offset(gguf->ctx, id);
+                if (offs + ggml_nbytes(it.second) <= mapping.size) {
+                    map_tensor(it.second, offs);
+                }
             }
+        } else {
+            // walk the tensor headers - they are validated when the weights are loaded below
+            const char * data = (const char *) mapping.addr;
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
+            size_t pos = mapping.pos;
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
-            }
+            while (pos + 3*sizeof(int32_t) <= mapping.size) {
+                int32_t n_dims;
+                int32_t length;
+                int32_t ttype;
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+                memcpy(&n_dims, data + pos,                     sizeof(int32_t));
+                memcpy(&length, data + pos +   sizeof(int32_t), sizeof(int32_t));
+                memcpy(&ttype,  data + pos + 2*sizeof(int32_t), sizeof(int32_t));
+
+                pos += 3*sizeof(int32_t);
+
+                if (n_dims < 1 || n_dims > 4 || length <= 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT ||
+                    ggml_blck_size(ggml_type(ttype)) == 0 || pos + n_dims*sizeof(int32_t) + length > mapping.size) {
+                    break;
+                }
+
+                int64_t nelements = 1;
+                for (int i = 0; i < n_dims; ++i) {
+                    int32_t ne;
+                    memcpy(&ne, data + pos + i*sizeof(int32_t), sizeof(int32_t));
+                    nelements *= ne;
+                }
+
+                pos += n_dims*sizeof(int32_t);
+
+                const auto it = model.tensors.find(std::string(data + pos, length));
+                if (it == model.tensors.end()) {
+                    break;
+                }
+
+                pos += length;
+
+                ggml_tensor * tensor = it->second;
+
+                // the size in the file, the converted tensors are not mapped
+                const size_t nbytes = nelements*ggml_type_size(ggml_type(ttype))/ggml_blck_size(ggml_type(ttype));
+                if (pos + nbytes > mapping.size) {
+                    break;
+                }
+
+                if (ttype == tensor->type) {
+                    map_tensor(tensor, pos);
+                }
+
+                pos += nbytes;
+            }
+        }
+
+        if (buf_mapped) {
+            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB (%zu of %zu tensors)\n", __func__,
+                    ggml_backend_buffer_name(buf_mapped), size_mapped / 1e6, n_mapped, model.tensors.size());
+        }
+    }
+
+    // allocate tensors in the backend buffers
+    for (auto & p : ctx_map) {
+        ggml_backend_buffer_type_t buft = p.first;
+        ggml_context * ctx = p.second;
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        if (buf) {
+            model.buffers.emplace_back(buf);
+
+            size_t size_main = ggml_backend_buffer_get_size(buf);
+            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
+        }
+    }
+
+    // load weights
+    {
+        size_t total_size = 0;
+
+        model.n_loaded = 0;
+
+        std::vector<char> read_buf;
+
+        int64_t t_convert_us = 0;
+
+        const int n_threads_load = wctx.params.n_threads_load > 0 ? wctx.params.n_threads_load : (int) std::thread::hardware_concurrency();
+
+        whisper_cache_writer cache;
+
+        const char * path_cache = target ? target->path.c_str() : nullptr;
+
+        if (path_cache != nullptr && !whisper_cache_writer_init(cache, wctx, *target)) {
+            WHISPER_LOG_WARN("%s: failed to create '%s' - not saving the converted model\n", __func__, cache.path_tmp.c_str());
+            path_cache = nullptr;
+        }
+
+        // the tensors to convert, see whisper_convert_weights()
+        // with a mapped file they are all converted at the end, otherwise their sources are copied and the queue is
+        // converted whenever the copies reach max_convert_size
+        std::vector<whisper_convert_job> convert_jobs;
+
+        size_t convert_size = 0;
+
+        const size_t max_convert_size = 512u*1024*1024;
+
+        auto convert = [&]() {
+            if (convert_jobs.empty()) {
+                return;
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+
+            whisper_convert_weights(convert_jobs, n_threads_load);
+
+            for (const auto & job : convert_jobs) {
+                if (job.dst != job.tensor->data) {
+                    ggml_backend_tensor_set(job.tensor, job.dst, 0, ggml_nbytes(job.tensor));
+                }
+
+                if (path_cache) {
+                    whisper_cache_writer_write(cache, job.tensor, job.dst);
+                }
+            }
+
+            t_convert_us += ggml_time_us() - t_start_us;
+
+            convert_jobs.clear();
+            convert_size = 0;
+        };
+
+        // the F32/F16 weights in the file may differ in type from the tensor - see whisper_context_params.type_w
+        auto read_tensor = [&](ggml_tensor * tensor, ggml_type type_src) {
+            const void * data = tensor->data; // as stored in the tensor, for the cache
+
+            if (type_src != tensor->type) {
+                const size_t size_src = ggml_row_size(type_src, tensor->ne[0])*ggml_nrows(tensor);
+
+                convert_jobs.emplace_back();
+
+                auto & job = convert_jobs.back();
+
+                job.tensor   = tensor;
+                job.type_src = type_src;
+
+                // with a mapped file, the workers read the pages of the source directly
+                if (model.mapping && model.mapping->pos + size_src <= model.mapping->size) {
+                    job.src = (const char *) model.mapping->addr + model.mapping->pos;
+                    model.mapping->pos += size_src;
+                } else {
+                    job.buf_src.resize(size_src);
+                    loader->read(loader->context, job.buf_src.data(), job.buf_src.size());
+                    job.src = job.buf_src.data();
+                }
+
+                job.dst = tensor->data;
+                if (!ggml_backend_buffer_is_host(tensor->buffer)) {
+                    job.buf_dst.resize(ggml_nbytes(tensor));
+                    job.dst = job.buf_dst.data();
+                }
+
+                convert_size += job.buf_src.size() + job.buf_dst.size();
+
+                model.n_converted++;
+
+                // written to the cache once converted
+                data = nullptr;
+            } else if (buf_mapped != nullptr && tensor->buffer == buf_mapped) {
+                // the tensor points into the mapped file, see above
+                model.mapping->pos += ggml_nbytes(tensor);
+            } else if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                // for the CPU and Metal backend, we can read directly into the tensor
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            } else {
+                // read into a temporary buffer first, then copy to device memory
+                read_buf.resize(ggml_nbytes(tensor));
 
                 loader->read(loader->context, read_buf.data(), read_buf.size());
 
                 ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+
+                data = read_buf.data();
+            }
+
+            if (path_cache && data) {
+                whisper_cache_writer_write(cache, tensor, data);
             }
 
             total_size += ggml_nbytes(tensor);
             model.n_loaded++;
+
+            if (convert_size >= max_convert_size) {
+                convert();
+            }
+        };
+
+        if (gguf) {
+            // the loader is past the magic - skip to the data of each tensor, in the order of the index
+            const size_t offs_data = gguf_get_data_offset(gguf->ctx);
+
+            size_t pos = sizeof(uint32_t);
+
+            auto skip = [&](size_t n) {
+                if (model.mapping) {
+                    model.mapping->pos += n;
+                } else {
+                    read_buf.resize(n);
+                    loader->read(loader->context, read_buf.data(), n);
+                }
+                pos += n;
+            };
+
+            for (int64_t i = 0; i < gguf_get_n_tensors(gguf->ctx); ++i) {
+                const char * name = gguf_get_tensor_name(gguf->ctx, i);
+
+                if (model.tensors.find(name) == model.tensors.end()) {
+                    WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name);
+                    return false;
+                }
+
+                auto tensor = model.tensors[name];
+
+                const ggml_tensor * meta = ggml_get_tensor(gguf->meta, name);
+
+                if (!ggml_are_same_shape(tensor, meta)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                            __func__, name, (int) meta->ne[0], (int) meta->ne[1], (int) meta->ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
+
+                if (meta->type != tensor->type && meta->type != GGML_TYPE_F32 && meta->type != GGML_TYPE_F16) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong type in model file: got %s, expected %s\n",
+                            __func__, name, ggml_type_name(meta->type), ggml_type_name(tensor->type));
+                    return false;
+                }
+
+                const size_t offs   = offs_data + gguf_get_tensor_offset(gguf->ctx, i);
+                const size_t nbytes = gguf_get_tensor_size(gguf->ctx, i);
+
+                // the loader reads the file as a stream, so the data has to follow the order of the index
+                if (offs < pos) {
+                    WHISPER_LOG_ERROR("%s: the data of tensor '%s' is not in the order of the index in model file\n", __func__, name);
+                    return false;
+                }
+
+                // the index is parsed without the data, so a truncated file is detected only here
+                if (model.mapping && offs + nbytes > model.mapping->size) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' is past the end of the model file (truncated?)\n", __func__, name);
+                    return false;
+                }
+
+                skip(offs - pos);
+                read_tensor(tensor, meta->type);
+                pos = offs + nbytes;
+            }
+
+            // reading past the end of a file stream sets eof
+            if (!model.mapping && loader->eof(loader->context)) {
+                WHISPER_LOG_ERROR("%s: unexpected end of the model file (truncated?)\n", __func__);
+                return false;
+            }
+        } else {
+            while (true) {
+                int32_t n_dims;
+                int32_t length;
+                int32_t ttype;
+
+                read_safe(loader, n_dims);
+                read_safe(loader, length);
+                read_safe(loader, ttype);
+
+                if (loader->eof(loader->context)) {
+                    break;
+                }
+
+                int32_t nelements = 1;
+                int32_t ne[4] = { 1, 1, 1, 1 };
+                for (int i = 0; i < n_dims; ++i) {
+                    read_safe(loader, ne[i]);
+                    nelements *= ne[i];
+                }
+
+                std::string name;
+                std::vector<char> tmp(length); // create a buffer
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                name.assign(&tmp[0], tmp.size());
+
+                if (model.tensors.find(name) == model.tensors.end()) {
+                    WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                    return false;
+                }
+
+                auto tensor = model.tensors[name.data()];
+
+                if (ggml_nelements(tensor) != nelements) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                    WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                            __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
+
+                if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                            __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                    return false;
+                }
+
+                const size_t bpe = ggml_type_size(ggml_type(ttype));
+
+                if (ttype != tensor->type && (ttype == GGML_TYPE_F32 || ttype == GGML_TYPE_F16)) {
+                    // converted while reading
+                } else if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                    return false;
+                }
+
+                read_tensor(tensor, ggml_type(ttype));
+            }
         }
 
+        convert();
+
         WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
 
+        if (model.n_converted > 0) {
+            WHISPER_LOG_INFO("%s: converted %d tensors in %.2f ms (%d threads)\n", __func__,
+                    model.n_converted, t_convert_us/1000.0, n_threads_load);
+        }
+
+        // a model that needed no conversion is not worth a copy
+        if (path_cache && model.n_converted > 0 && model.n_loaded == (int) model.tensors.size()) {
+            if (whisper_cache_writer_finish(cache)) {
+                WHISPER_LOG_INFO("%s: saved the converted model to '%s'\n", __func__, path_cache);
+            } else {
+                WHISPER_LOG_WARN("%s: failed to save the converted model to '%s'\n", __func__, path_cache);
+            }
+        }
+
         if (model.n_loaded == 0) {
             WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
@@ -1986,142 +3165,524 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
-static struct ggml_cgraph * whisper_build_graph_conv(
-        whisper_context & wctx,
-          whisper_state & wstate) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+// copy the 2*n_ctx mel frames starting at mel_offset into dst (n_mel rows), zero-padding past the end of the spectrogram
+static void whisper_mel_window(const whisper_mel & mel_inp, int mel_offset, int n_ctx, float * dst) {
+    memset(dst, 0, sizeof(float)*2*n_ctx*mel_inp.n_mel);
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
+    const int i0 = std::min(mel_offset,           mel_inp.n_len);
+    const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
 
-    const int n_mels = hparams.n_mels;
+    for (int j = 0; j < mel_inp.n_mel; ++j) {
+        for (int i = i0; i < i1; ++i) {
+            dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+        }
+    }
+}
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+// fused conv1d (kernel size 3, padding 1) + bias + GELU for the encoder stem on the CPU
+//
+// the output channels are split between the threads in blocks of WHISPER_CONV_BLOCK_OC channels. each thread
+// converts the weights of up to WHISPER_CONV_CHUNK blocks to F32 and then walks over the output frames: the input
+// frames needed by WHISPER_CONV_BLOCK_T output frames are gathered into a small per-thread tile, which is multiplied
+// with the weights of each block in 4 x 8 register tiles. the working set is a few MB per thread at most, so unlike
+// ggml_conv_1d_ph there is no im2col buffer in the compute allocation
+//
+//   y:   [OL, OC]     (F32), OL = (L + s0 - 1)/s0
+//   w:   [3, IC, OC]  (F16 or F32)
+//   x:   [L, IC]      (F32)
+//
+// the op is in-place: y holds the broadcast bias on input and gelu(conv1d(x, w) + b) on output (see whisper_build_conv_gelu)
 
-    struct ggml_context * ctx0 = ggml_init(params);
+#define WHISPER_CONV_BLOCK_OC 16
+#define WHISPER_CONV_BLOCK_T  32
+#define WHISPER_CONV_CHUNK    8
 
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
+// widest conv stem (n_audio_state) for which the fused kernel beats im2col + mul_mat, see whisper_bench_conv_stem()
+// above it the GEMM in mul_mat wins, e.g. 768: 447 -> 533 ms, 1280: 1184 -> 1290 ms for a 30 s window on 1 thread
+#define WHISPER_CONV_DIRECT_MAX_STATE 512
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    ggml_set_name(mel, "mel");
-    ggml_set_input(mel);
+// GELU, computed like ggml_gelu on the CPU: the input is rounded to F16 and looked up in a precomputed table
+static void whisper_gelu_f16(int n, float * y, const float * x) {
+    static const std::vector<float> table = []() {
+        std::vector<float> res(1 << 16);
+        for (int i = 0; i < (1 << 16); ++i) {
+            uint16_t u = i;
+            ggml_fp16_t h;
+            memcpy(&h, &u, sizeof(h));
 
-    struct ggml_tensor * cur = nullptr;
+            const float v = ggml_fp16_to_fp32(h);
+            res[i] = ggml_fp16_to_fp32(ggml_fp32_to_fp16(0.5f*v*(1.0f + tanhf(0.79788456080286535587989211986876f*v*(1.0f + 0.044715f*v*v)))));
+        }
+        return res;
+    }();
 
-    if (!whisper_encode_external(wstate)) {
-        // convolution + gelu
-        {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_1_b);
+    ggml_fp16_t h[WHISPER_CONV_BLOCK_T];
 
-            cur = ggml_gelu(ctx0, cur);
+    for (int i0 = 0; i0 < n; i0 += WHISPER_CONV_BLOCK_T) {
+        const int ni = std::min(WHISPER_CONV_BLOCK_T, n - i0);
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+        ggml_fp32_to_fp16_row(x + i0, h, ni);
 
-            cur = ggml_gelu(ctx0, cur);
+        for (int i = 0; i < ni; ++i) {
+            const float v = x[i0 + i];
+
+            uint16_t u;
+            memcpy(&u, &h[i], sizeof(u));
+
+            y[i0 + i] = v <= -10.0f ? 0.0f : v >= 10.0f ? v : table[u];
         }
+    }
+}
 
-        ggml_set_name(cur, "embd_conv");
-        wstate.embd_conv = cur;
-    } else {
-        ggml_build_forward_expand(gf, mel);
+static void whisper_conv1d_gelu(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * w, const struct ggml_tensor * x, int ith, int nth, void * userdata) {
+    GGML_UNUSED(a);
 
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
-        ggml_set_input(cur); // the external encoder will write into this tensor
+    const auto & params = *(const whisper_conv1d_gelu_params *) userdata;
 
-        ggml_set_name(cur, "embd_enc");
-        wstate.embd_enc = cur;
-    }
+    const int s0 = params.s0;
 
-    ggml_set_output(cur);
+    const int64_t L  = x->ne[0];
+    const int64_t IC = x->ne[1];
+    const int64_t OL = dst->ne[0];
+    const int64_t OC = dst->ne[1];
 
-    ggml_build_forward_expand(gf, cur);
+    // reduction length
+    const int64_t K = 3*IC;
 
-    ggml_free(ctx0);
+    WHISPER_ASSERT(x->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    WHISPER_ASSERT(w->type == GGML_TYPE_F32 || w->type == GGML_TYPE_F16);
+    WHISPER_ASSERT(w->ne[0] == 3 && w->ne[1] == IC && w->ne[2] == OC);
+    WHISPER_ASSERT(ggml_is_contiguous(x) && ggml_is_contiguous(w) && ggml_is_contiguous(dst));
 
-    return gf;
-}
+    constexpr int BOC = WHISPER_CONV_BLOCK_OC;
+    constexpr int BT  = WHISPER_CONV_BLOCK_T;
 
-static struct ggml_cgraph * whisper_build_graph_encoder(
-        whisper_context & wctx,
-          whisper_state & wstate) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+    // register tile
+    constexpr int ROC = 4;
+    constexpr int RT  = 8;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+    static_assert(BOC % ROC == 0 && BT % RT == 0, "invalid conv block size");
 
-    const int n_state_head = n_state/n_head;
+    const int64_t n_blocks = (OC + BOC - 1)/BOC;
 
-    auto & kv_pad = wstate.kv_pad;
+    const int64_t ib0 = (n_blocks*ith)/nth;
+    const int64_t ib1 = (n_blocks*(ith + 1))/nth;
 
-    WHISPER_ASSERT(!!kv_pad.buffer);
+    if (ib0 >= ib1) {
+        return;
+    }
 
-    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
+    const float * x_data = (const float *) x->data;
+          float * y_data = (float *) dst->data;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+    std::vector<float> wrow(K);
+    std::vector<float> wb(WHISPER_CONV_CHUNK*K*BOC); // [block][K][BOC]
+    std::vector<float> xt(K*BT);                     // [K][BT]
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    for (int64_t ic0 = ib0; ic0 < ib1; ic0 += WHISPER_CONV_CHUNK) {
+        const int nc = (int) std::min<int64_t>(WHISPER_CONV_CHUNK, ib1 - ic0);
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+        std::fill(wb.begin(), wb.end(), 0.0f);
 
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+        for (int ib = 0; ib < nc; ++ib) {
+            const int64_t o0 = (ic0 + ib)*BOC;
+            const int     no = (int) std::min<int64_t>(BOC, OC - o0);
 
-    const float KQscale = 1.0f/sqrtf(float(n_state_head));
+            float * wbb = wb.data() + ib*K*BOC;
 
-    // ===================================================================
-    // NOTE: experimenting with partial evaluation of the encoder (ignore)
-    //static int iter = -1;
-    //const int n_iter = 1500/n_ctx;
+            for (int j = 0; j < no; ++j) {
+                const char * src = (const char *) w->data + (o0 + j)*w->nb[2];
+                if (w->type == GGML_TYPE_F16) {
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, wrow.data(), K);
+                } else {
+                    memcpy(wrow.data(), src, K*sizeof(float));
+                }
 
-    //iter = (iter + 1) % n_iter;
+                for (int64_t k = 0; k < K; ++k) {
+                    wbb[k*BOC + j] = wrow[k];
+                }
+            }
+        }
 
-    //if (iter == 0) {
-    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-    //}
+        for (int64_t t0 = 0; t0 < OL; ) {
+            if (t0 >= params.skip0 && t0 < params.skip1) {
+                t0 = params.skip1;
+                continue;
+            }
 
-    static int iter = 0;
+            // a tile does not run into the skipped frames
+            const int64_t t1 = t0 < params.skip0 ? std::min(OL, params.skip0) : OL;
 
-    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+            const int nt = (int) std::min<int64_t>(BT, t1 - t0);
 
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+            // gather the input tile: xt[3*ic + k][t] = x[ic][(t0 + t)*s0 + k - 1], zero-padded
+            // only the tiles at the edges of the input need the padding
+            const bool interior = t0*s0 >= 1 && (t0 + BT - 1)*s0 + 1 < L;
 
-    // ===================================================================
+            for (int64_t ic = 0; ic < IC; ++ic) {
+                const float * xr = x_data + ic*L;
 
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+                float * x0 = xt.data() + (3*ic + 0)*BT;
+                float * x1 = xt.data() + (3*ic + 1)*BT;
+                float * x2 = xt.data() + (3*ic + 2)*BT;
 
-    struct ggml_tensor * inpL = cur;
+                if (interior && s0 == 1) {
+                    const float * xs = xr + t0 - 1;
+                    for (int t = 0; t < BT; ++t) {
+                        x0[t] = xs[t];
+                        x1[t] = xs[t + 1];
+                        x2[t] = xs[t + 2];
+                    }
+                } else if (interior) {
+                    const float * xs = xr + t0*s0 - 1;
+                    for (int t = 0; t < BT; ++t) {
+                        x0[t] = xs[t*s0];
+                        x1[t] = xs[t*s0 + 1];
+                        x2[t] = xs[t*s0 + 2];
+                    }
+                } else {
+                    for (int t = 0; t < BT; ++t) {
+                        const int64_t p = (t0 + t)*s0;
+                        const bool    v = t < nt;
 
-    for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_encoder[il];
+                        x0[t] = v && p - 1 >= 0 ? xr[p - 1] : 0.0f;
+                        x1[t] = v && p     <  L ? xr[p]     : 0.0f;
+                        x2[t] = v && p + 1 <  L ? xr[p + 1] : 0.0f;
+                    }
+                }
+            }
 
-        // norm
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
+            for (int ib = 0; ib < nc; ++ib) {
+                const int64_t o0 = (ic0 + ib)*BOC;
+                const int     no = (int) std::min<int64_t>(BOC, OC - o0);
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
-        }
+                const float * wbb = wb.data() + ib*K*BOC;
 
-        // self-attention
+                for (int jr = 0; jr < no; jr += ROC) {
+                    for (int tr = 0; tr < nt; tr += RT) {
+                        float acc[ROC][RT] = {};
+
+                        const float * wk = wbb + jr;
+                        const float * xk = xt.data() + tr;
+
+                        for (int64_t k = 0; k < K; ++k) {
+                            for (int j = 0; j < ROC; ++j) {
+                                for (int t = 0; t < RT; ++t) {
+                                    acc[j][t] += wk[j]*xk[t];
+                                }
+                            }
+
+                            wk += BOC;
+                            xk += BT;
+                        }
+
+                        const int nj = std::min(ROC, no - jr);
+                        const int ns = std::min(RT,  nt - tr);
+
+                        for (int j = 0; j < nj; ++j) {
+                            float * y = y_data + (o0 + jr + j)*OL + t0 + tr;
+                            for (int t = 0; t < ns; ++t) {
+                                acc[j][t] += y[t];
+                            }
+
+                            whisper_gelu_f16(ns, y, acc[j]);
+                        }
+                    }
+                }
+            }
+
+            t0 += nt;
+        }
+    }
+}
+
+static whisper_conv1d_gelu_params g_conv1d_gelu_s1 = { 1, 0, 0 };
+static whisper_conv1d_gelu_params g_conv1d_gelu_s2 = { 2, 0, 0 };
+
+// gelu(conv1d(x, w, stride = params->s0, padding = 1) + b) using the fused kernel above
+// the params are read when the graph is computed, so they can be changed between computations of the same graph
+static struct ggml_tensor * whisper_build_conv_gelu(
+         struct ggml_context * ctx0,
+          struct ggml_tensor * w,
+          struct ggml_tensor * b,
+          struct ggml_tensor * x,
+    whisper_conv1d_gelu_params * params) {
+    const int s0 = params->s0;
+
+    const int64_t OL = (x->ne[0] + s0 - 1)/s0;
+    const int64_t OC = w->ne[2];
+
+    // ggml_repeat only takes the shape of its second argument, which is therefore never allocated
+    struct ggml_tensor * cur = ggml_repeat(ctx0, b, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, OL, OC));
+
+    return ggml_map_custom3_inplace(ctx0, cur, w, x, whisper_conv1d_gelu, GGML_N_TASKS_MAX, params);
+}
+
+// the fused kernel runs on the CPU backend, so it is used only when the state has no GPU and the conv weights are in host memory
+// it is also slower than im2col for the wider models, see WHISPER_CONV_DIRECT_MAX_STATE
+static bool whisper_conv_direct_supported(const whisper_model & model, const std::vector<ggml_backend_t> & backends) {
+    if (model.hparams.n_audio_state > WHISPER_CONV_DIRECT_MAX_STATE) {
+        return false;
+    }
+
+    for (const auto & backend : backends) {
+        ggml_backend_dev_t dev = ggml_backend_get_device(backend);
+        if (dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) {
+            return false;
+        }
+    }
+
+    for (const auto * w : { model.e_conv_1_w, model.e_conv_2_w }) {
+        if (w->type != GGML_TYPE_F16 && w->type != GGML_TYPE_F32) {
+            return false;
+        }
+        if (!w->buffer || !ggml_backend_buffer_is_host(w->buffer)) {
+            return false;
+        }
+    }
+
+    for (const auto * b : { model.e_conv_1_b, model.e_conv_2_b }) {
+        if (b->type != GGML_TYPE_F32 || !b->buffer || !ggml_backend_buffer_is_host(b->buffer)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// convolution + gelu
+// with the fused kernel, the frames skipped by wstate.conv_params are left for the caller if incremental is true
+static struct ggml_tensor * whisper_build_conv_stem(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    struct ggml_context * ctx0,
+     struct ggml_tensor * mel,
+                   bool   incremental) {
+    const auto & model = wctx.model;
+
+    struct ggml_tensor * cur = nullptr;
+
+    if (wstate.conv_direct) {
+        cur = whisper_build_conv_gelu(ctx0, model.e_conv_1_w, model.e_conv_1_b, mel, incremental ? &wstate.conv_params[0] : &g_conv1d_gelu_s1);
+        cur = whisper_build_conv_gelu(ctx0, model.e_conv_2_w, model.e_conv_2_b, cur, incremental ? &wstate.conv_params[1] : &g_conv1d_gelu_s2);
+    } else {
+        cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
+        cur = ggml_add(ctx0, cur, model.e_conv_1_b);
+
+        cur = ggml_gelu(ctx0, cur);
+
+        cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+        cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+
+        cur = ggml_gelu(ctx0, cur);
+    }
+
+    return cur;
+}
+
+// hash of each frame of a [n_mels][n_len] mel window
+static void whisper_mel_frame_hash(const float * mel, int n_len, int n_mels, std::vector<uint64_t> & res) {
+    res.assign(n_len, 14695981039346656037ull);
+
+    for (int m = 0; m < n_mels; ++m) {
+        const float * row = mel + (int64_t) m*n_len;
+        for (int f = 0; f < n_len; ++f) {
+            uint32_t u;
+            memcpy(&u, &row[f], sizeof(u));
+
+            res[f] = (res[f] ^ u)*1099511628211ull;
+        }
+    }
+}
+
+// find the conv stem outputs of the new window that can be copied from the last encoded window
+// the windows are matched by content, so this works both for sliding windows over the same spectrogram and for
+// streaming, where the spectrogram is recomputed for every new chunk of audio
+static void whisper_conv_cache_plan(whisper_conv_cache & cache, const std::vector<float> & mel, int n_ctx, int n_mels, std::vector<uint64_t> & hash) {
+    cache.skip0 = 0;
+    cache.skip1 = 0;
+    cache.shift = 0;
+
+    const int n_len = 2*n_ctx;
+
+    whisper_mel_frame_hash(mel.data(), n_len, n_mels, hash);
+
+    if (cache.n_ctx != n_ctx) {
+        return;
+    }
+
+    // position of the frames that occur only once in the last window
+    std::unordered_map<uint64_t, int> pos;
+    pos.reserve(n_len);
+
+    for (int f = 0; f < n_len; ++f) {
+        auto res = pos.emplace(cache.hash[f], f);
+        if (!res.second) {
+            res.first->second = -1;
+        }
+    }
+
+    // the shift of the window is the offset on which most of these frames agree
+    // it has to be even, because the second conv layer has a stride of 2
+    std::map<int, int> votes;
+
+    for (int f = 0; f < n_len; ++f) {
+        const auto it = pos.find(hash[f]);
+        if (it != pos.end() && it->second >= f && (it->second - f) % 2 == 0) {
+            votes[it->second - f]++;
+        }
+    }
+
+    int d = -1;
+    int n_best = 0;
+
+    for (const auto & v : votes) {
+        if (v.second > n_best) {
+            d = v.first;
+            n_best = v.second;
+        }
+    }
+
+    if (d < 0) {
+        return;
+    }
+
+    // the mel frames that are identical in both windows
+    std::vector<bool> match(n_len, false);
+
+    for (int f = 0; f + d < n_len; ++f) {
+        if (hash[f] != cache.hash[f + d]) {
+            continue;
+        }
+
+        bool eq = true;
+        for (int m = 0; m < n_mels && eq; ++m) {
+            eq = mel[(int64_t) m*n_len + f] == cache.mel[(int64_t) m*n_len + f + d];
+        }
+
+        match[f] = eq;
+    }
+
+    // output frame u depends on the mel frames [2u - 2, 2u + 2], which must not touch the padding in either window
+    // the longest run of such frames is reused
+    int run0 = -1;
+
+    for (int u = 0; u <= n_ctx; ++u) {
+        bool ok = u < n_ctx && 2*u - 2 >= 0 && 2*u + 2 + d < n_len;
+        for (int f = 2*u - 2; ok && f <= 2*u + 2; ++f) {
+            ok = match[f];
+        }
+
+        if (ok) {
+            if (run0 < 0) {
+                run0 = u;
+            }
+        } else if (run0 >= 0) {
+            if (u - run0 > cache.skip1 - cache.skip0) {
+                cache.skip0 = run0;
+                cache.skip1 = u;
+            }
+            run0 = -1;
+        }
+    }
+
+    cache.shift = d/2;
+}
+
+static struct ggml_cgraph * whisper_build_graph_conv(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
+
+    const int n_mels = hparams.n_mels;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
+
+    struct ggml_tensor * cur = nullptr;
+
+    if (!whisper_encode_external(wstate)) {
+        cur = whisper_build_conv_stem(wctx, wstate, ctx0, mel, true);
+
+        ggml_set_name(cur, "embd_conv");
+        wstate.embd_conv = cur;
+    } else {
+        ggml_build_forward_expand(gf, mel);
+
+        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+        ggml_set_input(cur); // the external encoder will write into this tensor
+
+        ggml_set_name(cur, "embd_enc");
+        wstate.embd_enc = cur;
+    }
+
+    ggml_set_output(cur);
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// the transformer blocks of the encoder
+// inpL holds n_batch windows of n_ctx positions each, stacked along the second dimension
+// the windows only interact in the self-attention, which is computed separately for each of them
+// the flash-attention path uses the per-state padded KV buffer, so it is used only for a single window
+static struct ggml_tensor * whisper_build_encoder_blocks(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    struct ggml_context * ctx0,
+     struct ggml_cgraph * gf,
+     struct ggml_tensor * inpL,
+                    int   n_ctx,
+                    int   n_batch) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int n_state_head = n_state/n_head;
+
+    auto & kv_pad = wstate.kv_pad;
+
+    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
+
+    const float KQscale = 1.0f/sqrtf(float(n_state_head));
+
+    struct ggml_tensor * cur = nullptr;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_encoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
         {
             struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.attn_q_w,
@@ -2148,25 +3709,25 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_ctx),
+                        ggml_reshape_4d(ctx0, Qcur, n_state_head, n_head, n_ctx, n_batch),
                         0, 2, 1, 3);
 
-            if (wctx.params.flash_attn) {
+            if (wctx.params.flash_attn && n_batch == 1) {
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
 
                 struct ggml_tensor * K =
                     ggml_view_3d(ctx0, kv_pad.k,
                             n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.k)*n_state,
-                            ggml_element_size(kv_pad.k)*n_state_head,
+                            ggml_row_size(kv_pad.k->type, n_state),
+                            ggml_row_size(kv_pad.k->type, n_state_head),
                             0);
 
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_pad.v,
                             n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.v)*n_state,
-                            ggml_element_size(kv_pad.v)*n_state_head,
+                            ggml_row_size(kv_pad.v->type, n_state),
+                            ggml_row_size(kv_pad.v->type, n_state_head),
                             0);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
@@ -2176,7 +3737,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cast(ctx0,
-                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
+                                ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_batch),
                                 wctx.itype),
                             0, 2, 1, 3);
 
@@ -2188,9 +3749,9 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 struct ggml_tensor * V =
                     ggml_cast(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state_head, n_head, n_ctx),
+                                    n_state_head, n_head, n_ctx, n_batch),
                                 1, 2, 0, 3),
                             wctx.itype);
 
@@ -2198,7 +3759,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
                 struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx);
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx*n_batch);
             }
         }
 
@@ -2261,6 +3822,58 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
+    return cur;
+}
+
+static struct ggml_cgraph * whisper_build_graph_encoder(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    WHISPER_ASSERT(!!wstate.kv_pad.buffer);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+
+    // ===================================================================
+    // NOTE: experimenting with partial evaluation of the encoder (ignore)
+    //static int iter = -1;
+    //const int n_iter = 1500/n_ctx;
+
+    //iter = (iter + 1) % n_iter;
+
+    //if (iter == 0) {
+    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+    //}
+
+    static int iter = 0;
+
+    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+
+    // ===================================================================
+
+    // original:
+    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+    cur = whisper_build_encoder_blocks(wctx, wstate, ctx0, gf, cur, n_ctx, 1);
+
     ggml_build_forward_expand(gf, cur);
 
     wstate.embd_enc = cur;
@@ -2281,14 +3894,20 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     return gf;
 }
 
-// pre-compute cross-attention memory
-static struct ggml_cgraph * whisper_build_graph_cross(
+// compute the cross-attention K and V of the encoder output and store them in the KV caches of the states
+// cur holds the outputs for n_batch windows of n_ctx positions each, stacked along the second dimension,
+// the b-th window is stored in the KV cache of states[b]
+static void whisper_build_cross_kv(
         whisper_context & wctx,
-          whisper_state & wstate) {
+          whisper_state ** states,
+    struct ggml_context * ctx0,
+     struct ggml_cgraph * gf,
+     struct ggml_tensor * cur,
+                    int   n_ctx,
+                    int   n_batch) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
 
@@ -2296,18 +3915,6 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
-
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
-
     const float  Kscale = pow(float(n_state_head), -0.25);
 
     for (int il = 0; il < model.hparams.n_text_layer; ++il) {
@@ -2327,29 +3934,62 @@ static struct ggml_cgraph * whisper_build_graph_cross(
                     Vcross,
                     layer.cross_attn_v_b);
 
-        struct ggml_tensor * k;
-        struct ggml_tensor * v;
+        for (int ib = 0; ib < n_batch; ++ib) {
+            auto & kv_cross = states[ib]->kv_cross;
 
-        if (wctx.params.flash_attn) {
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+            struct ggml_tensor * Kb = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], ib*n_ctx*Kcross->nb[1]);
+            struct ggml_tensor * Vb = ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], ib*n_ctx*Vcross->nb[1]);
 
-            v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
-        } else {
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            struct ggml_tensor * k;
+            struct ggml_tensor * v;
 
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+            if (wctx.params.flash_attn) {
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx_pad));
 
-            v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
-        }
+                v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx,
+                        ggml_row_size(kv_cross.v->type, n_state)*(il*n_ctx_pad));
+            } else {
+                Vb = ggml_transpose(ctx0, Vb);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx));
+
+                v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kb, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vb, v));
+        }
     }
+}
+
+// pre-compute cross-attention memory
+static struct ggml_cgraph * whisper_build_graph_cross(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+
+    whisper_state * states[] = { &wstate };
+
+    whisper_build_cross_kv(wctx, states, ctx0, gf, cur, n_ctx, 1);
 
     //ggml_graph_print(gf);
 
@@ -2358,6 +3998,157 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// conv1d + bias + GELU over a batch of inputs [L, IC, N] -> [OL, OC, N], padding 1
+// ggml_conv_1d() reshapes the [N*OL, OC] result of the matrix multiplication as if it was [OL, OC, N], which is
+// correct only for N == 1, so the result is permuted explicitly here
+// the operands are the same as in ggml_conv_1d(), so each window gets exactly the result of whisper_build_conv_stem()
+static struct ggml_tensor * whisper_build_conv_gelu_batch(
+        struct ggml_context * ctx0,
+         struct ggml_tensor * w,
+         struct ggml_tensor * b,
+         struct ggml_tensor * x,
+                        int   s0) {
+    // [IC*K, OL, N]
+    struct ggml_tensor * im2col = ggml_im2col(ctx0, w, x, s0, 0, w->ne[0]/2, 0, 1, 0, false, GGML_TYPE_F16);
+
+    const int64_t OL = im2col->ne[1];
+    const int64_t N  = im2col->ne[2];
+    const int64_t OC = w->ne[2];
+
+    struct ggml_tensor * cur = ggml_mul_mat(ctx0,
+            ggml_reshape_2d(ctx0, im2col, im2col->ne[0], OL*N),
+            ggml_reshape_2d(ctx0, w, w->ne[0]*w->ne[1], OC));
+
+    // [OL, N, OC] -> [OL, OC, N]
+    cur = ggml_reshape_3d(ctx0, cur, OL, N, OC);
+    cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 0, 2, 1, 3));
+
+    cur = ggml_add(ctx0, cur, b);
+
+    return ggml_gelu(ctx0, cur);
+}
+
+// number of graph nodes needed to encode n_batch windows at once
+static int whisper_encode_batch_n_nodes(const whisper_context & wctx, int n_batch) {
+    return WHISPER_MAX_NODES + n_batch*(8*wctx.model.hparams.n_text_layer + 32);
+}
+
+// encode the mel windows of n_batch states in a single graph
+// the windows are stacked in one [2*n_ctx, n_mels, n_batch] input, so the conv stem runs once over all of them and
+// the transformer blocks and the cross-attention projections run once over the windows concatenated along the
+// sequence dimension
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
+        whisper_context & wctx,
+          whisper_state ** states,
+                    int   n_batch,
+                    int   n_ctx) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_state = hparams.n_audio_state;
+    const int n_mels  = hparams.n_mels;
+
+    auto & sched = states[0]->sched_encode_batch;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ sched.meta.size(),
+        /*.mem_buffer =*/ sched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, whisper_encode_batch_n_nodes(wctx, n_batch), false);
+
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
+
+    // [n_ctx, n_state, n_batch]
+    struct ggml_tensor * cur = nullptr;
+
+    cur = whisper_build_conv_gelu_batch(ctx0, model.e_conv_1_w, model.e_conv_1_b, mel, 1);
+    cur = whisper_build_conv_gelu_batch(ctx0, model.e_conv_2_w, model.e_conv_2_b, cur, 2);
+
+    // [n_state, n_ctx, n_batch]
+    cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 1, 0, 2, 3));
+
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, model.e_pe->nb[1], 0);
+
+    cur = ggml_add(ctx0, cur, e_pe);
+    cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_batch);
+
+    cur = whisper_build_encoder_blocks(wctx, *states[0], ctx0, gf, cur, n_ctx, n_batch);
+
+    // the encoder graphs of the states are allocated before building this graph, see whisper_encode_batch()
+    // embd_enc is the result of the encoder graph of the state - it is written through a view, so that this graph
+    // does not depend on (and recompute) the nodes of that graph
+    for (int ib = 0; ib < n_batch; ++ib) {
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0,
+                    ggml_view_2d(ctx0, cur, cur->ne[0], n_ctx, cur->nb[1], ib*n_ctx*cur->nb[1]),
+                    ggml_view_tensor(ctx0, states[ib]->embd_enc)));
+    }
+
+    whisper_build_cross_kv(wctx, states, ctx0, gf, cur, n_ctx, n_batch);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// build and allocate the conv, encoder and cross graphs of the state for its current audio context size
+// the graphs are rebuilt and reallocated only when the encoder shape changes, see whisper_encoder_graph_cache
+static bool whisper_encoder_graphs_prepare(whisper_context & wctx, whisper_state & wstate) {
+    const int  n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+    const bool flash_attn = wctx.params.flash_attn;
+
+    auto & cache = wstate.enc_graphs;
+
+    if (cache.valid(n_ctx, flash_attn)) {
+        return true;
+    }
+
+    cache = {};
+
+    ggml_backend_sched_reset(wstate.sched_conv.sched);
+    ggml_backend_sched_reset(wstate.sched_cross.sched);
+
+    ggml_cgraph * gf_conv = whisper_build_graph_conv(wctx, wstate);
+
+    if (!ggml_backend_sched_alloc_graph(wstate.sched_conv.sched, gf_conv)) {
+        // should never happen as we pre-allocate the memory
+        return false;
+    }
+
+    ggml_cgraph * gf_encode = nullptr;
+
+    if (!whisper_encode_external(wstate)) {
+        ggml_backend_sched_reset(wstate.sched_encode.sched);
+
+        gf_encode = whisper_build_graph_encoder(wctx, wstate);
+
+        if (!ggml_backend_sched_alloc_graph(wstate.sched_encode.sched, gf_encode)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+    }
+
+    ggml_cgraph * gf_cross = whisper_build_graph_cross(wctx, wstate);
+
+    if (!ggml_backend_sched_alloc_graph(wstate.sched_cross.sched, gf_cross)) {
+        // should never happen as we pre-allocate the memory
+        return false;
+    }
+
+    cache.n_ctx      = n_ctx;
+    cache.flash_attn = flash_attn;
+    cache.gf_conv    = gf_conv;
+    cache.gf_encode  = gf_encode;
+    cache.gf_cross   = gf_cross;
+
+    return true;
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2377,48 +4168,85 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    auto & cache = wstate.enc_graphs;
+
+    // the graphs are allocated only when the encoder shape changes
+    // otherwise we keep the previous allocations and only upload the new mel input
+    if (!whisper_encoder_graphs_prepare(wctx, wstate)) {
+        return false;
+    }
+
     // conv
     {
         auto & sched = wstate.sched_conv.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
-
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+        ggml_cgraph * gf = cache.gf_conv;
 
         struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
 
         // set the input
         {
             const auto & mel_inp = wstate.mel;
-            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
 
             assert(mel->type == GGML_TYPE_F32);
             assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
 
             wstate.inp_mel.resize(ggml_nelements(mel));
 
-            float * dst = wstate.inp_mel.data();
-            memset(dst, 0, ggml_nbytes(mel));
-
-            const int i0 = std::min(mel_offset,           mel_inp.n_len);
-            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
-
-            for (int j = 0; j < mel_inp.n_mel; ++j) {
-                for (int i = i0; i < i1; ++i) {
-                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-                }
-            }
+            whisper_mel_window(mel_inp, mel_offset, n_ctx, wstate.inp_mel.data());
 
             ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
         }
 
         if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            // with the fused conv kernel, only the frames that differ from the last window are computed
+            const bool incremental = wstate.conv_direct;
+
+            auto & cc = wstate.conv_cache;
+
+            std::vector<uint64_t> hash;
+
+            if (incremental) {
+                whisper_conv_cache_plan(cc, wstate.inp_mel, n_ctx, wctx.model.hparams.n_mels, hash);
+
+                // the conv1 frames that are used only by the skipped conv2 frames
+                wstate.conv_params[0].skip0 = 2*cc.skip0;
+                wstate.conv_params[0].skip1 = std::max(2*cc.skip0, 2*cc.skip1 - 1);
+
+                wstate.conv_params[1].skip0 = cc.skip0;
+                wstate.conv_params[1].skip1 = cc.skip1;
+
+                cc.n_ctx = -1;
+            }
+
+            if (!ggml_graph_compute_helper(sched, gf, n_threads, false)) {
+                cache = {};
                 return false;
             }
+
+            if (incremental) {
+                struct ggml_tensor * embd = wstate.embd_conv;
+
+                if (cc.skip1 > cc.skip0) {
+                    WHISPER_LOG_DEBUG("%s: reusing %d of %d conv frames (shift = %d)\n", __func__,
+                            (int) (cc.skip1 - cc.skip0), n_ctx, (int) cc.shift);
+
+                    for (int64_t c = 0; c < embd->ne[1]; ++c) {
+                        ggml_backend_tensor_set(embd, cc.out.data() + c*n_ctx + cc.skip0 + cc.shift,
+                                (c*n_ctx + cc.skip0)*sizeof(float), (cc.skip1 - cc.skip0)*sizeof(float));
+                    }
+                }
+
+                cc.mel = wstate.inp_mel;
+                cc.hash.swap(hash);
+                cc.out.resize(ggml_nelements(embd));
+
+                ggml_backend_tensor_get(embd, cc.out.data(), 0, ggml_nbytes(embd));
+
+                cc.n_ctx = n_ctx;
+            }
         } else {
 #if defined(WHISPER_USE_COREML)
             whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
@@ -2432,14 +4260,8 @@ static bool whisper_encode_internal(
     if (!whisper_encode_external(wstate)) {
         auto & sched = wstate.sched_encode.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
-
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
-
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, cache.gf_encode, n_threads, false)) {
+            cache = {};
             return false;
         }
     }
@@ -2448,14 +4270,8 @@ static bool whisper_encode_internal(
     {
         auto & sched = wstate.sched_cross.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
-
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
-
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, cache.gf_cross, n_threads, false)) {
+            cache = {};
             return false;
         }
     }
@@ -2463,6 +4279,8 @@ static bool whisper_encode_internal(
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
+    wstate.n_audio_ctx_enc = n_ctx;
+
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
@@ -2491,6 +4309,10 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
 
+    // the worst case has to fit one token per decoder or a draft verification batch, the outputs of a real batch are
+    // flagged in batch.logits
+    const int n_outputs = worst_case ? std::min(n_tokens, std::max(WHISPER_MAX_DECODERS, WHISPER_MAX_DRAFT + 1)) : whisper_batch_n_outputs(batch);
+
     const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
     const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
 
@@ -2522,6 +4344,14 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
 
+    // the rows of the tokens that need logits
+    struct ggml_tensor * out_ids = nullptr;
+    if (n_outputs < n_tokens) {
+        out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
+        ggml_set_name(out_ids, "out_ids");
+        ggml_set_input(out_ids);
+    }
+
     // token encoding + position encoding
     struct ggml_tensor * cur =
         ggml_add(ctx0,
@@ -2582,15 +4412,15 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
                 if (wctx.params.flash_attn) {
                     k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
 
                     v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.v->type, n_state)*(il*n_ctx + kv_head));
                 } else {
                     Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
 
                     k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
 
                     v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
                             (   n_ctx)*ggml_element_size(kv_self.v),
@@ -2611,17 +4441,17 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             struct ggml_tensor * K =
                 ggml_view_3d(ctx0, kv_self.k,
                         n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
             if (wctx.params.flash_attn) {
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_self.v,
                             n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state_head),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
 
@@ -2692,16 +4522,16 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.v->type, n_state),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
 
@@ -2710,9 +4540,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
@@ -2768,6 +4598,12 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
         // add the input
         cur = ggml_add(ctx0, cur, inpCA);
 
+        // the last feed-forward network, the final norm and the output projection are computed only for the tokens that
+        // need logits - during prompt processing this skips most of the n_vocab-wide rows
+        if (il == n_layer - 1 && out_ids) {
+            cur = ggml_get_rows(ctx0, cur, out_ids);
+        }
+
         struct ggml_tensor * inpFF = cur;
 
         // feed-forward network
@@ -2822,11 +4658,6 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 model.d_ln_b);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
-
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
@@ -2856,6 +4687,62 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 //   - n_tokens:   number of tokens in the prompt
 //   - n_past:     number of past tokens to prefix the prompt with
 //
+// collect the ops of a freshly built decoder graph that store the new K and V rows into the self-attention cache
+static void whisper_decoder_graph_init_kv_store(
+        whisper_decoder_graph_cache & cache,
+        const whisper_context & wctx,
+        const whisper_kv_cache & kv_self) {
+    const int n_state = wctx.model.hparams.n_text_state;
+
+    // without flash attention the V cache is transposed, so one cell is a single element of each row
+    const size_t nb_k = ggml_row_size(kv_self.k->type, n_state);
+    const size_t nb_v = wctx.params.flash_attn ? ggml_row_size(kv_self.v->type, n_state) : ggml_element_size(kv_self.v);
+
+    cache.kv_store.clear();
+
+    for (int i = 0; i < ggml_graph_n_nodes(cache.gf); ++i) {
+        struct ggml_tensor * t = ggml_graph_node(cache.gf, i);
+
+        if (t->op != GGML_OP_CPY) {
+            continue;
+        }
+
+        if (t->view_src == kv_self.k) {
+            cache.kv_store.emplace_back(t, nb_k);
+        } else if (t->view_src == kv_self.v) {
+            cache.kv_store.emplace_back(t, nb_v);
+        }
+    }
+}
+
+static void whisper_view_set_offs(struct ggml_tensor * t, size_t offs) {
+    t->view_offs = offs;
+    t->data      = (char *) t->view_src->data + offs;
+}
+
+// move the K and V stores of the cached decoder graph to a new KV head
+// the store op is a view of its destination view, so both of them are updated
+static void whisper_decoder_graph_set_head(whisper_decoder_graph_cache & cache, uint32_t kv_head) {
+    if (cache.kv_head == kv_head) {
+        return;
+    }
+
+    for (auto & store : cache.kv_store) {
+        struct ggml_tensor * cpy = store.first;
+        struct ggml_tensor * dst = cpy->src[1];
+
+        const size_t offs = dst->view_offs + ((int64_t) kv_head - (int64_t) cache.kv_head)*store.second;
+
+        whisper_view_set_offs(dst, offs);
+        whisper_view_set_offs(cpy, offs);
+
+        // the offset is also kept in the op params of the view
+        memcpy(dst->op_params, &offs, sizeof(offs));
+    }
+
+    cache.kv_head = kv_head;
+}
+
 static bool whisper_decode_internal(
         whisper_context & wctx,
           whisper_state & wstate,
@@ -2869,8 +4756,9 @@ static bool whisper_decode_internal(
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_vocab  = hparams.n_vocab;
-    const int n_tokens = batch.n_tokens;
+    const int n_vocab   = hparams.n_vocab;
+    const int n_tokens  = batch.n_tokens;
+    const int n_outputs = whisper_batch_n_outputs(batch);
 
     auto & logits_out = wstate.logits;
 
@@ -2884,7 +4772,7 @@ static bool whisper_decode_internal(
             return false;
         }
 
-        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
+        const uint32_t pad = std::max(whisper_kv_cache_get_padding(wctx), WHISPER_KV_N_BUCKET);
         kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
 
         //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
@@ -2894,14 +4782,41 @@ static bool whisper_decode_internal(
     // decoder
     {
         auto & sched = wstate.sched_decode.sched;
+        auto & cache = wstate.dec_graph;
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+        const int32_t n_kv        = wstate.kv_self.n;
+        const int32_t n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
+        // the graph is rebuilt and reallocated only when the decoding step moves to another bucket
+        // otherwise we keep the previous allocation and only point the K and V stores to the new KV head
+        if (!cache.valid(n_tokens, n_outputs, n_kv, n_audio_ctx, save_alignment_heads_QKs)) {
+            cache = {};
+
+            ggml_backend_sched_reset(sched);
+
+            ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                // should never happen as we pre-allocate the memory
+                return false;
+            }
+
+            cache.n_tokens    = n_tokens;
+            cache.n_outputs   = n_outputs;
+            cache.n_kv        = n_kv;
+            cache.n_audio_ctx = n_audio_ctx;
+            cache.kv_head     = wstate.kv_self.head;
+            cache.gf          = gf;
+
+            cache.save_alignment_heads_QKs = save_alignment_heads_QKs;
+
+            whisper_decoder_graph_init_kv_store(cache, wctx, wstate.kv_self);
+        } else {
+            whisper_decoder_graph_set_head(cache, wstate.kv_self.head);
         }
 
+        ggml_cgraph * gf = cache.gf;
+
         // set the inputs
         {
             struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
@@ -2910,10 +4825,7 @@ static bool whisper_decode_internal(
 
         {
             struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
-            }
+            ggml_backend_tensor_set(position, batch.pos, 0, n_tokens*ggml_element_size(position));
         }
 
         {
@@ -2926,17 +4838,19 @@ static bool whisper_decode_internal(
             wstate.inp_mask.resize(ggml_nelements(KQ_mask));
 
             float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
+
+            const whisper_pos      * cell_pos = kv_self.cell_pos.data();
+            const whisper_seq_mask * cell_seq = kv_self.cell_seq.data();
 
             for (int h = 0; h < 1; ++h) {
                 for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+                    const whisper_pos      pos = batch.pos[j];
+                    const whisper_seq_mask bit = whisper_seq_bit(batch.seq_id[j][0]);
+
+                    float * row = data + h*(n_kv*n_tokens) + j*n_kv;
 
                     for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
+                        row[i] = ((cell_seq[i] & bit) != 0) & (cell_pos[i] <= pos) ? 0.0f : -INFINITY;
                     }
                 }
 
@@ -2950,20 +4864,31 @@ static bool whisper_decode_internal(
             ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
         }
 
+        if (n_outputs < n_tokens) {
+            struct ggml_tensor * out_ids = ggml_graph_get_tensor(gf, "out_ids");
+
+            std::vector<int32_t> ids;
+            ids.reserve(n_outputs);
+            for (int i = 0; i < n_tokens; ++i) {
+                if (batch.logits[i] != 0) {
+                    ids.push_back(i);
+                }
+            }
+
+            ggml_backend_tensor_set(out_ids, ids.data(), 0, n_outputs*sizeof(int32_t));
+        }
+
         logits = ggml_graph_node(gf, -1);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, false)) {
+            cache = {};
             return false;
         }
     }
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
-        }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
-    }
+    // one row per token with batch.logits set, in batch order
+    logits_out.resize(n_outputs*n_vocab);
+    ggml_backend_tensor_get(logits, logits_out.data(), 0, sizeof(float)*n_outputs*n_vocab);
 
     if (batch.n_tokens > 1) {
         //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
@@ -3280,50 +5205,127 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+static bool whisper_is_alpha(uint8_t c) {
+    return (uint8_t) ((c | 0x20) - 'a') < 26;
+}
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+static bool whisper_is_digit(uint8_t c) {
+    return (uint8_t) (c - '0') < 10;
+}
 
-        std::regex re(pat);
-        std::smatch m;
+static bool whisper_is_space(uint8_t c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+// 0 - letter, 1 - digit, 2 - whitespace, 3 - other
+static int whisper_char_class(uint8_t c) {
+    return whisper_is_alpha(c) ? 0 : whisper_is_digit(c) ? 1 : whisper_is_space(c) ? 2 : 3;
+}
+
+// split the text into words, as [offset, length] pairs, the same way as the GPT-2 pattern:
+//
+//   's|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+
+//
+// the character classes are ASCII only, as with std::regex in the "C" locale
+static void whisper_pretokenize(const std::string & text, std::vector<std::pair<size_t, size_t>> & words) {
+    const uint8_t * s = (const uint8_t *) text.data();
+    const size_t    n = text.size();
+
+    words.clear();
+
+    size_t i = 0;
+    while (i < n) {
+        // contractions
+        if (s[i] == '\'' && i + 1 < n) {
+            const uint8_t c1 = s[i + 1];
+            const uint8_t c2 = i + 2 < n ? s[i + 2] : 0;
+
+            size_t len = 0;
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                len = 2;
+            } else if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                len = 3;
             }
-            str = m.suffix();
+
+            if (len > 0) {
+                words.emplace_back(i, len);
+                i += len;
+                continue;
+            }
+        }
+
+        size_t j = i;
+
+        // optional leading space of a word
+        if (s[j] == ' ' && j + 1 < n && !whisper_is_space(s[j + 1])) {
+            ++j;
+        }
+
+        const int c = whisper_char_class(s[j]);
+
+        while (j < n && whisper_char_class(s[j]) == c) {
+            ++j;
         }
+
+        // a whitespace run followed by a word leaves its last character to the word
+        if (c == 2 && j < n && j - i > 1) {
+            --j;
+        }
+
+        words.emplace_back(i, j - i);
+        i = j;
     }
+}
+
+static int32_t whisper_vocab_trie_next(const whisper_vocab_trie & trie, int32_t node, uint8_t c) {
+    const uint8_t * first = trie.edge_byte.data() + trie.node_edge[node];
+    const uint8_t * last  = trie.edge_byte.data() + trie.node_edge[node + 1];
+
+    const uint8_t * it = std::lower_bound(first, last, c);
+
+    return it != last && *it == c ? trie.edge_node[it - trie.edge_byte.data()] : -1;
+}
+
+std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<std::pair<size_t, size_t>> words;
+
+    // first split the text into words
+    whisper_pretokenize(text, words);
+
+    const auto & trie = vocab.trie;
+
+    const uint8_t * s = (const uint8_t *) text.data();
 
     // find the longest tokens that form the words:
     std::vector<whisper_vocab::id> tokens;
     for (const auto & word : words) {
-        if (word.empty()) continue;
+        const size_t n = word.first + word.second;
 
-        int i = 0;
-        int n = word.size();
+        size_t i = word.first;
         while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
+            int32_t node = 0;
+            int32_t id   = -1;
+            size_t  len  = 0;
+
+            for (size_t k = i; k < n; ++k) {
+                node = whisper_vocab_trie_next(trie, node, s[k]);
+                if (node < 0) {
                     break;
                 }
-                --j;
+                if (trie.node_tok[node] >= 0) {
+                    id  = trie.node_tok[node];
+                    len = k - i + 1;
+                }
             }
-            if (!found) {
+
+            if (id < 0) {
                 WHISPER_LOG_ERROR("unknown token\n");
                 ++i;
+                continue;
             }
+
+            tokens.push_back(id);
+            i += len;
         }
     }
 
@@ -3392,10 +5394,12 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         return nullptr;
     }
 
+    state->conv_direct = whisper_conv_direct_supported(ctx->model, state->backends);
+
     // at this point, we don't know yet how many decoders will be used
     // later during decoding, if more decoders are used, we will recreate the KV cache respectively
     state->kv_self_n_dec = 1;
-    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_k, ctx->params.type_v,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
@@ -3409,7 +5413,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
     }
 
-    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->params.type_k, ctx->params.type_v,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3423,7 +5427,8 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
     }
 
-    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype,
+    // the padded buffer is written and read by the same encoder graph, so it is kept in the intermediate type
+    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype, ctx->itype,
                 ctx->model.hparams.n_audio_state,
                 1,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3466,7 +5471,8 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 #endif
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+    // one row per decoder or per token of a draft verification batch, see whisper_decode_internal()
+    state->logits.reserve(ctx->vocab.n_vocab * std::max(WHISPER_MAX_DECODERS, WHISPER_MAX_DRAFT + 1));
 
     state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
 
@@ -3552,8 +5558,35 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_decode) / 1e6);
     }
 
-    return state;
-}
+    {
+        const whisper_state_memory mem = whisper_get_state_memory(state);
+        WHISPER_LOG_INFO("%s: state memory = %7.2f MB (kv %7.2f MB, compute %7.2f MB)\n", __func__,
+                mem.total / 1e6, (mem.kv_self + mem.kv_cross + mem.kv_pad) / 1e6, mem.compute / 1e6);
+    }
+
+    return state;
+}
+
+struct whisper_state_memory whisper_get_state_memory(struct whisper_state * state) {
+    whisper_state_memory mem = {};
+
+    mem.kv_self  = whisper_kv_cache_nbytes(state->kv_self);
+    mem.kv_cross = whisper_kv_cache_nbytes(state->kv_cross);
+    mem.kv_pad   = whisper_kv_cache_nbytes(state->kv_pad);
+
+    mem.compute = whisper_sched_size(state->sched_conv)   +
+                  whisper_sched_size(state->sched_encode) +
+                  whisper_sched_size(state->sched_cross)  +
+                  whisper_sched_size(state->sched_decode) +
+                  whisper_sched_size(state->sched_encode_batch);
+
+    mem.host = sizeof(float)*(state->mel.data.capacity() + state->logits.capacity() + state->prompt_kv_logits.capacity() +
+                              state->inp_mel.capacity()  + state->inp_mask.capacity());
+
+    mem.total = mem.kv_self + mem.kv_cross + mem.kv_pad + mem.compute + mem.host;
+
+    return mem;
+}
 
 int whisper_ctx_init_openvino_encoder_with_state(
         struct whisper_context * ctx,
@@ -3620,6 +5653,16 @@ struct whisper_context_params whisper_context_default_params() {
         /*.flash_attn           =*/ false,
         /*.gpu_device           =*/ 0,
 
+        /*.use_mmap             =*/ true,
+        /*.mmap_prefetch        =*/ false,
+
+        /*.type_k               =*/ GGML_TYPE_F16,
+        /*.type_v               =*/ GGML_TYPE_F16,
+
+        /*.type_w               =*/ GGML_TYPE_COUNT,
+        /*.n_threads_load       =*/ 0,
+        /*.cache_type_w         =*/ false,
+
         /*.dtw_token_timestamps =*/ false,
         /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
         /*.dtw_n_top            =*/ -1,
@@ -3627,13 +5670,127 @@ struct whisper_context_params whisper_context_default_params() {
             /*.n_heads          =*/ 0,
             /*.heads            =*/ NULL,
         },
+        /*.dtw_band             =*/ 0,
         /*.dtw_mem_size         =*/ 1024*1024*128,
     };
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+                      whisper_mmap * mapping,
+                      whisper_gguf * gguf,
+          const whisper_cache_target * cache);
+
+static struct whisper_context * whisper_init_from_file_no_state_impl(const char * path_model, struct whisper_context_params params, const whisper_cache_target * cache);
+
+// true if the converted model at path_cache was made from a model file with the given stamp
+static bool whisper_cache_is_valid(const char * path_cache, const whisper_file_stamp & source) {
+    if (!whisper_is_gguf(path_cache)) {
+        return false;
+    }
+
+    gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ nullptr,
+    };
+
+    gguf_context * ctx = gguf_init_from_file(path_cache, params);
+    if (ctx == nullptr) {
+        return false;
+    }
+
+    const int64_t id_size  = gguf_find_key(ctx, "whisper.cache.source_size");
+    const int64_t id_mtime = gguf_find_key(ctx, "whisper.cache.source_mtime");
+
+    const bool ok = id_size >= 0 && gguf_get_kv_type(ctx, id_size)  == GGUF_TYPE_UINT64 && gguf_get_val_u64(ctx, id_size)  == source.size &&
+                   id_mtime >= 0 && gguf_get_kv_type(ctx, id_mtime) == GGUF_TYPE_INT64  && gguf_get_val_i64(ctx, id_mtime) == source.mtime_ns;
+
+    gguf_free(ctx);
+
+    return ok;
+}
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
+    // load the converted model from the cache next to the model file, or convert the model and save it there
+    if (params.type_w != GGML_TYPE_COUNT && params.cache_type_w) {
+        whisper_cache_target cache;
+
+        cache.path = std::string(path_model) + "." + ggml_type_name(params.type_w) + ".gguf";
+
+        if (whisper_file_stamp_get(path_model, cache.source)) {
+            if (whisper_cache_is_valid(cache.path.c_str(), cache.source)) {
+                whisper_context * ctx = whisper_init_from_file_no_state_impl(cache.path.c_str(), params, nullptr);
+                if (ctx) {
+                    ctx->path_model = path_model;
+                    return ctx;
+                }
+
+                WHISPER_LOG_WARN("%s: failed to load the converted model '%s' - converting '%s' again\n", __func__, cache.path.c_str(), path_model);
+            }
+
+            return whisper_init_from_file_no_state_impl(path_model, params, &cache);
+        }
+    }
+
+    return whisper_init_from_file_no_state_impl(path_model, params, nullptr);
+}
+
+static struct whisper_context * whisper_init_from_file_no_state_impl(const char * path_model, struct whisper_context_params params, const whisper_cache_target * cache) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    whisper_gguf * gguf = nullptr;
+
+    if (whisper_is_gguf(path_model)) {
+        gguf = whisper_gguf_init(path_model);
+        if (gguf == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to read the GGUF index of '%s'\n", __func__, path_model);
+            return nullptr;
+        }
+    }
+
+#ifdef WHISPER_HAS_MMAP
+    if (params.use_mmap) {
+        whisper_mmap * mapping = whisper_mmap_open(path_model, params.mmap_prefetch);
+
+        if (mapping != nullptr) {
+            whisper_model_loader loader = {};
+
+            loader.context = mapping;
+
+            loader.read = [](void * ctx, void * output, size_t read_size) {
+                whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+                const size_t size_to_copy = std::min(read_size, mapping->size - mapping->pos);
+
+                memcpy(output, (const char *) mapping->addr + mapping->pos, size_to_copy);
+                mapping->pos += size_to_copy;
+
+                return size_to_copy;
+            };
+
+            loader.eof = [](void * ctx) {
+                whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+                return mapping->pos >= mapping->size;
+            };
+
+            loader.close = [](void * /*ctx*/) { };
+
+            auto ctx = whisper_init_with_params_no_state_impl(&loader, params, mapping, gguf, cache);
+
+            if (ctx) {
+                ctx->path_model = path_model;
+            }
+
+            return ctx;
+        }
+
+        WHISPER_LOG_WARN("%s: failed to map '%s' - reading it instead\n", __func__, path_model);
+    }
+#endif
+
 #ifdef _MSC_VER
     // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
     std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
@@ -3644,6 +5801,7 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
 #endif
     if (!fin) {
         WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
+        whisper_gguf_free(gguf);
         return nullptr;
     }
 
@@ -3667,7 +5825,7 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
         fin->close();
     };
 
-    auto ctx = whisper_init_with_params_no_state(&loader, params);
+    auto ctx = whisper_init_with_params_no_state_impl(&loader, params, nullptr, gguf, cache);
 
     if (ctx) {
         ctx->path_model = path_model;
@@ -3714,6 +5872,18 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr, nullptr, nullptr);
+}
+
+// the context takes the ownership of the mapping of the model file, if any
+// the GGUF index is needed only while loading the model and is freed here
+// cache: where to save the converted model, see whisper_context_params.cache_type_w
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+                      whisper_mmap * mapping,
+                      whisper_gguf * gguf,
+          const whisper_cache_target * cache) {
     ggml_time_init();
 
     if (params.flash_attn && params.dtw_token_timestamps) {
@@ -3721,19 +5891,45 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
         params.dtw_token_timestamps = false;
     }
 
+    if (!whisper_kv_cache_type_supported(params.type_k)) {
+        WHISPER_LOG_WARN("%s: unsupported K cache type %d - using f16\n", __func__, params.type_k);
+        params.type_k = GGML_TYPE_F16;
+    }
+
+    if (!whisper_kv_cache_type_supported(params.type_v)) {
+        WHISPER_LOG_WARN("%s: unsupported V cache type %d - using f16\n", __func__, params.type_v);
+        params.type_v = GGML_TYPE_F16;
+    }
+
+    // without flash attention, the V cache is stored transposed and written one element at a time
+    if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
+        WHISPER_LOG_WARN("%s: quantized V cache requires flash_attn - using f16\n", __func__);
+        params.type_v = GGML_TYPE_F16;
+    }
+
     WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
     WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
     WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
     WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: kv types   = %s, %s\n", __func__, ggml_type_name(params.type_k), ggml_type_name(params.type_v));
     WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
     WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
 
     whisper_context * ctx = new whisper_context;
     ctx->params = params;
+    ctx->model.mapping = mapping;
 
-    if (!whisper_model_load(loader, *ctx)) {
+    const bool ok = whisper_model_load(loader, *ctx, gguf, cache);
+
+    whisper_gguf_free(gguf);
+
+    if (!ok) {
         loader->close(loader->context);
         WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
+            ggml_backend_buffer_free(buf);
+        }
+        whisper_mmap_free(ctx->model.mapping);
         delete ctx;
         return nullptr;
     }
@@ -3834,10 +6030,15 @@ void whisper_free_state(struct whisper_state * state) {
 
         whisper_batch_free(state->batch);
 
+        whisper_worker_pool_free(state->workers);
+
+        whisper_free_state(state->draft.state);
+
         ggml_backend_sched_free(state->sched_conv.sched);
         ggml_backend_sched_free(state->sched_encode.sched);
         ggml_backend_sched_free(state->sched_cross.sched);
         ggml_backend_sched_free(state->sched_decode.sched);
+        ggml_backend_sched_free(state->sched_encode_batch.sched);
 
         for (auto & backend : state->backends) {
             ggml_backend_free(backend);
@@ -3860,8 +6061,14 @@ void whisper_free(struct whisper_context * ctx) {
             ggml_backend_buffer_free(buf);
         }
 
+        whisper_mmap_free(ctx->model.mapping);
+
         whisper_free_state(ctx->state);
 
+        for (whisper_state * state : ctx->pool.states) {
+            whisper_free_state(state);
+        }
+
         delete ctx;
     }
 }
@@ -3938,6 +6145,107 @@ int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
     return 0;
 }
 
+int whisper_encode_batch(struct whisper_context * ctx, struct whisper_state ** states, const int * offsets, int n_states, int n_threads) {
+    if (n_states <= 0 || states == nullptr) {
+        WHISPER_LOG_ERROR("%s: no states to encode\n", __func__);
+        return -1;
+    }
+
+    const int n_ctx = states[0]->exp_n_audio_ctx > 0 ? states[0]->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx;
+
+    bool batched = n_states > 1;
+
+    for (int i = 0; i < n_states; ++i) {
+        const int n_ctx_i = states[i]->exp_n_audio_ctx > 0 ? states[i]->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx;
+        if (n_ctx_i != n_ctx) {
+            WHISPER_LOG_ERROR("%s: all states must use the same audio context size (%d != %d)\n", __func__, n_ctx_i, n_ctx);
+            return -2;
+        }
+
+        // external encoders (CoreML, OpenVINO) process one window at a time
+        if (whisper_encode_external(*states[i])) {
+            batched = false;
+        }
+    }
+
+    if (!batched) {
+        for (int i = 0; i < n_states; ++i) {
+            if (!whisper_encode_internal(*ctx, *states[i], offsets ? offsets[i] : 0, n_threads, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to eval state %d\n", __func__, i);
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // the encoder output is stored in the embd_enc tensor of each state, so their graphs must be allocated
+    for (int i = 0; i < n_states; ++i) {
+        if (!whisper_encoder_graphs_prepare(*ctx, *states[i])) {
+            WHISPER_LOG_ERROR("%s: failed to allocate the encoder graphs of state %d\n", __func__, i);
+            return -3;
+        }
+    }
+
+    whisper_state & leader = *states[0];
+
+    auto & sched = leader.sched_encode_batch;
+
+    if (sched.sched == nullptr || leader.n_encode_batch_max < n_states) {
+        const int n_nodes = whisper_encode_batch_n_nodes(*ctx, n_states);
+
+        ggml_backend_sched_free(sched.sched);
+
+        sched.sched = ggml_backend_sched_new(leader.backends.data(), nullptr, leader.backends.size(), n_nodes, false);
+        sched.meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
+
+        leader.n_encode_batch_max = n_states;
+    }
+
+    ggml_cgraph * gf = whisper_build_graph_encoder_batch(*ctx, states, n_states, n_ctx);
+
+    if (!ggml_backend_sched_alloc_graph(sched.sched, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        ggml_backend_sched_reset(sched.sched);
+        return -3;
+    }
+
+    {
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        for (int i = 0; i < n_states; ++i) {
+            auto & wstate = *states[i];
+
+            assert(wstate.mel.n_mel == ctx->model.hparams.n_mels);
+
+            wstate.inp_mel.resize(mel->ne[0]*mel->ne[1]);
+
+            whisper_mel_window(wstate.mel, offsets ? offsets[i] : 0, n_ctx, wstate.inp_mel.data());
+
+            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), i*mel->nb[2], mel->nb[2]);
+        }
+    }
+
+    if (!ggml_graph_compute_helper(sched.sched, gf, n_threads)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    // the time is shared evenly between the states of the batch
+    const int64_t t_encode_us = (ggml_time_us() - t_start_us)/n_states;
+
+    for (int i = 0; i < n_states; ++i) {
+        states[i]->t_encode_us += t_encode_us;
+        states[i]->n_encode++;
+
+        states[i]->n_audio_ctx_enc = n_ctx;
+    }
+
+    return 0;
+}
+
 int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
 
@@ -4024,30 +6332,12 @@ const char * whisper_lang_str_full(int id) {
     return nullptr;
 }
 
-int whisper_lang_auto_detect_with_state(
+// decode the SOT token on top of the current encoder output of the state and return the most probable language
+static int whisper_lang_auto_detect_from_encoder(
         struct whisper_context * ctx,
           struct whisper_state * state,
-                           int   offset_ms,
                            int   n_threads,
                          float * lang_probs) {
-    const int seek = offset_ms/10;
-
-    if (seek < 0) {
-        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
-
-    if (seek >= state->mel.n_len_org) {
-        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
-        return -2;
-    }
-
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
-        return -6;
-    }
-
     const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
 
     if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
@@ -4099,6 +6389,33 @@ int whisper_lang_auto_detect_with_state(
     return logits_id[0].second;
 }
 
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->mel.n_len_org) {
+        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
+        return -2;
+    }
+
+    // run the encoder
+    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
+        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+        return -6;
+    }
+
+    return whisper_lang_auto_detect_from_encoder(ctx, state, n_threads, lang_probs);
+}
+
 int whisper_lang_auto_detect(
         struct whisper_context * ctx,
                            int   offset_ms,
@@ -4258,6 +6575,10 @@ struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
     timings->decode_ms = 1e-3f * ctx->state->t_decode_us / std::max(1, ctx->state->n_decode);
     timings->batchd_ms = 1e-3f * ctx->state->t_batchd_us / std::max(1, ctx->state->n_batchd);
     timings->prompt_ms = 1e-3f * ctx->state->t_prompt_us / std::max(1, ctx->state->n_prompt);
+    timings->audio_ctx = ctx->state->n_audio_ctx_enc;
+    timings->n_draft          = ctx->state->n_draft;
+    timings->n_draft_accepted = ctx->state->n_accept;
+    timings->dtw_ms = 1e-3f * ctx->state->t_dtw_us / std::max(1, ctx->state->n_dtw);
     return timings;
 }
 
@@ -4278,81 +6599,329 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
         WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
         WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
+        WHISPER_LOG_INFO("%s:     audio ctx = %5d (last encode)\n", __func__, ctx->state->n_audio_ctx_enc);
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+        if (ctx->state->n_draft > 0) {
+            WHISPER_LOG_INFO("%s:    draft time = %8.2f ms / %5d toks ( %5.1f%% accepted)\n", __func__, 1e-3f * ctx->state->t_draft_us, ctx->state->n_draft, 100.0f * ctx->state->n_accept / ctx->state->n_draft);
+        }
+        if (ctx->state->n_dtw > 0) {
+            WHISPER_LOG_INFO("%s:      dtw time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_dtw_us, ctx->state->n_dtw, 1e-3f * ctx->state->t_dtw_us / ctx->state->n_dtw);
+        }
+    }
+    {
+        const whisper_state_pool_stats pool = whisper_state_pool_get_stats(ctx);
+        if (pool.n_states > 0) {
+            WHISPER_LOG_INFO("%s:    state pool = %5d hits / %5d misses / %3d fails ( %d states, %.2f MB)\n", __func__, pool.n_hit, pool.n_miss, pool.n_fail, pool.n_states, pool.mem / 1e6);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
 
+static void whisper_state_reset_timings(whisper_state & state) {
+    state.t_mel_us = 0;
+    state.t_sample_us = 0;
+    state.t_encode_us = 0;
+    state.t_decode_us = 0;
+    state.t_batchd_us = 0;
+    state.t_prompt_us = 0;
+    state.t_draft_us = 0;
+    state.t_dtw_us = 0;
+    state.n_sample = 0;
+    state.n_encode = 0;
+    state.n_decode = 0;
+    state.n_batchd = 0;
+    state.n_prompt = 0;
+    state.n_draft = 0;
+    state.n_accept = 0;
+    state.n_dtw = 0;
+    state.n_audio_ctx_enc = 0;
+}
+
 void whisper_reset_timings(struct whisper_context * ctx) {
     ctx->t_start_us = ggml_time_us();
     if (ctx->state != nullptr) {
-        ctx->state->t_mel_us = 0;
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
-        ctx->state->t_batchd_us = 0;
-        ctx->state->t_prompt_us = 0;
-        ctx->state->n_sample = 0;
-        ctx->state->n_encode = 0;
-        ctx->state->n_decode = 0;
-        ctx->state->n_batchd = 0;
-        ctx->state->n_prompt = 0;
+        whisper_state_reset_timings(*ctx->state);
     }
 }
 
-static int whisper_has_coreml(void) {
-#ifdef WHISPER_USE_COREML
-    return 1;
-#else
-    return 0;
-#endif
+// reset the per-call data of a state, so that it can be reused as if it was just initialized
+// the KV caches, the compute buffers and the DTW masks are kept - only the cells of the KV cache are marked as free
+static void whisper_state_reset(whisper_state & state) {
+    whisper_state_reset_timings(state);
+
+    state.n_fail_p = 0;
+    state.n_fail_h = 0;
+
+    std::fill(state.kv_self.cell_pos.begin(), state.kv_self.cell_pos.end(), -1);
+    std::fill(state.kv_self.cell_seq.begin(), state.kv_self.cell_seq.end(),  0);
+    state.kv_self.head = 0;
+
+    state.prompt_kv.clear();
+    state.prompt_kv_logits.clear();
+
+    // the first decoder is seeded only in whisper_init_state(), the others at the start of each whisper_full() call
+    state.decoders[0].rng = std::mt19937(0);
+
+    state.result_all.clear();
+    state.prompt_past.clear();
+
+    state.lang_id          = 0;
+    state.lang_id_detected = -1;
+    state.lang_n_reuse     = 0;
+
+    state.t_beg  = 0;
+    state.t_last = 0;
+
+    state.energy.clear();
+    state.no_speech_prob = 0.0f;
+
+    state.exp_n_audio_ctx = 0;
 }
 
-static int whisper_has_openvino(void) {
-#ifdef WHISPER_USE_OPENVINO
-    return 1;
-#else
-    return 0;
-#endif
+// memory used by the states of the pool, must be called with the mutex locked
+static size_t whisper_state_pool_mem(const whisper_state_pool & pool) {
+    size_t mem = 0;
+    for (const auto & it : pool.mem_state) {
+        mem += it.second;
+    }
+
+    return mem;
 }
 
-const char * whisper_print_system_info(void) {
-    static std::string s;
+// allocate a new state for the pool, respecting its memory limit
+// must be called with the mutex unlocked - the state is initialized without holding it, so that the other threads can
+// acquire and release the idle states in the meantime, and the limit is checked again before the state is added
+// with idle, the new state is added to the idle states, otherwise it is returned to the caller as acquired
+static whisper_state * whisper_state_pool_alloc(whisper_context * ctx, whisper_state_pool & pool, bool idle) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
 
-    whisper_load_backends();
+        if (pool.mem_max > 0 && !pool.mem_state.empty()) {
+            const size_t mem_cur = whisper_state_pool_mem(pool);
 
-    s  = "";
-    s += "WHISPER : ";
-    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
-    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+            // all states of a context have about the same size
+            const size_t mem_est = pool.mem_state.begin()->second;
+            if (mem_cur + mem_est > pool.mem_max) {
+                WHISPER_LOG_WARN("%s: the pool is full (%d states, %.2f MB of %.2f MB)\n", __func__,
+                        (int) pool.states.size(), mem_cur/1e6, pool.mem_max/1e6);
+                return nullptr;
+            }
+        }
+    }
 
-    for (size_t i = 0; i < ggml_backend_reg_count(); i++) {
-        auto * reg = ggml_backend_reg_get(i);
-        auto * get_features_fn = (ggml_backend_get_features_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features");
-        if (get_features_fn) {
-            ggml_backend_feature * features = get_features_fn(reg);
-            s += ggml_backend_reg_name(reg);
-            s += " : ";
-            for (; features->name; features++) {
-                s += features->name;
-                s += " = ";
-                s += features->value;
-                s += " | ";
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        WHISPER_LOG_ERROR("%s: failed to initialize a new state\n", __func__);
+        return nullptr;
+    }
+
+    const size_t mem = whisper_get_state_memory(state).total;
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        const size_t mem_cur = whisper_state_pool_mem(pool);
+
+        if (pool.mem_max == 0 || mem_cur + mem <= pool.mem_max || pool.states.empty()) {
+            pool.states.push_back(state);
+            pool.mem_state[state] = mem;
+
+            if (idle) {
+                pool.idle.push_back(state);
             }
+
+            return state;
         }
+
+        WHISPER_LOG_WARN("%s: the pool is full (%d states, %.2f MB of %.2f MB)\n", __func__,
+                (int) pool.states.size(), mem_cur/1e6, pool.mem_max/1e6);
     }
-    return s.c_str();
+
+    whisper_free_state(state);
+
+    return nullptr;
 }
 
-//////////////////////////////////
-// Grammar - ported from llama.cpp
-//////////////////////////////////
+struct whisper_state * whisper_state_acquire(struct whisper_context * ctx) {
+    auto & pool = ctx->pool;
 
-// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
-// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
-static std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        if (!pool.idle.empty()) {
+            whisper_state * state = pool.idle.back();
+            pool.idle.pop_back();
+
+            pool.n_hit++;
+
+            return state;
+        }
+    }
+
+    whisper_state * state = whisper_state_pool_alloc(ctx, pool, false);
+
+    std::lock_guard<std::mutex> lock(pool.mutex);
+
+    if (state == nullptr) {
+        pool.n_fail++;
+        return nullptr;
+    }
+
+    pool.n_miss++;
+
+    return state;
+}
+
+void whisper_state_release(struct whisper_context * ctx, struct whisper_state * state) {
+    if (state == nullptr) {
+        return;
+    }
+
+    auto & pool = ctx->pool;
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        auto it = pool.mem_state.find(state);
+        if (it == pool.mem_state.end()) {
+            WHISPER_LOG_ERROR("%s: the state was not acquired from the pool of this context\n", __func__);
+            return;
+        }
+
+        // the KV cache of the decoders could have grown while the state was in use
+        it->second = whisper_get_state_memory(state).total;
+
+        whisper_state_reset(*state);
+
+        // keep the state only if the pool fits in the limit, e.g. the limit could have been lowered in the meantime
+        if (pool.mem_max == 0 || whisper_state_pool_mem(pool) <= pool.mem_max) {
+            pool.idle.push_back(state);
+            return;
+        }
+
+        pool.mem_state.erase(it);
+        pool.states.erase(std::find(pool.states.begin(), pool.states.end(), state));
+    }
+
+    whisper_free_state(state);
+}
+
+int whisper_state_pool_reserve(struct whisper_context * ctx, int n_states, size_t mem_max) {
+    auto & pool = ctx->pool;
+
+    std::vector<whisper_state *> states_free;
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        pool.mem_max = mem_max;
+
+        // free the idle states that do not fit in the new limit
+        while (pool.mem_max > 0 && !pool.idle.empty() && whisper_state_pool_mem(pool) > pool.mem_max) {
+            whisper_state * state = pool.idle.back();
+            pool.idle.pop_back();
+
+            pool.mem_state.erase(state);
+            pool.states.erase(std::find(pool.states.begin(), pool.states.end(), state));
+
+            states_free.push_back(state);
+        }
+    }
+
+    for (whisper_state * state : states_free) {
+        whisper_free_state(state);
+    }
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+
+            if ((int) pool.states.size() >= n_states) {
+                break;
+            }
+        }
+
+        if (whisper_state_pool_alloc(ctx, pool, true) == nullptr) {
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(pool.mutex);
+
+    return pool.states.size();
+}
+
+struct whisper_state_pool_stats whisper_state_pool_get_stats(struct whisper_context * ctx) {
+    auto & pool = ctx->pool;
+
+    std::lock_guard<std::mutex> lock(pool.mutex);
+
+    whisper_state_pool_stats stats = {};
+
+    stats.n_states = pool.states.size();
+    stats.n_idle   = pool.idle.size();
+    stats.n_hit    = pool.n_hit;
+    stats.n_miss   = pool.n_miss;
+    stats.n_fail   = pool.n_fail;
+    stats.mem      = whisper_state_pool_mem(pool);
+    stats.mem_max  = pool.mem_max;
+
+    return stats;
+}
+
+static int whisper_has_coreml(void) {
+#ifdef WHISPER_USE_COREML
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int whisper_has_openvino(void) {
+#ifdef WHISPER_USE_OPENVINO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+const char * whisper_print_system_info(void) {
+    static std::string s;
+
+    whisper_load_backends();
+
+    s  = "";
+    s += "WHISPER : ";
+    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
+    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+
+    for (size_t i = 0; i < ggml_backend_reg_count(); i++) {
+        auto * reg = ggml_backend_reg_get(i);
+        auto * get_features_fn = (ggml_backend_get_features_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features");
+        if (get_features_fn) {
+            ggml_backend_feature * features = get_features_fn(reg);
+            s += ggml_backend_reg_name(reg);
+            s += " : ";
+            for (; features->name; features++) {
+                s += features->name;
+                s += " = ";
+                s += features->value;
+                s += " | ";
+            }
+        }
+    }
+    return s.c_str();
+}
+
+//////////////////////////////////
+// Grammar - ported from llama.cpp
+//////////////////////////////////
+
+// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
+// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
+std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
         const char         * src,
         whisper_partial_utf8   partial_start) {
     static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
@@ -4552,7 +7121,7 @@ static void whisper_grammar_advance_stack(
 // be positioned at a character range (see `whisper_grammar_advance_stack`), and
 // produces the N possible stacks if the given char is accepted at those
 // positions
-static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
+std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
         const std::vector<std::vector<whisper_grammar_element>>         & rules,
         const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
         const uint32_t                                                  chr) {
@@ -4577,6 +7146,11 @@ static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar
         }
     }
 
+    // an ambiguous grammar reaches the same stack in several ways, keep one of each
+    // otherwise the number of stacks can grow exponentially with the length of the text
+    std::sort(new_stacks.begin(), new_stacks.end());
+    new_stacks.erase(std::unique(new_stacks.begin(), new_stacks.end()), new_stacks.end());
+
     return new_stacks;
 }
 
@@ -4652,7 +7226,7 @@ static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
     return rejects;
 }
 
-static struct whisper_grammar whisper_grammar_init(
+struct whisper_grammar whisper_grammar_init(
             const whisper_grammar_element ** rules,
                                  size_t      n_rules,
                                  size_t      i_start_rule) {
@@ -4669,7 +7243,7 @@ static struct whisper_grammar whisper_grammar_init(
 
     // loop over alternates of start rule to build initial stacks
     std::vector<std::vector<const whisper_grammar_element *>> stacks;
-    pos = rules[i_start_rule];
+    pos = vec_rules[i_start_rule].data();
     do {
         std::vector<const whisper_grammar_element *> stack;
         if (!whisper_grammar_is_end_of_sequence(pos)) {
@@ -4689,16 +7263,231 @@ static struct whisper_grammar whisper_grammar_init(
         }
     } while (true);
 
-    return { std::move(vec_rules), std::move(stacks), {} };
+    return { std::make_shared<const std::vector<std::vector<whisper_grammar_element>>>(std::move(vec_rules)), std::move(stacks), {} };
+}
+
+void whisper_grammar_trie_build(whisper_grammar_trie & trie, const whisper_vocab & vocab) {
+    const whisper_token eot = vocab.token_eot;
+
+    struct entry {
+        std::vector<uint32_t> code_points;
+        whisper_token         id;
+        whisper_partial_utf8  partial;
+    };
+
+    std::vector<entry> entries;
+
+    trie.candidates.assign((eot + 63)/64, 0);
+
+    for (whisper_token id = 0; id < eot; ++id) {
+        const auto it = vocab.id_to_token.find(id);
+        if (it == vocab.id_to_token.end() || it->second.empty()) {
+            continue;
+        }
+
+        trie.candidates[id/64] |= uint64_t(1) << (id%64);
+
+        auto decoded = decode_utf8(it->second.c_str(), { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+
+        // drop the terminating 0
+        decoded.first.pop_back();
+
+        entries.push_back({ std::move(decoded.first), id, decoded.second });
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+        return a.code_points < b.code_points;
+    });
+
+    // the entries are sorted, so the children of each node are created in code point order
+    // path[k] is the node of the first k code points of the previous entry
+    std::vector<int32_t>  parent = { -1 };
+    std::vector<uint32_t> chr    = {  0 };
+    std::vector<int32_t>  node_of(entries.size());
+
+    std::vector<int32_t> path = { 0 };
+    const std::vector<uint32_t> * prev = nullptr;
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const auto & cps = entries[i].code_points;
+
+        size_t n_common = 0;
+        if (prev) {
+            while (n_common < prev->size() && n_common < cps.size() && (*prev)[n_common] == cps[n_common]) {
+                ++n_common;
+            }
+        }
+
+        path.resize(n_common + 1);
+
+        for (size_t k = n_common; k < cps.size(); ++k) {
+            parent.push_back(path.back());
+            chr.push_back(cps[k]);
+
+            path.push_back(parent.size() - 1);
+        }
+
+        node_of[i] = path.back();
+        prev = &cps;
+    }
+
+    const int n_nodes = parent.size();
+
+    trie.node_edge.assign(n_nodes + 1, 0);
+    for (int i = 1; i < n_nodes; ++i) {
+        trie.node_edge[parent[i] + 1]++;
+    }
+    for (int i = 0; i < n_nodes; ++i) {
+        trie.node_edge[i + 1] += trie.node_edge[i];
+    }
+
+    trie.edge_chr.resize(n_nodes - 1);
+    trie.edge_node.resize(n_nodes - 1);
+
+    {
+        std::vector<uint32_t> cur(trie.node_edge.begin(), trie.node_edge.end() - 1);
+        for (int i = 1; i < n_nodes; ++i) {
+            const uint32_t e = cur[parent[i]]++;
+
+            trie.edge_chr[e]  = chr[i];
+            trie.edge_node[e] = i;
+        }
+    }
+
+    trie.node_tok.assign(n_nodes + 1, 0);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        trie.node_tok[node_of[i] + 1]++;
+    }
+    for (int i = 0; i < n_nodes; ++i) {
+        trie.node_tok[i + 1] += trie.node_tok[i];
+    }
+
+    trie.tok_id.resize(entries.size());
+    trie.tok_partial.resize(entries.size());
+
+    {
+        std::vector<uint32_t> cur(trie.node_tok.begin(), trie.node_tok.end() - 1);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const uint32_t t = cur[node_of[i]]++;
+
+            trie.tok_id[t]      = entries[i].id;
+            trie.tok_partial[t] = entries[i].partial;
+        }
+    }
+}
+
+// mark the tokens below the given trie node that can be accepted from the given stacks
+// the stacks have consumed the code points on the path to the node
+static void whisper_grammar_trie_accept(
+        const whisper_grammar_trie                                      & trie,
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        int32_t                                                           node,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        std::vector<uint64_t>                                           & accepted) {
+    // tokens that end here, a trailing partial UTF-8 sequence has to be possible at the top of some stack
+    for (uint32_t t = trie.node_tok[node]; t < trie.node_tok[node + 1]; ++t) {
+        const auto & partial = trie.tok_partial[t];
+
+        bool ok = partial.n_remain == 0;
+        for (size_t i = 0; !ok && i < stacks.size(); ++i) {
+            ok = !stacks[i].empty() && whisper_grammar_match_partial_char(stacks[i].back(), partial);
+        }
+
+        if (ok) {
+            const whisper_token id = trie.tok_id[t];
+            accepted[id/64] |= uint64_t(1) << (id%64);
+        }
+    }
+
+    for (uint32_t e = trie.node_edge[node]; e < trie.node_edge[node + 1]; ++e) {
+        const uint32_t chr = trie.edge_chr[e];
+
+        // check the stack tops before building the next stacks, most of the subtrees are pruned here
+        bool any = false;
+        for (const auto & stack : stacks) {
+            if (!stack.empty() && whisper_grammar_match_char(stack.back(), chr).first) {
+                any = true;
+                break;
+            }
+        }
+
+        if (!any) {
+            continue;
+        }
+
+        whisper_grammar_trie_accept(trie, rules, trie.edge_node[e], whisper_grammar_accept(rules, stacks, chr), accepted);
+    }
+}
+
+std::vector<uint64_t> whisper_grammar_trie_reject_tokens(const whisper_grammar_trie & trie, const whisper_grammar & grammar) {
+    std::vector<uint64_t> accepted(trie.candidates.size(), 0);
+
+    whisper_grammar_trie_accept(trie, *grammar.rules, 0, grammar.stacks, accepted);
+
+    std::vector<uint64_t> rejects(trie.candidates.size());
+    for (size_t i = 0; i < rejects.size(); ++i) {
+        rejects[i] = trie.candidates[i] & ~accepted[i];
+    }
+
+    return rejects;
+}
+
+std::vector<uint64_t> whisper_grammar_reject_tokens(const whisper_vocab & vocab, const whisper_grammar & grammar) {
+    const whisper_token eot = vocab.token_eot;
+
+    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
+    std::vector<whisper_grammar_candidate>                              candidates_grammar;
+
+    candidates_decoded.reserve(eot);
+
+    for (whisper_token id = 0; id < eot; ++id) {
+        const auto it = vocab.id_to_token.find(id);
+        if (it != vocab.id_to_token.end() && !it->second.empty()) {
+            candidates_decoded.push_back(decode_utf8(it->second.c_str(), grammar.partial_utf8));
+            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+        }
+    }
+
+    std::vector<uint64_t> rejects((eot + 63)/64, 0);
+
+    for (const auto & reject : whisper_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar)) {
+        rejects[reject.id/64] |= uint64_t(1) << (reject.id%64);
+    }
+
+    return rejects;
+}
+
+// subtract the penalty from the logits of the tokens in the mask
+static void whisper_grammar_penalize(const std::vector<uint64_t> & mask, float * logits, float penalty) {
+    const int n_words = mask.size();
+
+    for (int i = 0; i < n_words; ++i) {
+        const uint64_t bits = mask[i];
+        if (bits == 0) {
+            continue;
+        }
+
+        float * dst = logits + 64*i;
+
+        for (int j = 0; j < 64; ++j) {
+            if ((bits >> j) & 1) {
+                dst[j] -= penalty;
+            }
+        }
+    }
 }
 
 static void whisper_suppress_invalid_grammar(
              whisper_context  & ctx,
+               whisper_state  & state,
     const whisper_full_params & params,
            std::vector<float> & logits,
     const     whisper_grammar & grammar) {
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.stacks.empty()) {
         return;
     }
 
@@ -4710,34 +7499,58 @@ static void whisper_suppress_invalid_grammar(
     //    }
     //}
 
-    const whisper_token eot = whisper_token_eot(&ctx);
+    // the tokens continue a partial UTF-8 sequence of the accepted text - check each of them
+    if (grammar.partial_utf8.n_remain > 0) {
+        whisper_grammar_penalize(whisper_grammar_reject_tokens(ctx.vocab, grammar), logits.data(), params.grammar_penalty);
+        return;
+    }
 
-    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
-    std::vector<whisper_grammar_candidate>                              candidates_grammar;
+    auto & cache = state.grammar_cache;
 
-    for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
-            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+    std::vector<const whisper_grammar_element *> key;
+    for (const auto & stack : grammar.stacks) {
+        key.insert(key.end(), stack.begin(), stack.end());
+        key.push_back(nullptr);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        if (cache.rules != grammar.rules) {
+            cache.rules = grammar.rules;
+            cache.rejects.clear();
+        }
+
+        const auto it = cache.rejects.find(key);
+        if (it != cache.rejects.end()) {
+            whisper_grammar_penalize(it->second, logits.data(), params.grammar_penalty);
+            return;
         }
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    auto rejects = whisper_grammar_trie_reject_tokens(ctx.grammar_trie, grammar);
+
+    whisper_grammar_penalize(rejects, logits.data(), params.grammar_penalty);
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        // the number of grammar states is usually small, this only bounds the memory of pathological grammars
+        if (cache.rejects.size() >= 1024) {
+            cache.rejects.clear();
+        }
 
-    for (const auto & reject : rejects) {
-        logits[reject.id] -= params.grammar_penalty;
+        cache.rejects.emplace(std::move(key), std::move(rejects));
     }
 
     // when the grammar allows a continuation, we penalize the end-of-text token
     //if (!allow_eot) {
     //    logits[eot] -= params.grammar_penalty;
     //}
-    //fprintf(stderr, "Allowed: (%zu tokens)\n", size - rejects.size());
 }
 
 static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.stacks.empty()) {
         return;
     }
 
@@ -4755,7 +7568,7 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
     const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
+        grammar.stacks = whisper_grammar_accept(*grammar.rules, grammar.stacks, *it);
     }
     grammar.partial_utf8 = decoded.second;
 }
@@ -4809,6 +7622,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.debug_mode        =*/ false,
         /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_dynamic =*/ false,
 
         /*.tdrz_enable       =*/ false,
 
@@ -4820,6 +7634,8 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.language          =*/ "en",
         /*.detect_language   =*/ false,
+        /*.detect_audio_ctx  =*/ 0,
+        /*.detect_n_reuse    =*/ 0,
 
         /*.suppress_blank    =*/ true,
         /*.suppress_nst      =*/ false,
@@ -4832,6 +7648,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.entropy_thold     =*/  2.4f,
         /*.logprob_thold     =*/ -1.0f,
         /*.no_speech_thold   =*/  0.6f,
+        /*.no_speech_margin  =*/ -1.0f,
 
         /*.greedy            =*/ {
             /*.best_of   =*/ -1,
@@ -4862,6 +7679,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.n_grammar_rules =*/ 0,
         /*.i_start_rule    =*/ 0,
         /*.grammar_penalty =*/ 100.0f,
+
+        /*.draft_ctx   =*/ nullptr,
+        /*.draft_n_max =*/ 8,
     };
 
     switch (strategy) {
@@ -4972,46 +7792,246 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
-        }
-    }
-    logsumexp = logf(logsumexp) + logit_max;
+static void whisper_suppress_set(std::vector<uint64_t> & mask, int id) {
+    mask[id/64] |= uint64_t(1) << (id%64);
+}
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
-        }
+static void whisper_suppress_set(std::vector<uint64_t> & mask, const whisper_vocab & vocab, const std::string & token) {
+    const auto it = vocab.token_to_id.find(token);
+    if (it != vocab.token_to_id.end()) {
+        whisper_suppress_set(mask, it->second);
     }
 }
 
-static void whisper_compute_probs(
-    const std::vector<float> & logits,
-                  const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
-        } else {
-            probs[i] = expf(logprobs[i]);
+// set the logits of the tokens in the mask to -INFINITY
+// most of the 64-token words are empty, so this costs roughly n_vocab/64 loads
+static void whisper_suppress_apply(const std::vector<uint64_t> & mask, float * logits) {
+    const int n_words = mask.size();
+
+    for (int i = 0; i < n_words; ++i) {
+        const uint64_t bits = mask[i];
+        if (bits == 0) {
+            continue;
+        }
+
+        float * dst = logits + 64*i;
+
+        if (bits == ~uint64_t(0)) {
+            std::fill(dst, dst + 64, -INFINITY);
+            continue;
+        }
+
+        for (int j = 0; j < 64; ++j) {
+            if ((bits >> j) & 1) {
+                dst[j] = -INFINITY;
+            }
         }
     }
 }
 
-// process the logits for the selected decoder
-// - applies logit filters
+// compile the static logit filters of whisper_process_logits into token masks
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+static void whisper_suppress_init(
+                   whisper_suppress & suppress,
+              struct whisper_context & ctx,
+    const struct whisper_full_params & params) {
+    const auto & vocab = ctx.vocab;
+
+    const int n_logits = vocab.id_to_token.size();
+    const int n_words  = (n_logits + 63)/64;
+
+    suppress.pre  .assign(n_words, 0);
+    suppress.post .assign(n_words, 0);
+    suppress.blank.assign(n_words, 0);
+
+    // suppress blank
+    // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+    if (params.suppress_blank) {
+        whisper_suppress_set(suppress.blank, vocab.token_eot);
+        whisper_suppress_set(suppress.blank, vocab, " ");
+    }
+
+    // suppress <|notimestamps|> token
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+    whisper_suppress_set(suppress.pre, vocab.token_not);
+    if (params.no_timestamps) {
+        for (int i = vocab.token_beg; i < n_logits; ++i) {
+            whisper_suppress_set(suppress.pre, i);
+        }
+    }
+
+    // suppress sot and nosp tokens
+    whisper_suppress_set(suppress.pre, vocab.token_sot);
+    whisper_suppress_set(suppress.pre, vocab.token_nosp);
+
+    // [TDRZ] when tinydiarize is disabled, suppress solm token
+    if (params.tdrz_enable == false) {
+        whisper_suppress_set(suppress.pre, vocab.token_solm);
+    }
+
+    // suppress task tokens
+    whisper_suppress_set(suppress.pre, vocab.token_translate);
+    whisper_suppress_set(suppress.pre, vocab.token_transcribe);
+    whisper_suppress_set(suppress.pre, vocab.token_prev);
+
+    // suppress lang tokens
+    for (size_t i = 0; i < g_lang.size(); ++i) {
+        whisper_suppress_set(suppress.pre, whisper_token_lang(&ctx, i));
+    }
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (params.suppress_regex != nullptr) {
+        std::regex re(params.suppress_regex);
+        for (const auto & token_id : vocab.token_to_id) {
+            if (std::regex_match(token_id.first, re)) {
+                whisper_suppress_set(suppress.post, token_id.second);
+            }
+        }
+    }
+
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_nst) {
+        for (const std::string & token : non_speech_tokens) {
+            whisper_suppress_set(suppress.post, vocab, token);
+            whisper_suppress_set(suppress.post, vocab, " " + token);
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        whisper_suppress_set(suppress.post, vocab, " -");
+        whisper_suppress_set(suppress.post, vocab, " '");
+    }
+
+    suppress.has_post = std::any_of(suppress.post.begin(), suppress.post.end(), [](uint64_t w) { return w != 0; });
+}
+
+// the logits pipeline below works on the full vocabulary for every sampled token
+// the loops are split into WHISPER_LOGITS_LANES independent accumulators so that the compiler can vectorize them
+// without -ffast-math
+#define WHISPER_LOGITS_LANES 8
+
+// exp(x) for x <= 0, with the range reduction and the polynomial of ggml_v_expf()
+// results below 2^-126 are flushed to zero
+static inline float whisper_expf(float x) {
+    const float r = 0x1.8p23f;
+    const float z = x*0x1.715476p+0f + r;
+    const float n = z - r;
+    const float b = x - n*0x1.62e4p-1f - n*0x1.7f7d1cp-20f;
+
+    uint32_t zi;
+    memcpy(&zi, &z, sizeof(zi));
+
+    const uint32_t ki = (zi << 23) + 0x3f800000;
+
+    float k;
+    memcpy(&k, &ki, sizeof(k));
+
+    const float u = b*b;
+    const float j = 0x1.ffffecp-1f*b + ((0x1.fffdb6p-2f + 0x1.555e66p-3f*b) + (0x1.573e2ep-5f + 0x1.0e4020p-7f*b)*u)*u;
+    const float y = j*k + k;
+
+    // select with a mask instead of a branch, otherwise the callers are not vectorized
+    uint32_t yi;
+    memcpy(&yi, &y, sizeof(yi));
+
+    yi &= x > -87.0f ? 0xffffffffu : 0u;
+
+    float res;
+    memcpy(&res, &yi, sizeof(res));
+
+    return res;
+}
+
+static float whisper_logits_max(const float * x, int n) {
+    float mx[WHISPER_LOGITS_LANES];
+    for (int l = 0; l < WHISPER_LOGITS_LANES; ++l) {
+        mx[l] = -INFINITY;
+    }
+
+    int i = 0;
+    for (; i + WHISPER_LOGITS_LANES <= n; i += WHISPER_LOGITS_LANES) {
+        for (int l = 0; l < WHISPER_LOGITS_LANES; ++l) {
+            mx[l] = x[i + l] > mx[l] ? x[i + l] : mx[l];
+        }
+    }
+    for (; i < n; ++i) {
+        mx[0] = x[i] > mx[0] ? x[i] : mx[0];
+    }
+
+    float res = mx[0];
+    for (int l = 1; l < WHISPER_LOGITS_LANES; ++l) {
+        res = mx[l] > res ? mx[l] : res;
+    }
+
+    return res;
+}
+
+// e[i] = exp(x[i] - max), returns the sum of e
+static float whisper_logits_exp(const float * x, int n, float max, float * e) {
+    float sum[WHISPER_LOGITS_LANES] = { 0.0f };
+
+    int i = 0;
+    for (; i + WHISPER_LOGITS_LANES <= n; i += WHISPER_LOGITS_LANES) {
+        for (int l = 0; l < WHISPER_LOGITS_LANES; ++l) {
+            e[i + l] = whisper_expf(x[i + l] - max);
+            sum[l] += e[i + l];
+        }
+    }
+    for (; i < n; ++i) {
+        e[i] = whisper_expf(x[i] - max);
+        sum[0] += e[i];
+    }
+
+    float res = 0.0f;
+    for (int l = 0; l < WHISPER_LOGITS_LANES; ++l) {
+        res += sum[l];
+    }
+
+    return res;
+}
+
+// softmax statistics of the logits, kept separately for the text tokens [0, n_text) and the timestamp tokens [n_text, n)
+struct whisper_logits_stats {
+    float max      = -INFINITY; // over all tokens
+    float max_text = -INFINITY;
+    float sum_text = 0.0f;      // sum of exp(logits - max)
+    float sum_ts   = 0.0f;
+
+    float logsumexp() const {
+        return logf(sum_text + sum_ts) + max;
+    }
+};
+
+// two passes over the logits: the maxima, then e = exp(logits - max) and its sums
+// e is usually the probs buffer, which whisper_logits_normalize() then scales in place
+static whisper_logits_stats whisper_logits_softmax(const float * logits, int n, int n_text, float * e) {
+    whisper_logits_stats st;
+
+    st.max_text = whisper_logits_max(logits, n_text);
+    st.max      = std::max(st.max_text, whisper_logits_max(logits + n_text, n - n_text));
+
+    st.sum_text = whisper_logits_exp(logits,          n_text,     st.max, e);
+    st.sum_ts   = whisper_logits_exp(logits + n_text, n - n_text, st.max, e + n_text);
+
+    return st;
+}
+
+// logprobs = log_softmax(logits), probs = softmax(logits)
+// probs holds exp(logits - max) from whisper_logits_softmax() on input
+static void whisper_logits_normalize(const float * logits, int n, const whisper_logits_stats & st, float * logprobs, float * probs) {
+    const float lse   = st.logsumexp();
+    const float scale = 1.0f/(st.sum_text + st.sum_ts);
+
+    for (int i = 0; i < n; ++i) {
+        logprobs[i] = logits[i] - lse; // -INFINITY stays -INFINITY
+        probs[i]   *= scale;
+    }
+}
+
+// process the logits for the selected decoder
+// - applies logit filters
 // - computes logprobs and probs
-// TODO: optimize
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
@@ -5033,12 +8053,15 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+
+        const float * src = state.logits.data() + decoder.i_batch*n_logits;
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                logits[i] = src[i]/temperature;
             }
+        } else {
+            memcpy(logits.data(), src, n_logits*sizeof(float));
         }
 
         // will be populated a bit later
@@ -5047,82 +8070,25 @@ static void whisper_process_logits(
     }
 
     // apply logit filters here
+    // the static ones are precompiled in state.suppress, see whisper_suppress_init()
     // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
     {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
-            }
-        }
+        const auto & suppress = state.suppress;
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
-
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY;
+        WHISPER_ASSERT((int) suppress.pre.size() == (n_logits + 63)/64);
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
+        if (is_initial) {
+            whisper_suppress_apply(suppress.blank, logits.data());
         }
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
-
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
-        }
-
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
+        whisper_suppress_apply(suppress.pre, logits.data());
 
         if (params.logits_filter_callback) {
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
-
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+        if (suppress.has_post) {
+            whisper_suppress_apply(suppress.post, logits.data());
         }
 
         // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
@@ -5167,66 +8133,36 @@ static void whisper_process_logits(
             }
         }
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
+        // softmax statistics, probs = exp(logits - max) for now
+        whisper_logits_stats st = whisper_logits_softmax(logits.data(), n_logits, vocab.token_beg, probs.data());
 
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
-
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            // logsumexp over timestamps vs the max text token logprob, the common logsumexp cancels out
+            const float timestamp_logprob      = st.sum_ts > 0.0f ? logf(st.sum_ts) + st.max : -INFINITY;
+            const float max_text_token_logprob = st.max_text;
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
                 for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
+                    logits[i] = -INFINITY;
+                    probs[i]  = 0.0f;
                 }
             } else {
                 if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
-
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
+                    whisper_suppress_invalid_grammar(ctx, state, params, logits, decoder.grammar);
 
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    st = whisper_logits_softmax(logits.data(), n_logits, vocab.token_beg, probs.data());
                 }
             }
         }
-    }
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
+        // populate the logprobs and probs arrays (log_softmax and softmax)
+        // when a timestamp is forced, the text tokens are masked but the normalization stays the same
+        whisper_logits_normalize(logits.data(), n_logits, st, logprobs.data(), probs.data());
+    }
 
 #if 0
     // print first 100 logits - token string : logit
@@ -5478,6 +8414,130 @@ static void whisper_sequence_score(
     }
 }
 
+// [EXPERIMENTAL] dynamic audio_ctx
+// the encoder length is rounded up to one of WHISPER_AUDIO_CTX_N_BUCKETS equally spaced buckets of the model's
+// n_audio_ctx, so only a few distinct encoder graphs are ever built
+// the compute buffers are reserved for the full context in whisper_init_state(), so switching between the
+// buckets never grows the scheduler buffers
+static int whisper_audio_ctx_bucket(const whisper_context & ctx, int n_frames) {
+    const int n_audio_ctx = ctx.model.hparams.n_audio_ctx;
+
+    // each encoder position covers 2 mel frames
+    const int n_ctx = (std::min(n_frames, 2*n_audio_ctx) + 1)/2;
+
+    for (int i = 1; i < WHISPER_AUDIO_CTX_N_BUCKETS; ++i) {
+        const int n_bucket = (i*n_audio_ctx)/WHISPER_AUDIO_CTX_N_BUCKETS;
+        if (n_ctx <= n_bucket) {
+            return n_bucket;
+        }
+    }
+
+    return n_audio_ctx;
+}
+
+// [EXPERIMENTAL] speculative decoding
+// greedily sample up to n_max tokens with the draft model, continuing the prompt and the tokens of the decoder
+// the proposal stops after the first EOT token
+// the draft KV cache keeps the longest common prefix with the previous proposal, so usually only the tokens that
+// have been accepted since then are decoded again
+static bool whisper_draft_propose(
+                       whisper_draft & draft,
+               const whisper_decoder & decoder,
+    const std::vector<whisper_token> & prompt,
+           const whisper_full_params & params,
+                                 int   seek,
+                                 int   n_audio_ctx,
+                                 int   n_max,
+          std::vector<whisper_token> & result) {
+    auto & dctx   = *draft.ctx;
+    auto & dstate = *draft.state;
+
+    result.clear();
+
+    if (draft.seek != seek) {
+        dstate.exp_n_audio_ctx = n_audio_ctx;
+
+        if (!whisper_encode_internal(dctx, dstate, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+            return false;
+        }
+
+        whisper_kv_cache_clear(dstate.kv_self);
+
+        draft.tokens.clear();
+        draft.seek = seek;
+    }
+
+    std::vector<whisper_token> tokens = prompt;
+    for (const auto & token : decoder.sequence.tokens) {
+        tokens.push_back(token.id);
+    }
+
+    // the last token is always decoded again to get its logits
+    int n_keep = 0;
+    while (n_keep < (int) draft.tokens.size() && n_keep < (int) tokens.size() - 1 && draft.tokens[n_keep] == tokens[n_keep]) {
+        n_keep++;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_keep, -1);
+    draft.tokens.resize(n_keep);
+
+    // the draft follows the timestamp rules of the decoder, but not its grammar and logits filter
+    auto & ddecoder = dstate.decoders[0];
+
+    ddecoder.sequence   = decoder.sequence;
+    ddecoder.grammar    = {};
+    ddecoder.seek_delta = decoder.seek_delta;
+    ddecoder.has_ts     = decoder.has_ts;
+
+    whisper_full_params dparams = params;
+    dparams.logits_filter_callback = nullptr;
+
+    const whisper_token * feed = tokens.data() + n_keep;
+    int n_feed = tokens.size() - n_keep;
+
+    whisper_token id = 0;
+
+    while (true) {
+        whisper_batch_prep_legacy(dstate.batch, feed, n_feed, draft.tokens.size(), 0);
+
+        if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+            return false;
+        }
+
+        draft.tokens.insert(draft.tokens.end(), feed, feed + n_feed);
+
+        ddecoder.i_batch = 0;
+
+        whisper_process_logits(dctx, dstate, ddecoder, dparams, 0.0f);
+
+        const auto token = whisper_sample_token(dctx, ddecoder, true);
+
+        result.push_back(token.id);
+
+        if (token.id == whisper_token_eot(&dctx) || (int) result.size() >= n_max) {
+            break;
+        }
+
+        ddecoder.sequence.tokens.push_back(token);
+
+        if (token.id > whisper_token_beg(&dctx)) {
+            ddecoder.seek_delta = 2*(token.id - whisper_token_beg(&dctx));
+            ddecoder.has_ts     = true;
+        }
+
+        id     = token.id;
+        feed   = &id;
+        n_feed = 1;
+    }
+
+    return true;
+}
+
+// the first release of the distilled models cannot predict timestamps
+static bool whisper_is_distil_v1(const whisper_context & ctx) {
+    return ctx.model.hparams.n_text_layer == 2 && ctx.model.hparams.n_vocab != 51866;
+}
+
 int whisper_full_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -5497,21 +8557,70 @@ int whisper_full_with_state(
         }
     }
 
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    if (params.detect_audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: detect_audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.detect_audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+
+    // the window at seek_encoded already has its encoder output in the state
+    int seek_encoded = -1;
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
-        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+        if (!params.detect_language && params.detect_n_reuse > 0 && state->lang_n_reuse > 0 && state->lang_id_detected >= 0) {
+            state->lang_n_reuse--;
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
-        if (lang_id < 0) {
-            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
-            return -3;
-        }
-        state->lang_id = lang_id;
-        params.language = whisper_lang_str(lang_id);
+            state->lang_id = state->lang_id_detected;
+            params.language = whisper_lang_str(state->lang_id_detected);
+
+            WHISPER_LOG_DEBUG("%s: reusing the detected language: %s (%d more calls)\n", __func__, params.language, state->lang_n_reuse);
+        } else {
+            // detect on the first window, with the same encoder length as the main loop so that the encoder output can be
+            // reused, unless a (usually shorter) detect_audio_ctx is requested
+            const int seek_detect = seek_start < state->mel.n_len_org ? seek_start : 0;
+
+            if (params.detect_audio_ctx > 0) {
+                state->exp_n_audio_ctx = params.detect_audio_ctx;
+            } else if (params.audio_ctx_dynamic && params.audio_ctx == 0) {
+                state->exp_n_audio_ctx = whisper_audio_ctx_bucket(*ctx, seek_end - seek_detect);
+            }
+
+            if (!whisper_encode_internal(*ctx, *state, seek_detect, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+                return -6;
+            }
+
+            std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+
+            const auto lang_id = whisper_lang_auto_detect_from_encoder(ctx, state, params.n_threads, probs.data());
+            if (lang_id < 0) {
+                WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+                return -3;
+            }
+            state->lang_id = lang_id;
+            state->lang_id_detected = lang_id;
+            state->lang_n_reuse = params.detect_n_reuse;
+            params.language = whisper_lang_str(lang_id);
+
+            WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
+            if (params.detect_language) {
+                return 0;
+            }
 
-        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
-        if (params.detect_language) {
-            return 0;
+            if (params.detect_audio_ctx > 0) {
+                state->exp_n_audio_ctx = params.audio_ctx;
+            } else if (seek_detect == seek_start) {
+                seek_encoded = seek_start;
+            }
         }
     }
 
@@ -5524,9 +8633,6 @@ int whisper_full_with_state(
         }
     }
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
-
     // if length of spectrogram is less than 1.0s (100 frames), then return
     // basically don't process anything that is less than 1.0s
     // see issue #39: https://github.com/ggml-org/whisper.cpp/issues/39
@@ -5614,13 +8720,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5637,8 +8736,7 @@ int whisper_full_with_state(
 
     // first release distilled models require the "no_timestamps" token
     {
-        const bool is_distil = ctx->model.hparams.n_text_layer == 2 && ctx->model.hparams.n_vocab != 51866;
-        if (is_distil && !params.no_timestamps) {
+        if (whisper_is_distil_v1(*ctx) && !params.no_timestamps) {
             WHISPER_LOG_WARN("%s: using first release distilled models - forcing no_timestamps\n", __func__);
             params.no_timestamps = true;
         }
@@ -5648,8 +8746,55 @@ int whisper_full_with_state(
         prompt_init.push_back(whisper_token_not(ctx));
     }
 
+    // the token suppression rules do not change during the transcription
+    whisper_suppress_init(state->suppress, *ctx, params);
+
+    // [EXPERIMENTAL] speculative decoding
+    bool draft_on = false;
+    if (params.draft_ctx != nullptr && params.draft_n_max > 0) {
+        auto & draft = state->draft;
+
+        if (params.draft_ctx->vocab.n_vocab != ctx->vocab.n_vocab) {
+            WHISPER_LOG_WARN("%s: the draft model has a different vocabulary (%d != %d) - speculative decoding disabled\n",
+                    __func__, params.draft_ctx->vocab.n_vocab, ctx->vocab.n_vocab);
+        } else if (n_samples == 0) {
+            WHISPER_LOG_WARN("%s: the draft model needs the audio samples - speculative decoding disabled\n", __func__);
+        } else {
+            if (draft.ctx != params.draft_ctx) {
+                whisper_free_state(draft.state);
+
+                draft.ctx   = params.draft_ctx;
+                draft.state = whisper_init_state(draft.ctx);
+
+                if (draft.state == nullptr) {
+                    WHISPER_LOG_ERROR("%s: failed to initialize the draft state\n", __func__);
+                    draft.ctx = nullptr;
+                    return -10;
+                }
+            }
+
+            if (whisper_pcm_to_mel_with_state(draft.ctx, draft.state, samples, n_samples, params.n_threads) != 0) {
+                WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram for the draft model\n", __func__);
+                return -2;
+            }
+
+            whisper_suppress_init(draft.state->suppress, *draft.ctx, params);
+
+            draft.tokens.clear();
+            draft.seek = -1;
+
+            draft_on = true;
+        }
+    }
+
     int seek = seek_start;
 
+    // the decoders start each window from a copy of this, so they all share the same rules
+    whisper_grammar grammar;
+    if (params.grammar_rules != nullptr) {
+        grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
+    }
+
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
@@ -5666,6 +8811,9 @@ int whisper_full_with_state(
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    // the draft tokens of the last verification batch, the first draft_i of them have been accepted
+    std::vector<whisper_token> draft_tokens;
+
     // main loop
     while (true) {
         if (params.progress_callback) {
@@ -5687,11 +8835,18 @@ int whisper_full_with_state(
             }
         }
 
+        if (params.audio_ctx_dynamic && params.audio_ctx == 0) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_bucket(*ctx, seek_end - seek);
+        }
+
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        if (seek == seek_encoded) {
+            WHISPER_LOG_DEBUG("%s: reusing the encoder output of the language detection\n", __func__);
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
+        seek_encoded = -1;
 
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
@@ -5701,6 +8856,11 @@ int whisper_full_with_state(
 
         int best_decoder_id = 0;
 
+        // the prompt KV cells depend on the encoder output of the window
+        state->prompt_kv.clear();
+
+        bool no_speech_skip = false;
+
         for (int it = 0; it < (int) temperatures.size(); ++it) {
             const float t_cur = temperatures[it];
 
@@ -5727,6 +8887,14 @@ int whisper_full_with_state(
 
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
+            // the draft tokens are verified against the greedy choice of the model, so other strategies are not supported
+            // the draft model does not follow the grammar either, which would reject most of its tokens
+            bool draft_cur = draft_on && params.strategy == WHISPER_SAMPLING_GREEDY && t_cur < 1e-6f && n_decoders_cur == 1 &&
+                             params.n_grammar_rules == 0;
+            int  draft_i   = 0;
+
+            draft_tokens.clear();
+
             // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
                 auto & decoder = state->decoders[j];
@@ -5745,15 +8913,10 @@ int whisper_full_with_state(
                 decoder.completed = false;
                 decoder.has_ts    = false;
 
-                if (params.grammar_rules != nullptr) {
-                    decoder.grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
-                } else {
-                    decoder.grammar = {};
-                }
+                decoder.grammar = grammar;
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -5784,7 +8947,7 @@ int whisper_full_with_state(
                     // overallocate to workaround KV cache fragmentation issues
                     const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_k, ctx->params.type_v,
                                 ctx->model.hparams.n_text_state,
                                 ctx->model.hparams.n_text_layer,
                                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
@@ -5794,33 +8957,76 @@ int whisper_full_with_state(
                     }
 
                     state->kv_self_n_dec = n_decoders_cur;
+
+                    // the cached decoder graph stores into the old cache
+                    state->dec_graph = {};
+
+                    state->prompt_kv.clear();
                 }
 
-                whisper_kv_cache_clear(state->kv_self);
+                const int n_logits = ctx->vocab.id_to_token.size();
+
+                if (!state->prompt_kv.empty() && state->prompt_kv == prompt) {
+                    // fallback with the same prompt as the previous attempt: restore its KV cells and logits
+                    WHISPER_LOG_DEBUG("%s: reusing the KV cache of the prompt (%d tokens)\n", __func__, (int) prompt.size());
+
+                    whisper_kv_cache_seq_keep(state->kv_self, WHISPER_SEQ_ID_PROMPT);
+                    whisper_kv_cache_seq_cp  (state->kv_self, WHISPER_SEQ_ID_PROMPT, 0, -1, -1);
+
+                    state->logits = state->prompt_kv_logits;
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+
+                    whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+
+                    // the no_speech probability is read at the SOT token, the first token is sampled after the last one
+                    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L689-L693
+                    const int i_sot = prompt.size() - prompt_init.size();
+
+                    state->batch.logits[i_sot] = 1;
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
+
+                    // keep the last token in row 0, as whisper_get_logits() returns it after a single decoding pass
+                    if (state->logits.size() == 2*(size_t) n_logits) {
+                        std::swap_ranges(state->logits.begin(), state->logits.begin() + n_logits, state->logits.begin() + n_logits);
+                    }
+
+                    // keep the prompt cells for the fallbacks of this window
+                    whisper_kv_cache_seq_cp(state->kv_self, 0, WHISPER_SEQ_ID_PROMPT, -1, -1);
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -8;
+                    state->prompt_kv        = prompt;
+                    state->prompt_kv_logits = state->logits;
                 }
 
                 // Calculate no_speech probability after first decode.
                 // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
+                // The SOT token has the last row of the logits.
                 {
-                    const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
                     std::vector<float> probs(n_logits);
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    const auto st = whisper_logits_softmax(state->logits.data() + state->logits.size() - n_logits, n_logits, n_logits, probs.data());
+                    state->no_speech_prob = probs[whisper_token_nosp(ctx)]/(st.sum_text + st.sum_ts);
+                }
+
+                // the window is treated as no speech regardless of the decoded tokens, skip the generation
+                // decoder 0 is left without tokens and with a full window seek_delta
+                if (params.no_speech_margin >= 0.0f && state->no_speech_prob > params.no_speech_thold + params.no_speech_margin) {
+                    WHISPER_LOG_DEBUG("%s: skipping window at seek = %d, no_speech_prob %8.5f > %8.5f + %8.5f\n",
+                            __func__, seek, state->no_speech_prob, params.no_speech_thold, params.no_speech_margin);
+
+                    best_decoder_id = 0;
+                    no_speech_skip  = true;
+                    break;
                 }
 
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
+                    state->decoders[0].i_batch = 0;
 
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
@@ -5848,67 +9054,41 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid memory allocations, optimize
                 {
-                    std::atomic<int> j_cur(0);
-
-                    auto process = [&]() {
-                        while (true) {
-                            const int j = j_cur.fetch_add(1);
-
-                            if (j >= n_decoders_cur) {
-                                break;
-                            }
-
-                            auto & decoder = state->decoders[j];
-
-                            if (decoder.completed || decoder.failed) {
-                                continue;
-                            }
+                    const std::function<void(int)> process = [&](int j) {
+                        auto & decoder = state->decoders[j];
 
-                            switch (params.strategy) {
-                                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                                    {
-                                        if (t_cur < 1e-6f) {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
-                                        } else {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
-                                        }
-
-                                        decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                                    } break;
-                                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                                    {
-                                        const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
-
-                                        for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
-                                        }
-                                    } break;
-                            };
+                        if (decoder.completed || decoder.failed) {
+                            return;
                         }
+
+                        switch (params.strategy) {
+                            case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                                {
+                                    if (t_cur < 1e-6f) {
+                                        decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
+                                    } else {
+                                        decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
+                                    }
+
+                                    decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
+                                } break;
+                            case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                                {
+                                    const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
+
+                                    for (const auto & token : tokens_new) {
+                                        bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
+                                        bc_per_dec[j].back().sequence.tokens.push_back(token);
+                                        bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                    }
+                                } break;
+                        };
                     };
 
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
-                }
+                    whisper_worker_pool_run(state->workers, params.n_threads, n_decoders_cur, process);
+                }
 
                 beam_candidates.clear();
                 for (const auto & bc : bc_per_dec) {
@@ -6083,6 +9263,82 @@ int whisper_full_with_state(
 
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
+                // [EXPERIMENTAL] speculative decoding
+                // obtain the logits for the next token from the last verification batch if the token matches the draft,
+                // otherwise verify a new draft of the tokens that follow it in a single batch
+                if (draft_cur) {
+                    auto & decoder = state->decoders[0];
+                    auto & batch   = state->batch;
+
+                    const whisper_token id = decoder.sequence.tokens.back().id;
+
+                    const int n_past = prompt.size() + i;
+
+                    if (draft_i < (int) draft_tokens.size() && draft_tokens[draft_i] == id) {
+                        // the logits of the accepted token are in the next row of the batch
+                        decoder.i_batch = ++draft_i;
+
+                        state->n_accept++;
+
+                        const int64_t t_start_sample_us = ggml_time_us();
+
+                        whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+
+                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                        continue;
+                    }
+
+                    // remove the KV cells of the rejected draft tokens
+                    if (draft_i < (int) draft_tokens.size()) {
+                        whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+                    }
+
+                    const int n_draft = std::min(std::min(params.draft_n_max, WHISPER_MAX_DRAFT), std::min(n_max - 1 - i, whisper_n_text_ctx(ctx) - 1 - n_past));
+
+                    draft_tokens.clear();
+                    draft_i = 0;
+
+                    if (n_draft > 0) {
+                        const int64_t t_start_draft_us = ggml_time_us();
+
+                        if (!whisper_draft_propose(state->draft, decoder, prompt, params, seek, state->exp_n_audio_ctx, n_draft, draft_tokens)) {
+                            WHISPER_LOG_WARN("%s: failed to propose draft tokens - speculative decoding disabled for this segment\n", __func__);
+
+                            draft_tokens.clear();
+                            draft_cur = false;
+                        }
+
+                        state->t_draft_us += ggml_time_us() - t_start_draft_us;
+                        state->n_draft    += draft_tokens.size();
+                    }
+
+                    batch.n_tokens = 1 + draft_tokens.size();
+
+                    for (int j = 0; j < batch.n_tokens; ++j) {
+                        batch.token   [j]    = j == 0 ? id : draft_tokens[j - 1];
+                        batch.pos     [j]    = n_past + j;
+                        batch.n_seq_id[j]    = 1;
+                        batch.seq_id  [j][0] = 0;
+                        batch.logits  [j]    = 1;
+                    }
+
+                    if (!whisper_decode_internal(*ctx, *state, batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -9;
+                    }
+
+                    decoder.i_batch = 0;
+
+                    const int64_t t_start_sample_us = ggml_time_us();
+
+                    whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                    continue;
+                }
+
                 // obtain logits for the next token
                 {
                     auto & batch = state->batch;
@@ -6119,45 +9375,19 @@ int whisper_full_with_state(
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
+                    // TODO: avoid memory allocations, optimize
                     {
-                        std::atomic<int> j_cur(0);
-
-                        auto process = [&]() {
-                            while (true) {
-                                const int j = j_cur.fetch_add(1);
-
-                                if (j >= n_decoders_cur) {
-                                    break;
-                                }
-
-                                auto & decoder = state->decoders[j];
-
-                                if (decoder.failed || decoder.completed) {
-                                    continue;
-                                }
-
-                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
-                            }
-                        };
-
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
+                        const std::function<void(int)> process = [&](int j) {
+                            auto & decoder = state->decoders[j];
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
+                            if (decoder.failed || decoder.completed) {
+                                return;
                             }
 
-                            process();
+                            whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                        };
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
+                        whisper_worker_pool_run(state->workers, params.n_threads, n_decoders_cur, process);
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -6239,7 +9469,7 @@ int whisper_full_with_state(
             // [EXPERIMENTAL] Token-level timestamps with DTW
             const auto n_segments_before = state->result_all.size();
 
-            const bool is_no_speech = (state->no_speech_prob > params.no_speech_thold &&
+            const bool is_no_speech = no_speech_skip || (state->no_speech_prob > params.no_speech_thold &&
                 best_decoder.sequence.avg_logprobs < params.logprob_thold);
 
             //WHISPER_LOG_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
@@ -6402,6 +9632,88 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
+// whisper_full_parallel() cuts the audio in jobs of about WHISPER_PARALLEL_JOB_MS at the quietest point of the last
+// WHISPER_PARALLEL_CUT_MS, so that the boundaries fall in the pauses between words instead of at arbitrary samples
+// when the segments have timestamps, each job also decodes the first WHISPER_PARALLEL_OVERLAP_MS of the next one and
+// the duplicated segments are dropped when stitching the results together
+#define WHISPER_PARALLEL_JOB_MS     29000
+#define WHISPER_PARALLEL_CUT_MS     5000
+#define WHISPER_PARALLEL_OVERLAP_MS 1000
+
+struct whisper_parallel_job {
+    int i0; // first sample
+    int i1; // first sample of the next job
+    int i2; // end of the decoded audio, including the overlap with the next job
+
+    int ret = 0;
+
+    std::vector<whisper_segment> result;
+};
+
+// the jobs of a worker are [next, end) - the owner takes them from the front, while the idle workers steal from the back
+struct whisper_parallel_worker {
+    std::mutex mutex;
+
+    int next = 0;
+    int end  = 0;
+
+    int     n_jobs    = 0;
+    int     n_stolen  = 0;
+    int64_t t_busy_us = 0;
+};
+
+static std::vector<whisper_parallel_job> whisper_parallel_split(const float * samples, int i_beg, int i_end, bool overlap) {
+    const int n_frame   = WHISPER_SAMPLE_RATE/100; // 10 ms
+    const int n_window  = 10;                      // 100 ms
+    const int n_job     = (WHISPER_SAMPLE_RATE/1000)*WHISPER_PARALLEL_JOB_MS;
+    const int n_cut     = (WHISPER_SAMPLE_RATE/1000)*WHISPER_PARALLEL_CUT_MS;
+    const int n_overlap = overlap ? (WHISPER_SAMPLE_RATE/1000)*WHISPER_PARALLEL_OVERLAP_MS : 0;
+
+    std::vector<whisper_parallel_job> jobs;
+    std::vector<float> energy(n_cut/n_frame);
+
+    int pos = i_beg;
+    while (i_end - pos > n_job + n_overlap) {
+        const int i_search = pos + n_job - n_cut;
+
+        for (size_t f = 0; f < energy.size(); ++f) {
+            const float * x = samples + i_search + f*n_frame;
+
+            float sum = 0.0f;
+            for (int k = 0; k < n_frame; ++k) {
+                sum += x[k]*x[k];
+            }
+            energy[f] = sum;
+        }
+
+        // the quietest window of n_window frames
+        float sum = 0.0f;
+        for (int f = 0; f < n_window; ++f) {
+            sum += energy[f];
+        }
+
+        float sum_min = sum;
+        int   f_min   = 0;
+        for (int f = n_window; f < (int) energy.size(); ++f) {
+            sum += energy[f] - energy[f - n_window];
+            if (sum < sum_min) {
+                sum_min = sum;
+                f_min   = f - n_window + 1;
+            }
+        }
+
+        const int cut = i_search + (f_min + n_window/2)*n_frame;
+
+        jobs.push_back({ pos, cut, std::min(cut + n_overlap, i_end), 0, {} });
+
+        pos = cut;
+    }
+
+    jobs.push_back({ pos, i_end, i_end, 0, {} });
+
+    return jobs;
+}
+
 int whisper_full_parallel(
         struct whisper_context * ctx,
         struct whisper_full_params params,
@@ -6411,481 +9723,1247 @@ int whisper_full_parallel(
     if (n_processors == 1) {
         return whisper_full(ctx, params, samples, n_samples);
     }
+
+    const int i_beg = std::min(n_samples, (WHISPER_SAMPLE_RATE*params.offset_ms)/1000);
+    const int i_end = params.duration_ms > 0 ? std::min(n_samples, i_beg + (WHISPER_SAMPLE_RATE*params.duration_ms)/1000) : n_samples;
+
+    // the overlap can be reconciled only if the segments have timestamps
+    const bool overlap = !params.no_timestamps && !params.single_segment && !whisper_is_distil_v1(*ctx);
+
+    std::vector<whisper_parallel_job> jobs = whisper_parallel_split(samples, i_beg, i_end, overlap);
+
+    const int n_jobs = jobs.size();
+
+    // the calling thread uses the default state, the other workers acquire their states from the pool of the context,
+    // so that the next calls do not have to allocate them again
+    std::vector<whisper_state *> states;
+    for (int i = 1; i < std::min(n_processors, n_jobs); ++i) {
+        whisper_state * state = whisper_state_acquire(ctx);
+        if (state == nullptr) {
+            WHISPER_LOG_WARN("%s: failed to acquire a state for worker %d, using %d workers\n", __func__, i, i);
+            break;
+        }
+        states.push_back(state);
+    }
+
+    struct whisper_state_pool_release {
+        whisper_context * ctx;
+        std::vector<whisper_state *> & states;
+
+        ~whisper_state_pool_release() {
+            for (whisper_state * state : states) {
+                whisper_state_release(ctx, state);
+            }
+        }
+    } states_release = { ctx, states };
+
+    const int n_workers = 1 + (int) states.size();
+
+    // consecutive jobs are given to the same worker, so that it can carry the text context from one job to the next
+    std::vector<whisper_parallel_worker> workers(n_workers);
+    for (int i = 0; i < n_workers; ++i) {
+        workers[i].next = (n_jobs*i)/n_workers;
+        workers[i].end  = (n_jobs*(i + 1))/n_workers;
+    }
+
+    std::atomic<int>  n_done(0);
+    std::atomic<bool> failed(false);
+
+    auto run = [&](int iw) {
+        whisper_state * state = iw == 0 ? ctx->state : states[iw - 1];
+
+        auto & worker = workers[iw];
+
+        // the job last processed with this state - the default state may continue the context of the previous call
+        int last = iw == 0 ? -1 : -2;
+
+        while (!failed) {
+            int  ij     = -1;
+            bool stolen = false;
+
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                if (worker.next < worker.end) {
+                    ij = worker.next++;
+                }
+            }
+
+            // steal the last job of the worker with the most remaining work
+            while (ij < 0) {
+                int iv    = -1;
+                int n_max = 0;
+
+                for (int i = 0; i < n_workers; ++i) {
+                    std::lock_guard<std::mutex> lock(workers[i].mutex);
+                    if (workers[i].end - workers[i].next > n_max) {
+                        n_max = workers[i].end - workers[i].next;
+                        iv    = i;
+                    }
+                }
+
+                if (iv < 0) {
+                    break;
+                }
+
+                std::lock_guard<std::mutex> lock(workers[iv].mutex);
+                if (workers[iv].next < workers[iv].end) {
+                    ij     = --workers[iv].end;
+                    stolen = true;
+                }
+            }
+
+            if (ij < 0) {
+                break;
+            }
+
+            auto & job = jobs[ij];
+
+            auto params_cur = params;
+
+            params_cur.offset_ms   = 0;
+            params_cur.duration_ms = 0;
+            params_cur.no_context  = params.no_context || ij != last + 1;
+
+            params_cur.print_progress = false;
+            params_cur.print_realtime = false;
+
+            params_cur.new_segment_callback = nullptr;
+            params_cur.new_segment_callback_user_data = nullptr;
+
+            params_cur.progress_callback = nullptr;
+            params_cur.progress_callback_user_data = nullptr;
+
+            const int64_t t_start_us = ggml_time_us();
+
+            job.ret = whisper_full_with_state(ctx, state, params_cur, samples + job.i0, job.i2 - job.i0);
+
+            worker.t_busy_us += ggml_time_us() - t_start_us;
+            worker.n_jobs    += 1;
+            worker.n_stolen  += stolen;
+
+            last = ij;
+
+            if (job.ret != 0) {
+                failed = true;
+                break;
+            }
+
+            // move the results to absolute time
+            const int64_t t_offset = (100ll*job.i0)/WHISPER_SAMPLE_RATE;
+
+            job.result = std::move(state->result_all);
+            state->result_all.clear();
+
+            for (auto & segment : job.result) {
+                segment.t0 += t_offset;
+                segment.t1 += t_offset;
+
+                for (auto & token : segment.tokens) {
+                    if (token.t0    >= 0) { token.t0    += t_offset; }
+                    if (token.t1    >= 0) { token.t1    += t_offset; }
+                    if (token.t_dtw >= 0) { token.t_dtw += t_offset; }
+                }
+            }
+
+            const int n_done_cur = ++n_done;
+
+            if (iw == 0 && params.progress_callback) {
+                params.progress_callback(ctx, ctx->state, (100*n_done_cur)/n_jobs, params.progress_callback_user_data);
+            }
+        }
+    };
+
+    const int64_t t_start_us = ggml_time_us();
+
+    std::vector<std::thread> threads(n_workers - 1);
+    for (int i = 0; i < n_workers - 1; ++i) {
+        threads[i] = std::thread(run, i + 1);
+    }
+
+    run(0);
+
+    for (int i = 0; i < n_workers - 1; ++i) {
+        threads[i].join();
+    }
+
+    const int64_t t_wall_us = std::max<int64_t>(1, ggml_time_us() - t_start_us);
+
     int ret = 0;
+    for (const auto & job : jobs) {
+        if (job.ret != 0) {
+            ret = job.ret;
+            break;
+        }
+    }
+
+    // stitch the results of the jobs in order
+    auto & result_all = ctx->state->result_all;
+    result_all.clear();
+
+    for (int i = 0; i < n_jobs && ret == 0; ++i) {
+        const int64_t t_cut = (100ll*jobs[i].i1)/WHISPER_SAMPLE_RATE;
+
+        for (auto & segment : jobs[i].result) {
+            if (overlap && i < n_jobs - 1 && segment.t0 >= t_cut) {
+                // this segment is decoded again by the next job, with its full context
+                continue;
+            }
+
+            if (!result_all.empty()) {
+                if (overlap && (segment.t0 + segment.t1)/2 < result_all.back().t1) {
+                    // already transcribed by the previous job
+                    continue;
+                }
+
+                // make sure that segments are not overlapping
+                segment.t0 = std::max(segment.t0, result_all.back().t1);
+                segment.t1 = std::max(segment.t1, segment.t0);
+            }
+
+            result_all.push_back(std::move(segment));
+
+            // call the new_segment_callback for each segment
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            }
+        }
+    }
+
+    for (int i = 0; i < n_workers - 1; ++i) {
+        const whisper_state * state = states[i];
+
+        ctx->state->t_mel_us += state->t_mel_us;
+
+        ctx->state->t_sample_us += state->t_sample_us;
+        ctx->state->t_encode_us += state->t_encode_us;
+        ctx->state->t_decode_us += state->t_decode_us;
+        ctx->state->t_batchd_us += state->t_batchd_us;
+        ctx->state->t_prompt_us += state->t_prompt_us;
+        ctx->state->t_draft_us  += state->t_draft_us;
+        ctx->state->t_dtw_us    += state->t_dtw_us;
+
+        ctx->state->n_sample += state->n_sample;
+        ctx->state->n_encode += state->n_encode;
+        ctx->state->n_decode += state->n_decode;
+        ctx->state->n_batchd += state->n_batchd;
+        ctx->state->n_prompt += state->n_prompt;
+        ctx->state->n_draft  += state->n_draft;
+        ctx->state->n_accept += state->n_accept;
+        ctx->state->n_dtw    += state->n_dtw;
+    }
+
+    // average the timings
+    ctx->state->t_mel_us    /= n_workers;
+    ctx->state->t_sample_us /= n_workers;
+    ctx->state->t_encode_us /= n_workers;
+    ctx->state->t_decode_us /= n_workers;
+
+    // print information about the audio boundaries and the load of the workers
+    WHISPER_LOG_INFO("%s: the audio has been split into %d jobs for %d workers\n", __func__, n_jobs, n_workers);
+    for (int i = 0; i < n_jobs - 1; ++i) {
+        WHISPER_LOG_DEBUG("%s: split %d - %s\n", __func__, (i + 1), to_timestamp((100ll*jobs[i].i1)/WHISPER_SAMPLE_RATE).c_str());
+    }
+    for (int i = 0; i < n_workers; ++i) {
+        WHISPER_LOG_INFO("%s: worker %d - %3d jobs (%3d stolen), busy %5.1f%% of %8.2f ms\n", __func__,
+                i, workers[i].n_jobs, workers[i].n_stolen, (100.0*workers[i].t_busy_us)/t_wall_us, t_wall_us/1000.0);
+    }
+
+    return ret;
+}
+
+int whisper_full_n_segments_from_state(struct whisper_state * state) {
+    return state->result_all.size();
+}
+
+int whisper_full_n_segments(struct whisper_context * ctx) {
+    return ctx->state->result_all.size();
+}
+
+int whisper_full_lang_id_from_state(struct whisper_state * state) {
+    return state->lang_id;
+}
+
+int whisper_full_lang_id(struct whisper_context * ctx) {
+    return ctx->state->lang_id;
+}
+
+int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t0;
+}
+
+int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].t0;
+}
+
+int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t1;
+}
+
+int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].t1;
+}
+
+bool whisper_full_get_segment_speaker_turn_next_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].speaker_turn_next;
+}
+
+bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].speaker_turn_next;
+}
+
+const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].text.c_str();
+}
+
+const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].text.c_str();
+}
+
+int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].tokens.size();
+}
+
+int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].tokens.size();
+}
+
+const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
+}
+
+const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+}
+
+whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].id;
+}
+
+whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token].id;
+}
+
+struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token];
+}
+
+struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token];
+}
+
+float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].p;
+}
+
+float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token].p;
+}
+
+float whisper_full_get_segment_no_speech_prob(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].no_speech_prob;
+}
+
+float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].no_speech_prob;
+}
+
+// =================================================================================================
+
+//
+// Temporary interface needed for exposing ggml interface
+// Will be removed in the future when ggml becomes a separate library
+//
+
+WHISPER_API int whisper_bench_memcpy(int n_threads) {
+    fputs(whisper_bench_memcpy_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    size_t n    = 20;
+    size_t arr  = n_threads > 0 ? 1024llu : n_threads; // trick to avoid compiler optimizations
+
+    // 1GB array
+    const size_t size = arr*1e6;
+
+    double sum  = 0.0;
+
+    // heat-up
+    {
+        char * src = (char *) malloc(size);
+        char * dst = (char *) malloc(size);
+
+        for (size_t i = 0; i < size; i++) src[i] = i;
+
+        memcpy(dst, src, size); // heat-up
+
+        double tsum = 0.0;
+
+        for (size_t i = 0; i < n; i++) {
+            const int64_t t0 = ggml_time_us();
+
+            memcpy(dst, src, size);
+
+            const int64_t t1 = ggml_time_us();
+
+            tsum += (t1 - t0)*1e-6;
+
+            src[rand() % size] = rand() % 256;
+        }
+
+        snprintf(strbuf, sizeof(strbuf), "memcpy: %7.2f GB/s (heat-up)\n", (double) (n*size)/(tsum*1e9));
+        s += strbuf;
+
+        // needed to prevent the compiler from optimizing the memcpy away
+        {
+            for (size_t i = 0; i < size; i++) sum += dst[i];
+        }
+
+        free(src);
+        free(dst);
+    }
+
+    // single-thread
+    {
+        char * src = (char *) malloc(size);
+        char * dst = (char *) malloc(size);
+
+        for (size_t i = 0; i < size; i++) src[i] = i;
+
+        memcpy(dst, src, size); // heat-up
+
+        double tsum = 0.0;
+
+        for (size_t i = 0; i < n; i++) {
+            const int64_t t0 = ggml_time_us();
+
+            memcpy(dst, src, size);
+
+            const int64_t t1 = ggml_time_us();
+
+            tsum += (t1 - t0)*1e-6;
+
+            src[rand() % size] = rand() % 256;
+        }
+
+        snprintf(strbuf, sizeof(strbuf), "memcpy: %7.2f GB/s ( 1 thread)\n", (double) (n*size)/(tsum*1e9));
+        s += strbuf;
+
+        // needed to prevent the compiler from optimizing the memcpy away
+        {
+            for (size_t i = 0; i < size; i++) sum += dst[i];
+        }
+
+        free(src);
+        free(dst);
+    }
+
+    // multi-thread
+
+    for (int32_t k = 1; k <= n_threads; k++) {
+        char * src = (char *) malloc(size);
+        char * dst = (char *) malloc(size);
+
+        for (size_t i = 0; i < size; i++) src[i] = i;
+
+        memcpy(dst, src, size); // heat-up
+
+        double tsum = 0.0;
+
+        auto helper = [&](int th) {
+            const int64_t i0 = (th + 0)*size/k;
+            const int64_t i1 = (th + 1)*size/k;
+
+            for (size_t i = 0; i < n; i++) {
+                memcpy(dst + i0, src + i0, i1 - i0);
+
+                src[i0 + rand() % (i1 - i0)] = rand() % 256;
+            };
+        };
+
+        const int64_t t0 = ggml_time_us();
+
+        std::vector<std::thread> threads(k - 1);
+        for (int32_t th = 0; th < k - 1; ++th) {
+            threads[th] = std::thread(helper, th);
+        }
+
+        helper(k - 1);
+
+        for (int32_t th = 0; th < k - 1; ++th) {
+            threads[th].join();
+        }
+
+        const int64_t t1 = ggml_time_us();
+
+        tsum += (t1 - t0)*1e-6;
+
+        snprintf(strbuf, sizeof(strbuf), "memcpy: %7.2f GB/s (%2d thread)\n", (double) (n*size)/(tsum*1e9), k);
+        s += strbuf;
+
+        // needed to prevent the compiler from optimizing the memcpy away
+        {
+            for (size_t i = 0; i < size; i++) sum += dst[i];
+        }
+
+        free(src);
+        free(dst);
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "sum:    %f\n", sum);
+    s += strbuf;
+
+    return s.c_str();
+}
+
+WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads) {
+    fputs(whisper_bench_ggml_mul_mat_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
+    whisper_load_backends();
+
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int n_max = 128;
+
+    const std::vector<size_t> sizes = {
+        64, 128, 256, 512, 1024, 2048, 4096,
+    };
+
+    const size_t N_max = sizes.back();
+
+    // a: N*N*sizeof(float)
+    // b: N*N*sizeof(float)
+    // c: N*N*sizeof(float)
+    // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
+    std::vector<uint8_t> buf(3llu*N_max*N_max*sizeof(float) + 3*ggml_tensor_overhead() + ggml_graph_overhead());
+
+    // put a bunch of random data in the buffer
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
+
+    for (int j = 0; j < (int) sizes.size(); j++) {
+        int n_q4_0 = 0;
+        int n_q4_1 = 0;
+        int n_q5_0 = 0;
+        int n_q5_1 = 0;
+        int n_q8_0 = 0;
+        int n_fp16 = 0;
+        int n_fp32 = 0;
+
+        // GFLOPS/s
+        double s_q4_0 = 0.0;
+        double s_q4_1 = 0.0;
+        double s_q5_0 = 0.0;
+        double s_q5_1 = 0.0;
+        double s_q8_0 = 0.0;
+        double s_fp16 = 0.0;
+        double s_fp32 = 0.0;
+
+        const size_t N = sizes[j];
+
+        for (int k = 0; k < 7; ++k) {
+            const ggml_type wtype =
+                k == 0 ? GGML_TYPE_Q4_0 :
+                k == 1 ? GGML_TYPE_Q4_1 :
+                k == 2 ? GGML_TYPE_Q5_0 :
+                k == 3 ? GGML_TYPE_Q5_1 :
+                k == 4 ? GGML_TYPE_Q8_0 :
+                k == 5 ? GGML_TYPE_F16  : GGML_TYPE_F32;
+
+            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : /*k == 6*/ s_fp32;
+            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : /*k == 6*/ n_fp32;
+
+            struct ggml_init_params gparams = {
+                /*.mem_size   =*/ buf.size(),
+                /*.mem_buffer =*/ buf.data(),
+                /*.no_alloc   =*/ false,
+            };
+
+            struct ggml_context * ctx0 = ggml_init(gparams);
+
+            struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, wtype,         N, N);
+            struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
+
+            struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
+
+            struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+            ggml_build_forward_expand(gf, c);
+
+            double tsum = 0.0;
+
+            // heat-up
+            ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+
+            for (int i = 0; i < n_max; ++i) {
+                const int64_t t0 = ggml_time_us();
+
+                ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+
+                const int64_t t1 = ggml_time_us();
+
+                tsum += (t1 - t0)*1e-6;
+                n++;
+
+                if (tsum > 1.0 && n >= 3) {
+                    break;
+                }
+            }
+
+            ggml_free(ctx0);
+
+            s = ((2.0*N*N*N*n)/tsum)*1e-9;
+        }
+
+        // Q4_0 | Q4_1
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q4_0 %7.1f GFLOPS (%3d runs) | Q4_1 %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_q4_0, n_q4_0, s_q4_1, n_q4_1);
+        s += strbuf;
+
+        // Q5_0 | Q5_1 | Q8_0
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q5_0 %7.1f GFLOPS (%3d runs) | Q5_1 %7.1f GFLOPS (%3d runs) | Q8_0 %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_q5_0, n_q5_0, s_q5_1, n_q5_1, s_q8_0, n_q8_0);
+        s += strbuf;
+
+        // F16 | F32
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_fp16, n_fp16, s_fp32, n_fp32);
+        s += strbuf;
+    }
+
+    return s.c_str();
+}
+
+WHISPER_API int whisper_bench_conv_stem(int n_threads) {
+    fputs(whisper_bench_conv_stem_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_conv_stem_str(int n_threads) {
+    whisper_load_backends();
+
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int n_max = 16;
+
+    // encoder conv stem of a full 30 s window: [3000, n_mels] -> [1500, n_state]
+    const int n_mels = 80;
+    const int n_len  = 2*1500;
+
+    const std::vector<int> sizes = {
+        384, 512, 768, 1024, 1280,
+    };
+
+    for (int n_state : sizes) {
+        // 0 - im2col + mul_mat, 1 - fused kernel
+        double t_ms[2] = { 0.0, 0.0 };
+        size_t n_mem[2] = { 0, 0 };
+        int    n_run[2] = { 0, 0 };
+
+        float max_diff = 0.0f;
+
+        std::vector<float> ref;
+
+        for (int k = 0; k < 2; ++k) {
+            // weights, biases, input, the intermediate results of the im2col path and some headroom
+            const size_t mem_size = (size_t) (3*n_mels*n_state + 3*n_state*n_state)*sizeof(ggml_fp16_t) +
+                                    (size_t) (n_len*n_mels)*sizeof(float) +
+                                    (size_t) (n_len*3*n_mels + n_len/2*3*n_state)*sizeof(ggml_fp16_t) +
+                                    (size_t) (3*n_len*n_state + 3*n_len/2*n_state + 2*n_state)*sizeof(float) +
+                                    32*ggml_tensor_overhead() + ggml_graph_overhead() + 1024*1024;
+
+            struct ggml_init_params gparams = {
+                /*.mem_size   =*/ mem_size,
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ false,
+            };
+
+            struct ggml_context * ctx0 = ggml_init(gparams);
+
+            struct ggml_tensor * w1  = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, 3, n_mels,  n_state);
+            struct ggml_tensor * b1  = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, n_state);
+            struct ggml_tensor * w2  = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, 3, n_state, n_state);
+            struct ggml_tensor * b2  = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, n_state);
+            struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_len, n_mels);
+
+            // deterministic pseudo-random data, same for both paths
+            {
+                std::mt19937 rng(1);
+                std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+                for (auto * t : { w1, w2 }) {
+                    const float scale = 1.0f/sqrtf((float) t->ne[0]*t->ne[1]);
+                    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+                        ((ggml_fp16_t *) t->data)[i] = ggml_fp32_to_fp16(scale*dist(rng));
+                    }
+                }
+                for (auto * t : { b1, b2, mel }) {
+                    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+                        ((float *) t->data)[i] = 0.1f*dist(rng);
+                    }
+                }
+            }
+
+            struct ggml_tensor * cur = nullptr;
+
+            if (k == 0) {
+                cur = ggml_conv_1d_ph(ctx0, w1, mel, 1, 1);
+                cur = ggml_gelu(ctx0, ggml_add(ctx0, cur, b1));
+                cur = ggml_conv_1d_ph(ctx0, w2, cur, 2, 1);
+                cur = ggml_gelu(ctx0, ggml_add(ctx0, cur, b2));
+            } else {
+                cur = whisper_build_conv_gelu(ctx0, w1, b1, mel, &g_conv1d_gelu_s1);
+                cur = whisper_build_conv_gelu(ctx0, w2, b2, cur, &g_conv1d_gelu_s2);
+            }
+
+            struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+            ggml_build_forward_expand(gf, cur);
+
+            // memory of all intermediate tensors, without reuse
+            for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+                struct ggml_tensor * node = ggml_graph_node(gf, i);
+                if (node->view_src == nullptr) {
+                    n_mem[k] += ggml_nbytes(node);
+                }
+            }
+
+            double tsum = 0.0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+            // heat-up
+            ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+            for (int i = 0; i < n_max; ++i) {
+                const int64_t t0 = ggml_time_us();
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+                ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+                const int64_t t1 = ggml_time_us();
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+                tsum += (t1 - t0)*1e-6;
+                n_run[k]++;
 
-        auto params_cur = params;
+                if (tsum > 1.0 && n_run[k] >= 3) {
+                    break;
+                }
+            }
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
-        params_cur.print_realtime = false;
+            t_ms[k] = 1e3*tsum/n_run[k];
 
-        params_cur.new_segment_callback = nullptr;
-        params_cur.new_segment_callback_user_data = nullptr;
+            const float * res = (const float *) cur->data;
+            if (k == 0) {
+                ref.assign(res, res + ggml_nelements(cur));
+            } else {
+                for (int64_t i = 0; i < ggml_nelements(cur); ++i) {
+                    max_diff = std::max(max_diff, fabsf(res[i] - ref[i]));
+                }
+            }
 
-        params_cur.progress_callback = nullptr;
-        params_cur.progress_callback_user_data = nullptr;
+            ggml_free(ctx0);
+        }
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        snprintf(strbuf, sizeof(strbuf), "conv %4d: im2col %8.2f ms (%3d runs, %7.2f MB) | fused %8.2f ms (%3d runs, %7.2f MB) | max diff %.2e\n",
+                n_state, t_ms[0], n_run[0], n_mem[0]/1e6, t_ms[1], n_run[1], n_mem[1]/1e6, max_diff);
+        s += strbuf;
     }
 
-    {
-        auto params_cur = params;
+    return s.c_str();
+}
 
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+WHISPER_API int whisper_bench_logits(int n_threads) {
+    fputs(whisper_bench_logits_str(n_threads), stderr);
+    return 0;
+}
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
-    }
+WHISPER_API const char * whisper_bench_logits_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
-    }
+    ggml_time_init();
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    // the logits are processed by the thread that samples the token
+    GGML_UNUSED(n_threads);
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+    const int n_max = 1000;
 
-        for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+    // English-only, multilingual and large-v3 vocabularies; timestamps start 1501 tokens before the end
+    const std::vector<int> sizes = {
+        51864, 51865, 51866,
+    };
 
-            // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
-            }
+    for (int n_vocab : sizes) {
+        const int n_text = n_vocab - 1501;
 
-            ctx->state->result_all.push_back(std::move(result));
+        std::vector<float> src(n_vocab);
+        {
+            std::mt19937 rng(1);
+            std::normal_distribution<float> dist(0.0f, 4.0f);
 
-            // call the new_segment_callback for each segment
-            if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            for (auto & x : src) {
+                x = dist(rng);
             }
-        }
-
-        ctx->state->t_mel_us += states[i]->t_mel_us;
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
-        ctx->state->t_batchd_us += states[i]->t_batchd_us;
-        ctx->state->t_prompt_us += states[i]->t_prompt_us;
-
-        ctx->state->n_sample += states[i]->n_sample;
-        ctx->state->n_encode += states[i]->n_encode;
-        ctx->state->n_decode += states[i]->n_decode;
-        ctx->state->n_batchd += states[i]->n_batchd;
-        ctx->state->n_prompt += states[i]->n_prompt;
+            // some suppressed tokens, as after the logit filters
+            for (int i = 0; i < n_vocab; i += 97) {
+                src[i] = -INFINITY;
+            }
+        }
 
-        whisper_free_state(states[i]);
-    }
+        std::vector<float> logits(n_vocab);
 
-    // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+        // 0 - scalar reference, 1 - whisper_logits_softmax + whisper_logits_normalize
+        std::vector<float> logprobs[2] = { std::vector<float>(n_vocab), std::vector<float>(n_vocab) };
+        std::vector<float> probs   [2] = { std::vector<float>(n_vocab), std::vector<float>(n_vocab) };
 
-    // print information about the audio boundaries
-    WHISPER_LOG_WARN("\n");
-    WHISPER_LOG_WARN("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        WHISPER_LOG_WARN("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
-    }
-    WHISPER_LOG_WARN("%s: the transcription quality may be degraded near these boundaries\n", __func__);
+        double t_us[2] = { 0.0, 0.0 };
+        float  ts_lp[2] = { 0.0f, 0.0f };
 
-    return ret;
-}
+        for (int k = 0; k < 2; ++k) {
+            auto & lp = logprobs[k];
+            auto & p  = probs[k];
 
-int whisper_full_n_segments_from_state(struct whisper_state * state) {
-    return state->result_all.size();
-}
+            int64_t t_sum = 0;
 
-int whisper_full_n_segments(struct whisper_context * ctx) {
-    return ctx->state->result_all.size();
-}
+            for (int it = 0; it < n_max + 1; ++it) {
+                const int64_t t0 = ggml_time_us();
 
-int whisper_full_lang_id_from_state(struct whisper_state * state) {
-    return state->lang_id;
-}
+                // temperature, as in whisper_process_logits()
+                for (int i = 0; i < n_vocab; ++i) {
+                    logits[i] = src[i]/0.5f;
+                }
 
-int whisper_full_lang_id(struct whisper_context * ctx) {
-    return ctx->state->lang_id;
-}
+                if (k == 0) {
+                    const float max = *std::max_element(logits.begin(), logits.end());
+                    float sum = 0.0f;
+                    for (int i = 0; i < n_vocab; ++i) {
+                        if (logits[i] > -INFINITY) {
+                            sum += expf(logits[i] - max);
+                        }
+                    }
+                    const float lse = logf(sum) + max;
+                    for (int i = 0; i < n_vocab; ++i) {
+                        lp[i] = logits[i] > -INFINITY ? logits[i] - lse : -INFINITY;
+                    }
 
-int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].t0;
-}
+                    const float max_ts = *std::max_element(lp.begin() + n_text, lp.end());
+                    float sum_ts = 0.0f;
+                    for (int i = n_text; i < n_vocab; ++i) {
+                        if (lp[i] > -INFINITY) {
+                            sum_ts += expf(lp[i] - max_ts);
+                        }
+                    }
+                    ts_lp[k] = logf(sum_ts) + max_ts;
 
-int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].t0;
-}
+                    for (int i = 0; i < n_vocab; ++i) {
+                        p[i] = logits[i] == -INFINITY ? 0.0f : expf(lp[i]);
+                    }
+                } else {
+                    const auto st = whisper_logits_softmax(logits.data(), n_vocab, n_text, p.data());
+                    ts_lp[k] = logf(st.sum_ts) + st.max - st.logsumexp();
+                    whisper_logits_normalize(logits.data(), n_vocab, st, lp.data(), p.data());
+                }
 
-int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].t1;
-}
+                const int64_t t1 = ggml_time_us();
 
-int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].t1;
-}
+                // skip the heat-up
+                if (it > 0) {
+                    t_sum += t1 - t0;
+                }
+            }
 
-bool whisper_full_get_segment_speaker_turn_next_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].speaker_turn_next;
-}
+            t_us[k] = (double) t_sum/n_max;
+        }
 
-bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].speaker_turn_next;
-}
+        float max_diff_p  = 0.0f;
+        float max_diff_lp = 0.0f;
+        for (int i = 0; i < n_vocab; ++i) {
+            max_diff_p = std::max(max_diff_p, fabsf(probs[1][i] - probs[0][i]));
+            if (logprobs[0][i] > -INFINITY) {
+                max_diff_lp = std::max(max_diff_lp, fabsf(logprobs[1][i] - logprobs[0][i]));
+            }
+        }
 
-const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].text.c_str();
-}
+        snprintf(strbuf, sizeof(strbuf), "logits %5d: scalar %8.2f us/token | fused %8.2f us/token | speed-up %5.2fx | max diff p %.2e, logp %.2e, ts logp %.2e\n",
+                n_vocab, t_us[0], t_us[1], t_us[0]/t_us[1], max_diff_p, max_diff_lp, fabsf(ts_lp[1] - ts_lp[0]));
+        s += strbuf;
+    }
 
-const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].text.c_str();
+    return s.c_str();
 }
 
-int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].tokens.size();
+WHISPER_API int whisper_bench_decoder(struct whisper_context * ctx, int n_threads) {
+    fputs(whisper_bench_decoder_str(ctx, n_threads), stderr);
+    return 0;
 }
 
-int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].tokens.size();
-}
+WHISPER_API const char * whisper_bench_decoder_str(struct whisper_context * ctx, int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
-}
+    ggml_time_init();
 
-const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
-}
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        s = "failed to initialize the state\n";
+        return s.c_str();
+    }
 
-whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token].id;
-}
+    // there is no encoder pass, the cross-attention cache only has to hold finite values
+    ggml_backend_buffer_clear(state->kv_cross.buffer, 0);
 
-whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token].id;
-}
+    const int n_max = ctx->model.hparams.n_text_ctx;
 
-struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token];
-}
+    const whisper_token token = whisper_token_sot(ctx);
 
-struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token];
-}
+    // 0 - the graph is built and allocated on each step, 1 - the graph is reused within a bucket
+    double t_us[2] = { 0.0, 0.0 };
 
-float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token].p;
-}
+    // number of distinct buckets in the reuse run
+    int n_graphs = 0;
 
-float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token].p;
-}
+    for (int k = 0; k < 2; ++k) {
+        // the first run is a heat-up
+        for (int it = 0; it < 2; ++it) {
+            whisper_kv_cache_clear(state->kv_self);
+            state->dec_graph = {};
 
-float whisper_full_get_segment_no_speech_prob(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].no_speech_prob;
-}
+            int64_t t_sum = 0;
 
-float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].no_speech_prob;
-}
+            int32_t n_kv_prev = -1;
 
-// =================================================================================================
+            n_graphs = 0;
 
-//
-// Temporary interface needed for exposing ggml interface
-// Will be removed in the future when ggml becomes a separate library
-//
+            for (int i = 0; i < n_max; ++i) {
+                whisper_batch_prep_legacy(state->batch, &token, 1, i, 0);
 
-WHISPER_API int whisper_bench_memcpy(int n_threads) {
-    fputs(whisper_bench_memcpy_str(n_threads), stderr);
-    return 0;
-}
+                if (k == 0) {
+                    state->dec_graph = {};
+                }
 
-WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
-    static std::string s;
-    s = "";
-    char strbuf[256];
+                const int64_t t0 = ggml_time_us();
 
-    ggml_time_init();
+                if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
+                    whisper_free_state(state);
+                    s = "failed to decode\n";
+                    return s.c_str();
+                }
 
-    size_t n    = 20;
-    size_t arr  = n_threads > 0 ? 1024llu : n_threads; // trick to avoid compiler optimizations
+                t_sum += ggml_time_us() - t0;
 
-    // 1GB array
-    const size_t size = arr*1e6;
+                if ((int32_t) state->kv_self.n != n_kv_prev) {
+                    n_kv_prev = state->kv_self.n;
+                    n_graphs++;
+                }
+            }
 
-    double sum  = 0.0;
+            t_us[k] = (double) t_sum/n_max;
+        }
+    }
 
-    // heat-up
+    // cost of building and allocating a single-token graph, i.e. the overhead that the reuse removes
+    double t_build_us = 0.0;
     {
-        char * src = (char *) malloc(size);
-        char * dst = (char *) malloc(size);
+        auto & sched = state->sched_decode.sched;
 
-        for (size_t i = 0; i < size; i++) src[i] = i;
+        whisper_kv_cache_clear(state->kv_self);
+        whisper_batch_prep_legacy(state->batch, &token, 1, 0, 0);
+        whisper_kv_cache_find_slot(state->kv_self, state->batch);
 
-        memcpy(dst, src, size); // heat-up
+        state->kv_self.n = std::max(whisper_kv_cache_get_padding(*ctx), WHISPER_KV_N_BUCKET);
+        state->dec_graph = {};
 
-        double tsum = 0.0;
+        int64_t t_sum = 0;
 
-        for (size_t i = 0; i < n; i++) {
+        for (int it = 0; it < n_max + 1; ++it) {
             const int64_t t0 = ggml_time_us();
 
-            memcpy(dst, src, size);
+            ggml_backend_sched_reset(sched);
 
-            const int64_t t1 = ggml_time_us();
+            ggml_cgraph * gf = whisper_build_graph_decoder(*ctx, *state, state->batch, false, false);
+            ggml_backend_sched_alloc_graph(sched, gf);
 
-            tsum += (t1 - t0)*1e-6;
+            const int64_t t1 = ggml_time_us();
 
-            src[rand() % size] = rand() % 256;
+            // skip the heat-up
+            if (it > 0) {
+                t_sum += t1 - t0;
+            }
         }
 
-        snprintf(strbuf, sizeof(strbuf), "memcpy: %7.2f GB/s (heat-up)\n", (double) (n*size)/(tsum*1e9));
-        s += strbuf;
-
-        // needed to prevent the compiler from optimizing the memcpy away
-        {
-            for (size_t i = 0; i < size; i++) sum += dst[i];
-        }
+        ggml_backend_sched_reset(sched);
 
-        free(src);
-        free(dst);
+        t_build_us = (double) t_sum/n_max;
     }
 
-    // single-thread
-    {
-        char * src = (char *) malloc(size);
-        char * dst = (char *) malloc(size);
+    whisper_free_state(state);
 
-        for (size_t i = 0; i < size; i++) src[i] = i;
+    snprintf(strbuf, sizeof(strbuf), "decoder %3d tokens: rebuild %8.2f us/token | reuse %8.2f us/token (%3d graphs) | build + alloc %8.2f us/token | saved %8.2f us/token\n",
+            n_max, t_us[0], t_us[1], n_graphs, t_build_us, t_us[0] - t_us[1]);
+    s += strbuf;
 
-        memcpy(dst, src, size); // heat-up
+    return s.c_str();
+}
 
-        double tsum = 0.0;
+WHISPER_API int whisper_bench_encoder_batch(struct whisper_context * ctx, int n_threads) {
+    fputs(whisper_bench_encoder_batch_str(ctx, n_threads), stderr);
+    return 0;
+}
 
-        for (size_t i = 0; i < n; i++) {
-            const int64_t t0 = ggml_time_us();
+WHISPER_API const char * whisper_bench_encoder_batch_str(struct whisper_context * ctx, int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-            memcpy(dst, src, size);
+    ggml_time_init();
 
-            const int64_t t1 = ggml_time_us();
+    const int n_max = 2;
 
-            tsum += (t1 - t0)*1e-6;
+    const int n_mels = ctx->model.hparams.n_mels;
+    const int n_len  = 2*ctx->model.hparams.n_audio_ctx;
 
-            src[rand() % size] = rand() % 256;
+    const std::vector<int> sizes = {
+        2, 4, 8,
+    };
+
+    std::vector<whisper_state *> states;
+
+    for (int i = 0; i < sizes.back(); ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            for (whisper_state * st : states) {
+                whisper_free_state(st);
+            }
+            s = "failed to initialize the state\n";
+            return s.c_str();
         }
 
-        snprintf(strbuf, sizeof(strbuf), "memcpy: %7.2f GB/s ( 1 thread)\n", (double) (n*size)/(tsum*1e9));
-        s += strbuf;
+        states.push_back(state);
 
-        // needed to prevent the compiler from optimizing the memcpy away
+        // deterministic pseudo-random spectrogram, different for each state
+        std::vector<float> mel(n_len*n_mels);
         {
-            for (size_t i = 0; i < size; i++) sum += dst[i];
+            std::mt19937 rng(i + 1);
+            std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+            for (auto & v : mel) {
+                v = dist(rng);
+            }
         }
 
-        free(src);
-        free(dst);
+        whisper_set_mel_with_state(ctx, state, mel.data(), n_len, n_mels);
     }
 
-    // multi-thread
+    std::vector<float> ref;
+    std::vector<float> out;
 
-    for (int32_t k = 1; k <= n_threads; k++) {
-        char * src = (char *) malloc(size);
-        char * dst = (char *) malloc(size);
+    // full windows and short windows, as used for short audio with a dynamic audio context
+    for (int n_ctx : { ctx->model.hparams.n_audio_ctx, 256 }) {
+        for (whisper_state * state : states) {
+            state->exp_n_audio_ctx = n_ctx;
+        }
 
-        for (size_t i = 0; i < size; i++) src[i] = i;
+        for (int n_batch : sizes) {
+            // 0 - one window after the other, 1 - whisper_encode_batch()
+            double t_ms[2] = { 0.0, 0.0 };
 
-        memcpy(dst, src, size); // heat-up
+            for (int k = 0; k < 2; ++k) {
+                // the first run is a heat-up
+                for (int it = 0; it < n_max + 1; ++it) {
+                    const int64_t t0 = ggml_time_us();
 
-        double tsum = 0.0;
+                    bool ok = true;
 
-        auto helper = [&](int th) {
-            const int64_t i0 = (th + 0)*size/k;
-            const int64_t i1 = (th + 1)*size/k;
+                    if (k == 0) {
+                        for (int i = 0; i < n_batch && ok; ++i) {
+                            // the windows are encoded again, do not let the conv stem reuse its previous outputs
+                            states[i]->conv_cache = {};
 
-            for (size_t i = 0; i < n; i++) {
-                memcpy(dst + i0, src + i0, i1 - i0);
+                            ok = whisper_encode_internal(*ctx, *states[i], 0, n_threads, nullptr, nullptr);
+                        }
+                    } else {
+                        ok = whisper_encode_batch(ctx, states.data(), nullptr, n_batch, n_threads) == 0;
+                    }
 
-                src[i0 + rand() % (i1 - i0)] = rand() % 256;
-            };
-        };
+                    if (!ok) {
+                        for (whisper_state * st : states) {
+                            whisper_free_state(st);
+                        }
+                        s = "failed to encode\n";
+                        return s.c_str();
+                    }
 
-        const int64_t t0 = ggml_time_us();
+                    if (it > 0) {
+                        t_ms[k] += (ggml_time_us() - t0)*1e-3/(n_max*n_batch);
+                    }
+                }
 
-        std::vector<std::thread> threads(k - 1);
-        for (int32_t th = 0; th < k - 1; ++th) {
-            threads[th] = std::thread(helper, th);
+                auto & res = k == 0 ? ref : out;
+
+                res.clear();
+                for (int i = 0; i < n_batch; ++i) {
+                    const ggml_tensor * embd = states[i]->embd_enc;
+
+                    const size_t n = res.size();
+                    res.resize(n + ggml_nelements(embd));
+
+                    ggml_backend_tensor_get(embd, res.data() + n, 0, ggml_nbytes(embd));
+                }
+            }
+
+            float max_diff = 0.0f;
+            for (size_t i = 0; i < ref.size(); ++i) {
+                max_diff = std::max(max_diff, std::fabs(ref[i] - out[i]));
+            }
+
+            snprintf(strbuf, sizeof(strbuf), "encoder audio ctx %4d batch %d: serial %8.2f ms/window | batched %8.2f ms/window | speed-up %5.2fx | max diff %g\n",
+                    n_ctx, n_batch, t_ms[0], t_ms[1], t_ms[0]/t_ms[1], max_diff);
+            s += strbuf;
         }
+    }
 
-        helper(k - 1);
+    for (whisper_state * state : states) {
+        whisper_free_state(state);
+    }
 
-        for (int32_t th = 0; th < k - 1; ++th) {
-            threads[th].join();
-        }
+    return s.c_str();
+}
 
-        const int64_t t1 = ggml_time_us();
+// the original tokenizer, used as a reference by whisper_bench_tokenizer() and test-tokenizer
+std::vector<whisper_vocab::id> tokenize_regex(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<std::string> words;
 
-        tsum += (t1 - t0)*1e-6;
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
 
-        snprintf(strbuf, sizeof(strbuf), "memcpy: %7.2f GB/s (%2d thread)\n", (double) (n*size)/(tsum*1e9), k);
-        s += strbuf;
+        std::regex re(pat);
+        std::smatch m;
 
-        // needed to prevent the compiler from optimizing the memcpy away
-        {
-            for (size_t i = 0; i < size; i++) sum += dst[i];
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
         }
-
-        free(src);
-        free(dst);
     }
 
-    snprintf(strbuf, sizeof(strbuf), "sum:    %f\n", sum);
-    s += strbuf;
+    // find the longest tokens that form the words:
+    std::vector<whisper_vocab::id> tokens;
+    for (const auto & word : words) {
+        if (word.empty()) continue;
 
-    return s.c_str();
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            bool found = false;
+            while (j > i) {
+                auto sub = word.substr(i, j-i);
+                auto it = vocab.token_to_id.find(sub);
+                if (it != vocab.token_to_id.end()) {
+                    tokens.push_back(it->second);
+                    i = j;
+                    found = true;
+                    break;
+                }
+                --j;
+            }
+            if (!found) {
+                ++i;
+            }
+        }
+    }
+
+    return tokens;
 }
 
-WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads) {
-    fputs(whisper_bench_ggml_mul_mat_str(n_threads), stderr);
+WHISPER_API int whisper_bench_tokenizer(struct whisper_context * ctx, int n_threads) {
+    fputs(whisper_bench_tokenizer_str(ctx, n_threads), stderr);
     return 0;
 }
 
-WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
-    whisper_load_backends();
-
+WHISPER_API const char * whisper_bench_tokenizer_str(struct whisper_context * ctx, int n_threads) {
     static std::string s;
     s = "";
     char strbuf[256];
 
     ggml_time_init();
 
-    const int n_max = 128;
+    // the tokenizer is single-threaded
+    GGML_UNUSED(n_threads);
 
-    const std::vector<size_t> sizes = {
-        64, 128, 256, 512, 1024, 2048, 4096,
+    // contractions, numbers, punctuation, whitespace runs and non-ASCII text
+    const std::vector<std::string> parts = {
+        " the", " quick", " brown", " fox", " jumps", " over", " lazy", " dog", "The", " It's", " we're", " they've",
+        " I'm", " you'll", " he'd", " don't", " 'quoted'", " 1984", " 3.14159", " 2,048", ",", ".", "!", "?", " --", " (a)",
+        "  ", "   ", "\t", "\n", " \n ", " caf\xc3\xa9", " na\xc3\xafve", " \xe4\xbd\xa0\xe5\xa5\xbd", " \xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82",
+        " \xf0\x9f\x99\x82", "'S", "''", " Mr.", " e-mail", " x86_64", " #hashtag", " @user",
     };
 
-    const size_t N_max = sizes.back();
-
-    // a: N*N*sizeof(float)
-    // b: N*N*sizeof(float)
-    // c: N*N*sizeof(float)
-    // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
-    std::vector<uint8_t> buf(3llu*N_max*N_max*sizeof(float) + 3*ggml_tensor_overhead() + ggml_graph_overhead());
-
-    // put a bunch of random data in the buffer
-    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
-
-    for (int j = 0; j < (int) sizes.size(); j++) {
-        int n_q4_0 = 0;
-        int n_q4_1 = 0;
-        int n_q5_0 = 0;
-        int n_q5_1 = 0;
-        int n_q8_0 = 0;
-        int n_fp16 = 0;
-        int n_fp32 = 0;
-
-        // GFLOPS/s
-        double s_q4_0 = 0.0;
-        double s_q4_1 = 0.0;
-        double s_q5_0 = 0.0;
-        double s_q5_1 = 0.0;
-        double s_q8_0 = 0.0;
-        double s_fp16 = 0.0;
-        double s_fp32 = 0.0;
-
-        const size_t N = sizes[j];
-
-        for (int k = 0; k < 7; ++k) {
-            const ggml_type wtype =
-                k == 0 ? GGML_TYPE_Q4_0 :
-                k == 1 ? GGML_TYPE_Q4_1 :
-                k == 2 ? GGML_TYPE_Q5_0 :
-                k == 3 ? GGML_TYPE_Q5_1 :
-                k == 4 ? GGML_TYPE_Q8_0 :
-                k == 5 ? GGML_TYPE_F16  : GGML_TYPE_F32;
-
-            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : /*k == 6*/ s_fp32;
-            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : /*k == 6*/ n_fp32;
-
-            struct ggml_init_params gparams = {
-                /*.mem_size   =*/ buf.size(),
-                /*.mem_buffer =*/ buf.data(),
-                /*.no_alloc   =*/ false,
-            };
-
-            struct ggml_context * ctx0 = ggml_init(gparams);
+    std::mt19937 rng(1);
 
-            struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, wtype,         N, N);
-            struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
+    auto gen = [&](size_t n_bytes) {
+        std::string text;
+        while (text.size() < n_bytes) {
+            text += parts[rng() % parts.size()];
+        }
+        return text;
+    };
 
-            struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
+    // a typical initial prompt and a long text
+    const std::vector<std::pair<size_t, int>> cases = {
+        { 256, 1000 }, { 65536, 4 },
+    };
 
-            struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+    for (const auto & c : cases) {
+        const std::string text = gen(c.first);
+        const int n_max = c.second;
 
-            ggml_build_forward_expand(gf, c);
+        std::vector<whisper_vocab::id> res[2];
 
-            double tsum = 0.0;
+        // 0 - std::regex reference, 1 - whisper_pretokenize + trie
+        double t_us[2] = { 0.0, 0.0 };
 
-            // heat-up
-            ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+        for (int k = 0; k < 2; ++k) {
+            int64_t t_sum = 0;
 
-            for (int i = 0; i < n_max; ++i) {
+            for (int it = 0; it < n_max + 1; ++it) {
                 const int64_t t0 = ggml_time_us();
 
-                ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+                res[k] = k == 0 ? tokenize_regex(ctx->vocab, text) : tokenize(ctx->vocab, text);
 
                 const int64_t t1 = ggml_time_us();
 
-                tsum += (t1 - t0)*1e-6;
-                n++;
-
-                if (tsum > 1.0 && n >= 3) {
-                    break;
+                // skip the heat-up
+                if (it > 0) {
+                    t_sum += t1 - t0;
                 }
             }
 
-            ggml_free(ctx0);
-
-            s = ((2.0*N*N*N*n)/tsum)*1e-9;
+            t_us[k] = (double) t_sum/n_max;
         }
 
-        // Q4_0 | Q4_1
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q4_0 %7.1f GFLOPS (%3d runs) | Q4_1 %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_q4_0, n_q4_0, s_q4_1, n_q4_1);
-        s += strbuf;
-
-        // Q5_0 | Q5_1 | Q8_0
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: Q5_0 %7.1f GFLOPS (%3d runs) | Q5_1 %7.1f GFLOPS (%3d runs) | Q8_0 %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_q5_0, n_q5_0, s_q5_1, n_q5_1, s_q8_0, n_q8_0);
-        s += strbuf;
-
-        // F16 | F32
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_fp16, n_fp16, s_fp32, n_fp32);
+        snprintf(strbuf, sizeof(strbuf), "tokenize %6zu bytes: regex %8.3f MB/s | trie %8.3f MB/s | speed-up %7.2fx | %6zu tokens, %s\n",
+                text.size(), text.size()/t_us[0], text.size()/t_us[1], t_us[0]/t_us[1], res[1].size(), res[0] == res[1] ? "identical" : "MISMATCH");
         s += strbuf;
     }
 
@@ -7222,132 +11300,279 @@ static std::vector<uint32_t> get_alignment_heads_by_layer(const whisper_context_
     return ret;
 }
 
+// lay out the cells of the DTW band by anti-diagonal
+// cell (i, j) of the (N + 1)x(M + 1) cost matrix is in the band if it is within band audio frames of the diagonal
+// from (0, 0) to (N, M), the band is widened if needed so that it always contains a path between the two
+static void whisper_dtw_band_init(whisper_dtw_buffers & buf, int64_t N, int64_t M, int64_t band) {
+    int64_t w = band > 0 ? band : N + M;
+    w = std::max(w, (N + M + N - 1)/N + 1);
+
+    buf.lo .resize(N + M + 1);
+    buf.off.resize(N + M + 2);
+
+    int64_t n_cells = 0;
+    for (int64_t d = 0; d <= N + M; ++d) {
+        int64_t lo = std::max<int64_t>(1, d - M);
+        int64_t hi = std::min<int64_t>(N, d - 1);
+
+        if (d > w) {
+            lo = std::max(lo, ((d - w)*N + N + M - 1)/(N + M));
+        }
+        hi = std::min(hi, ((d + w)*N)/(N + M));
+
+        buf.lo [d] = lo;
+        buf.off[d] = n_cells;
+
+        n_cells += std::max<int64_t>(0, hi - lo + 1);
+    }
+    buf.off[N + M + 1] = n_cells;
+
+    buf.x    .resize(n_cells);
+    buf.trace.resize(n_cells);
+}
+
+bool whisper_dtw_in_band(const whisper_dtw_buffers & buf, int64_t i, int64_t j) {
+    const int64_t d = i + j;
+    return i >= buf.lo[d] && i - buf.lo[d] < buf.off[d + 1] - buf.off[d];
+}
+
+static inline void whisper_sort2(float & a, float & b) {
+    const float t = std::min(a, b);
+    b = std::max(a, b);
+    a = t;
+}
+
+// median filter with "reflect" padding of the positions [j0, j1) of the row y[0..n) into buf.med
+// is identical to medfilt on openAI timing.py
+// the windows of the default width 7 that need no padding go through a sorting network that the compiler vectorizes
+static void whisper_median_filter(whisper_dtw_buffers & buf, const float * y, int64_t n, int width, int64_t j0, int64_t j1) {
+    const int64_t r = width/2;
+
+    float * dst = buf.med.data();
+
+    int64_t ja = j1;
+    int64_t jb = j1;
+
+    if (width == 7) {
+        ja = std::min(std::max(j0, r), j1);
+        jb = std::max(std::min(j1, n - r), ja);
+
+        for (int64_t j = ja; j < jb; ++j) {
+            float a0 = y[j - 3], a1 = y[j - 2], a2 = y[j - 1], a3 = y[j], a4 = y[j + 1], a5 = y[j + 2], a6 = y[j + 3];
+
+            whisper_sort2(a0, a6); whisper_sort2(a2, a3); whisper_sort2(a4, a5);
+            whisper_sort2(a0, a2); whisper_sort2(a1, a4); whisper_sort2(a3, a6);
+            whisper_sort2(a0, a1); whisper_sort2(a2, a5); whisper_sort2(a3, a4);
+            whisper_sort2(a1, a2); whisper_sort2(a4, a6);
+            whisper_sort2(a2, a3); whisper_sort2(a4, a5);
+            whisper_sort2(a1, a2); whisper_sort2(a3, a4); whisper_sort2(a5, a6);
+
+            dst[j] = a3;
+        }
+    }
+
+    const auto median_at = [&](int64_t j) {
+        for (int64_t off = -r; off <= r; ++off) {
+            int64_t idx = j + off;
+            if (idx < 0) {
+                idx = -idx;
+            } else if (idx >= n) {
+                idx = 2*(n - 1) - idx;
+            }
+
+            buf.filter[off + r] = y[idx];
+        }
+        std::nth_element(buf.filter.begin(), buf.filter.begin() + r, buf.filter.end());
+
+        return buf.filter[r];
+    };
+
+    for (int64_t j = j0; j < ja; ++j) {
+        dst[j] = median_at(j);
+    }
+    for (int64_t j = jb; j < j1; ++j) {
+        dst[j] = median_at(j);
+    }
+}
+
+// cost of each cell of the DTW band from the alignment head QKs, N_TOKENS*audio_ctx*N_ALIGNMENT_HEADS
+// the first n_sot tokens and the last token are not aligned
+void whisper_dtw_cost(
+        whisper_dtw_buffers & dtw,
+                const float * qks,
+                      int64_t n_tokens,
+                      int64_t n_audio_ctx,
+                      int64_t n_audio_tokens,
+                      int64_t n_heads,
+                      int64_t n_sot,
+                          int medfilt_width,
+                          int band) {
+    // Normalize over the tokens (dim=-2 in original OpenAI code) for each audio token and head, same as ggml_norm
+    // the weights are first transposed to N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS, so that the sums of all audio
+    // tokens are accumulated together in contiguous rows, and so that the median filter runs over contiguous rows
+    const int64_t M = n_audio_tokens;
+
+    dtw.qks.resize(n_heads * n_tokens * M);
+    dtw.sum.resize(M);
+    dtw.mean.resize(M);
+    dtw.scale.resize(M);
+
+    for (int64_t k = 0; k < n_heads; ++k) {
+        float * y = dtw.qks.data() + k * n_tokens * M;
+
+        for (int64_t j0 = 0; j0 < M; j0 += 32) {
+            for (int64_t t0 = 0; t0 < n_tokens; t0 += 32) {
+                for (int64_t j = j0; j < std::min(j0 + 32, M); ++j) {
+                    const float * q = qks + j * n_tokens + k * n_tokens * n_audio_ctx;
+                    for (int64_t t = t0; t < std::min(t0 + 32, n_tokens); ++t) {
+                        y[t * M + j] = q[t];
+                    }
+                }
+            }
+        }
+
+        std::fill(dtw.sum.begin(), dtw.sum.end(), 0.0);
+        for (int64_t t = 0; t < n_tokens; ++t) {
+            for (int64_t j = 0; j < M; ++j) {
+                dtw.sum[j] += (double) y[t * M + j];
+            }
+        }
+        for (int64_t j = 0; j < M; ++j) {
+            dtw.mean[j] = dtw.sum[j]/n_tokens;
+        }
+
+        std::fill(dtw.sum.begin(), dtw.sum.end(), 0.0);
+        for (int64_t t = 0; t < n_tokens; ++t) {
+            for (int64_t j = 0; j < M; ++j) {
+                const float v = y[t * M + j] - dtw.mean[j];
+                dtw.sum[j] += (double) (v*v);
+            }
+        }
+        for (int64_t j = 0; j < M; ++j) {
+            const float variance = dtw.sum[j]/n_tokens;
+            dtw.scale[j] = 1.0f/sqrtf(variance + 1e-9f);
+        }
+
+        for (int64_t t = 0; t < n_tokens; ++t) {
+            for (int64_t j = 0; j < M; ++j) {
+                y[t * M + j] = (y[t * M + j] - dtw.mean[j])*dtw.scale[j];
+            }
+        }
+    }
+
+    const int64_t N = n_tokens - n_sot - 1;
+
+    whisper_dtw_band_init(dtw, N, M, band);
+
+    // Cost of each cell of the band: median filter over the audio tokens with "reflect" padding, mean over the
+    // alignment heads, scaled by -1
+    dtw.med.resize(M);
+    dtw.filter.resize(medfilt_width);
+
+    for (int64_t i = 1; i <= N; ++i) {
+        // the audio tokens of a token row in the band are contiguous
+        int64_t j0 = 1;
+        while (!whisper_dtw_in_band(dtw, i, j0)) {
+            ++j0;
+        }
+        int64_t j1 = j0;
+        while (j1 < M && whisper_dtw_in_band(dtw, i, j1 + 1)) {
+            ++j1;
+        }
+
+        std::fill(dtw.sum.begin() + j0 - 1, dtw.sum.begin() + j1, 0.0);
+
+        const int64_t t = n_sot + i - 1;
+
+        for (int64_t k = 0; k < n_heads; ++k) {
+            const float * y = dtw.qks.data() + (k * n_tokens + t) * M;
+
+            whisper_median_filter(dtw, y, M, medfilt_width, j0 - 1, j1);
+
+            for (int64_t j = j0 - 1; j < j1; ++j) {
+                dtw.sum[j] += (double) dtw.med[j];
+            }
+        }
+
+        for (int64_t j = j0; j <= j1; ++j) {
+            const int64_t d = i + j;
+            dtw.x[dtw.off[d] + i - dtw.lo[d]] = -((float) dtw.sum[j - 1]/(float) n_heads);
+        }
+    }
+}
+
 // dtw + backtrace to return found path
 // based on
 // https://github.com/openai/whisper/blob/main/whisper/timing.py#L83
-static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
-    WHISPER_ASSERT(ggml_n_dims(x) == 2);
-
-    int64_t N = x->ne[0];
-    int64_t M = x->ne[1];
-    struct ggml_tensor * cost = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N + 1, M + 1);
-    struct ggml_tensor * trace = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, N + 1, M + 1);
-
-    cost = whisper_set_f32(cost, INFINITY);
-    trace = whisper_set_i32(trace, -1);
-    whisper_set_f32_nd(cost, 0, 0, 0, 0, 0.0);
-
-    // dtw
-    // supposedly can be optmized by computing diagonals in parallel ?
-    // Not sure it is worth it since x will be GENERATED_TOKENS*1500 size at most.
-    for (int64_t j = 1; j < M + 1; ++j) {
-        for (int64_t i = 1; i < N + 1; ++i) {
-            float c0 = whisper_get_f32_nd(cost, i - 1, j - 1, 0, 0);
-            float c1 = whisper_get_f32_nd(cost, i - 1, j, 0, 0);
-            float c2 = whisper_get_f32_nd(cost, i, j - 1, 0, 0);
-
-            float c;
-            int32_t t;
-            if (c0 < c1 && c0 < c2) {
-                c = c0;
-                t = 0;
-            } else if (c1 < c0 && c1 < c2) {
-                c = c1;
-                t = 1;
-            } else {
-                c = c2;
-                t = 2;
-            }
+// the cost of cell (i, j) depends only on the two previous anti-diagonals, so the cells of an anti-diagonal are
+// computed together in a loop that the compiler vectorizes, keeping only the last 3 anti-diagonals of the cost
+void whisper_dtw_and_backtrace(whisper_dtw_buffers & buf, int64_t N, int64_t M) {
+    const int64_t n_rows = N + 2;
+
+    buf.cost.assign(3*n_rows, INFINITY);
+    buf.cost[0] = 0.0f;
+
+    const float * x = buf.x.data();
+    int8_t * trace  = buf.trace.data();
+
+    for (int64_t d = 2; d <= N + M; ++d) {
+              float * cost = buf.cost.data() + ((d    )%3)*n_rows;
+        const float * pd1  = buf.cost.data() + ((d - 1)%3)*n_rows;
+        const float * pd2  = buf.cost.data() + ((d - 2)%3)*n_rows;
+
+        const int64_t lo = buf.lo[d];
+        const int64_t hi = lo + (buf.off[d + 1] - buf.off[d]) - 1;
+        WHISPER_ASSERT(lo <= hi);
+
+        const int64_t o = buf.off[d] - lo;
 
-            c = whisper_get_f32_nd(x, i - 1, j - 1, 0, 0) + c;
-            whisper_set_f32_nd(cost, i, j, 0, 0, c);
-            whisper_set_i32_nd(trace, i, j, 0, 0, t);
+        for (int64_t i = lo; i <= hi; ++i) {
+            const float c0 = pd2[i - 1]; // (i - 1, j - 1)
+            const float c1 = pd1[i - 1]; // (i - 1, j)
+            const float c2 = pd1[i];     // (i,     j - 1)
+
+            // no branches, so that the loop is vectorized
+            const bool b0 = (c0 < c1) & (c0 < c2);
+            const bool b1 = (c1 < c0) & (c1 < c2);
+
+            cost [i]     = x[o + i] + (b0 ? c0 : b1 ? c1 : c2);
+            trace[o + i] = 2 - 2*b0 - b1;
         }
+
+        // the neighbours of the band can not be reached
+        cost[lo - 1] = INFINITY;
+        cost[hi + 1] = INFINITY;
     }
 
     // Backtrace
-    const int64_t BT_MAX_ROWS = N + M - 1;
-    struct ggml_tensor * bt = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, BT_MAX_ROWS, 2);
-    // trace[0, :] = 2;
-    for (int64_t i = 0; i < M + 1; ++i)
-        whisper_set_i32_nd(trace, 0, i, 0, 0, 2);
-    //trace[:, 0] = 1;
-    for (int64_t i = 0; i < N + 1; ++i)
-        whisper_set_i32_nd(trace, i, 0, 0, 0, 1);
-    int bt_row_idx = BT_MAX_ROWS - 1;
+    buf.path.clear();
+
     int64_t i = N;
     int64_t j = M;
     while (i > 0 || j > 0) {
-        whisper_set_i32_nd(bt, bt_row_idx, 0, 0, 0, i - 1);
-        whisper_set_i32_nd(bt, bt_row_idx, 1, 0, 0, j - 1);
-        --bt_row_idx;
+        buf.path.emplace_back(i - 1, j - 1);
+
+        int t = 0;
+        if (i == 0) {
+            t = 2;
+        } else if (j == 0) {
+            t = 1;
+        } else {
+            WHISPER_ASSERT(whisper_dtw_in_band(buf, i, j));
+            t = trace[buf.off[i + j] + i - buf.lo[i + j]];
+        }
 
-        int32_t t = whisper_get_i32_nd(trace, i, j, 0, 0);
         if (t == 0) {
             --i;
             --j;
         } else if (t == 1) {
             --i;
-        } else if (t == 2) {
-            --j;
         } else {
-            WHISPER_ASSERT(0);
-        }
-    }
-
-    // FIXME: manual clip/transpose might not be the most efficient way? (e.g. use ggml funcs)
-    // Clip + transpose
-    // This might not be entirely necessary for our case, but leaving it for now so output matrix
-    // is identical to dtw on openAI timing.py
-    const int64_t result_n_cols = BT_MAX_ROWS-bt_row_idx-1;
-    ggml_tensor * r = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, 2, result_n_cols);
-    for (int64_t i = 0; i < 2; ++i) {
-        for (int64_t j = 0; j < result_n_cols; ++j) {
-            int32_t v = whisper_get_i32_nd(bt, j+bt_row_idx+1, i, 0, 0);
-            whisper_set_i32_nd(r, i, j, 0, 0, v);
+            --j;
         }
     }
 
-    return r;
-}
-
-struct median_filter_user_data {
-    int filter_width;
-};
-
-static void median_filter(struct ggml_tensor * dst , const struct ggml_tensor * a, int ith, int /*nth*/, void * userdata) {
-    if (ith != 0) {
-        return;
-    }
-    int filter_width = ((median_filter_user_data *) userdata)->filter_width;
-    WHISPER_ASSERT(filter_width < a->ne[2]);
-    WHISPER_ASSERT(filter_width % 2);
-    WHISPER_ASSERT(ggml_n_dims(a) == 3);
-    WHISPER_ASSERT(a->type == GGML_TYPE_F32);
-
-    std::vector<float> filter;
-    filter.reserve(filter_width);
-    for (int64_t i = 0; i < a->ne[0]; ++i) {
-        for (int64_t j = 0; j < a->ne[1]; ++j) {
-            for (int64_t k = 0; k < a->ne[2]; ++k) {
-                for (int64_t off = -filter_width/2; off <= filter_width/2; ++off) {
-                    // "reflect" padding
-                    int64_t idx = k + off;
-                    if (idx < 0) {
-                        idx = -idx;
-                    } else if (idx >= a->ne[2]) {
-                        idx = 2*(a->ne[2] - 1) - idx;
-                    }
-
-                    filter.push_back(whisper_get_f32_nd(a, i, j, idx, 0));
-                }
-                std::sort(filter.begin(), filter.end());
-                const float v = filter[filter.size()/2];
-                whisper_set_f32_nd(dst, i, j, k, 0, v);
-                filter.clear();
-            }
-        }
-    }
+    std::reverse(buf.path.begin(), buf.path.end());
 }
 
 static void whisper_exp_compute_token_level_timestamps_dtw(
@@ -7366,16 +11591,6 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     WHISPER_ASSERT(n_frames <= n_audio_ctx * 2);
     WHISPER_ASSERT(ctx->params.dtw_aheads_preset != WHISPER_AHEADS_NONE);
 
-    // FIXME: Allocating mem everytime we call this func
-    // Our ggml buffer should be pre-allocated somewhere during init and reused
-    // when we call this function
-    struct ggml_init_params gparams = {
-        /*.mem_size   =*/ ctx->params.dtw_mem_size,
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ false,
-    };
-    struct ggml_context * gctx = ggml_init(gparams);
-
     // Build token sequence that will be passed to decoder
     // sot + [lang] + text result + eot
     std::vector<whisper_token> tokens = { whisper_token_sot(ctx), };
@@ -7410,75 +11625,42 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     }
     WHISPER_ASSERT(state->aheads_cross_QKs != nullptr);
 
-    const auto n_audio_tokens = n_frames/2;
-    WHISPER_ASSERT(state->aheads_cross_QKs != NULL);
+    const int64_t t_start_us = ggml_time_us();
+
+    const int64_t n_audio_tokens = n_frames/2;
     WHISPER_ASSERT(n_audio_tokens <= state->aheads_cross_QKs->ne[1]);
-    const auto n_tokens = state->aheads_cross_QKs->ne[0];
-    const auto n_heads = state->aheads_cross_QKs->ne[2];
+    const int64_t n_tokens = state->aheads_cross_QKs->ne[0];
+    const int64_t n_heads  = state->aheads_cross_QKs->ne[2];
+    WHISPER_ASSERT(medfilt_width < n_audio_tokens);
 
-    // Copy data from decoder buffer to a local CPU tensor, discarding unused audio
-    // tokens (i.e. discarding rows at the end of tensor)
-    // IN: Tensor with N_TOKENS*audio_ctx*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
+    // Copy data from decoder buffer
+    // the QKs are N_TOKENS*audio_ctx*N_ALIGNMENT_HEADS, the unused audio tokens at the end are ignored
     WHISPER_ASSERT(state->aheads_cross_QKs->type == GGML_TYPE_F32);
     WHISPER_ASSERT(ggml_is_contiguous(state->aheads_cross_QKs));
-    ggml_tensor * w = ggml_new_tensor_3d(gctx, GGML_TYPE_F32, n_tokens, n_audio_tokens, n_heads);
     auto & data = state->aheads_cross_QKs_data;
     data.resize(n_tokens * n_audio_ctx * n_heads);
     ggml_backend_tensor_get(state->aheads_cross_QKs, data.data(), 0, sizeof(float) * n_tokens * n_audio_ctx * n_heads);
-    for (int k = 0; k < n_heads; ++k) {
-        for (int j = 0; j < n_audio_tokens; ++j) {
-            memcpy(
-                (char *) w->data + j * w->nb[1] + k * w->nb[2],
-                data.data() + j * n_tokens + k * n_tokens * n_audio_ctx,
-                n_tokens * sizeof(float)
-            );
-        }
-    }
-
-    // Normalize - in original OpenAI code, this is done over dim=-2. In this case,
-    // we already permuted N_TOKENS dimension to columns on last loop, becase ggml_norm
-    // operates over columns. Afterwards, permute to a shape that facilitates mean
-    // operation (after median filter)
-    // IN: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_norm(gctx, w, 1e-9f);
-    w = ggml_permute(gctx, ggml_permute(gctx, w, 2, 1, 0 ,3), 0, 2, 1, 3);
-
-    // Pass median filter - this is done over AUDIO_TOKENS dimension.
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Same dims
-    median_filter_user_data mf_user_data = {medfilt_width};
-    w = ggml_map_custom1(gctx, w, median_filter, 1, &mf_user_data);
-
-    // Take mean over columns, scale by -1, reshape to 2D tensor, remove SOT sequence and EOT
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_mean(gctx, w);
-    w = ggml_scale(gctx, w, -1.0);
-    w = ggml_reshape_2d(gctx, w, w->ne[1], w->ne[2]);
-
-    // Remove SOT sequence and EOT
-    // Out dimension is (N_TOKENS-sot_sequence_length-1)*N_AUDIO_TOKENS
-    w = ggml_view_2d(gctx, w, w->ne[0] - sot_sequence_length - 1, w->ne[1], w->nb[1], sot_sequence_length * w->nb[0]);
-
-    // Compute
-    struct ggml_cgraph * gf = ggml_new_graph(gctx);
-    ggml_build_forward_expand(gf, w);
 
-    ggml_backend_ptr backend { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
-    ggml_backend_graph_compute(backend.get(), gf);
+    // Remove SOT sequence and EOT, the cost matrix is (N_TOKENS-sot_sequence_length-1)*N_AUDIO_TOKENS
+    const int64_t N = n_tokens - sot_sequence_length - 1;
+    if (N <= 0) {
+        state->t_dtw_us += ggml_time_us() - t_start_us;
+        return;
+    }
+
+    auto & dtw = state->dtw;
 
-    ggml_tensor * alignment = dtw_and_backtrace(gctx, w);
+    whisper_dtw_cost(dtw, data.data(), n_tokens, n_audio_ctx, n_audio_tokens, n_heads, sot_sequence_length, medfilt_width, ctx->params.dtw_band);
+    whisper_dtw_and_backtrace(dtw, N, n_audio_tokens);
 
     // Place timestamps on segments
     int32_t last_v = 0;
     auto seg_i = state->result_all.begin() + i_segment;
     auto tok_i = seg_i->tokens.begin();
-    for (int i = 0; i < alignment->ne[1]; ++i) {
-        int32_t v = whisper_get_i32_nd(alignment, 0, i, 0, 0);
+    for (const auto & p : dtw.path) {
+        int32_t v = p.first;
         if (v != last_v) {
-            int32_t time_index = whisper_get_i32_nd(alignment, 1, i, 0, 0);
+            int32_t time_index = p.second;
             int64_t timestamp = (time_index * 2) + seek; // Each index on DTW result = 20mS audio
             last_v = v;
 
@@ -7510,7 +11692,8 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
         fprintf(stderr, "\n");
     }*/
 
-    ggml_free(gctx);
+    state->t_dtw_us += ggml_time_us() - t_start_us;
+    state->n_dtw++;
 }
 
 void whisper_log_set(ggml_log_callback log_callback, void * user_data) {
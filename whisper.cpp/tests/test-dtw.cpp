@@ -0,0 +1,219 @@
+// check the DTW token alignment against a naive implementation of the original algorithm:
+// normalize the QKs over the tokens, median filter over the audio tokens, mean over the heads, DTW over the full
+// (N + 1)x(M + 1) cost matrix and backtrace
+
+#include "whisper-impl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <utility>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+// cost matrix [N][M] of the aligned tokens, as computed by the ggml graph of the original implementation
+static std::vector<float> test_cost_ref(const std::vector<float> & qks, int64_t n_tokens, int64_t n_audio_ctx, int64_t M, int64_t n_heads, int64_t n_sot, int medfilt_width) {
+    // [n_heads][n_tokens][M]
+    std::vector<float> y(n_heads*n_tokens*M);
+
+    // ggml_norm over the tokens of each audio token and head
+    for (int64_t k = 0; k < n_heads; ++k) {
+        for (int64_t j = 0; j < M; ++j) {
+            const float * q = qks.data() + k*n_tokens*n_audio_ctx + j*n_tokens;
+
+            double sum = 0.0;
+            for (int64_t t = 0; t < n_tokens; ++t) {
+                sum += (double) q[t];
+            }
+            const float mean = sum/n_tokens;
+
+            double sum2 = 0.0;
+            for (int64_t t = 0; t < n_tokens; ++t) {
+                const float v = q[t] - mean;
+                sum2 += (double) (v*v);
+            }
+            const float variance = sum2/n_tokens;
+            const float scale    = 1.0f/sqrtf(variance + 1e-9f);
+
+            for (int64_t t = 0; t < n_tokens; ++t) {
+                y[(k*n_tokens + t)*M + j] = (q[t] - mean)*scale;
+            }
+        }
+    }
+
+    const int64_t N = n_tokens - n_sot - 1;
+    const int     r = medfilt_width/2;
+
+    std::vector<float> res(N*M);
+    std::vector<float> window(medfilt_width);
+
+    for (int64_t i = 0; i < N; ++i) {
+        for (int64_t j = 0; j < M; ++j) {
+            double sum = 0.0;
+
+            for (int64_t k = 0; k < n_heads; ++k) {
+                const float * row = y.data() + (k*n_tokens + n_sot + i)*M;
+
+                // "reflect" padding
+                for (int off = -r; off <= r; ++off) {
+                    int64_t idx = j + off;
+                    if (idx < 0) {
+                        idx = -idx;
+                    } else if (idx >= M) {
+                        idx = 2*(M - 1) - idx;
+                    }
+                    window[off + r] = row[idx];
+                }
+
+                std::sort(window.begin(), window.end());
+
+                sum += (double) window[r];
+            }
+
+            res[i*M + j] = -((float) sum/(float) n_heads);
+        }
+    }
+
+    return res;
+}
+
+// DTW over the full cost matrix, the cells outside the band (if any) can not be entered
+static std::vector<std::pair<int32_t, int32_t>> test_dtw_ref(const std::vector<float> & x, int64_t N, int64_t M, const whisper_dtw_buffers * band) {
+    std::vector<float>  cost ((N + 1)*(M + 1), INFINITY);
+    std::vector<int8_t> trace((N + 1)*(M + 1), -1);
+
+    cost[0] = 0.0f;
+
+    for (int64_t j = 1; j <= M; ++j) {
+        for (int64_t i = 1; i <= N; ++i) {
+            if (band && !whisper_dtw_in_band(*band, i, j)) {
+                continue;
+            }
+
+            const float c0 = cost[(i - 1)*(M + 1) + j - 1];
+            const float c1 = cost[(i - 1)*(M + 1) + j];
+            const float c2 = cost[ i     *(M + 1) + j - 1];
+
+            float c;
+            int   t;
+            if (c0 < c1 && c0 < c2) {
+                c = c0;
+                t = 0;
+            } else if (c1 < c0 && c1 < c2) {
+                c = c1;
+                t = 1;
+            } else {
+                c = c2;
+                t = 2;
+            }
+
+            cost [i*(M + 1) + j] = x[(i - 1)*M + j - 1] + c;
+            trace[i*(M + 1) + j] = t;
+        }
+    }
+
+    for (int64_t j = 0; j <= M; ++j) {
+        trace[j] = 2;
+    }
+    for (int64_t i = 0; i <= N; ++i) {
+        trace[i*(M + 1)] = 1;
+    }
+
+    std::vector<std::pair<int32_t, int32_t>> path;
+
+    int64_t i = N;
+    int64_t j = M;
+    while (i > 0 || j > 0) {
+        path.emplace_back(i - 1, j - 1);
+
+        const int t = trace[i*(M + 1) + j];
+        assert(t >= 0);
+
+        if (t == 0) {
+            --i;
+            --j;
+        } else if (t == 1) {
+            --i;
+        } else {
+            --j;
+        }
+    }
+
+    std::reverse(path.begin(), path.end());
+
+    return path;
+}
+
+int main(void) {
+    struct test_case {
+        int64_t n_tokens;
+        int64_t n_audio_ctx;
+        int64_t n_audio_tokens;
+        int64_t n_heads;
+        int64_t n_sot;
+        int     medfilt_width;
+        int     band;
+    };
+
+    const std::vector<test_case> cases = {
+        {  12,   64,   50, 2, 1, 7,  0 },
+        {  12,   64,   50, 2, 1, 7,  4 },
+        {  40,  400,  300, 6, 3, 7,  0 },
+        {  40,  400,  300, 6, 3, 7, 25 },
+        {  40,  400,  300, 6, 3, 5, 10 },
+        {   5,   32,   20, 1, 1, 3,  0 },
+        {  60,   32,   20, 4, 1, 7,  0 },
+        {  60,   32,   20, 4, 1, 7,  3 },
+        { 100, 1500, 1500, 8, 3, 7,  0 },
+        { 100, 1500, 1500, 8, 3, 7, 50 },
+    };
+
+    std::mt19937 rng(1);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    for (const auto & c : cases) {
+        std::vector<float> qks(c.n_tokens*c.n_audio_ctx*c.n_heads);
+        for (auto & v : qks) {
+            v = dist(rng);
+        }
+
+        const int64_t N = c.n_tokens - c.n_sot - 1;
+        const int64_t M = c.n_audio_tokens;
+
+        whisper_dtw_buffers dtw;
+
+        whisper_dtw_cost(dtw, qks.data(), c.n_tokens, c.n_audio_ctx, M, c.n_heads, c.n_sot, c.medfilt_width, c.band);
+        whisper_dtw_and_backtrace(dtw, N, M);
+
+        const auto x = test_cost_ref(qks, c.n_tokens, c.n_audio_ctx, M, c.n_heads, c.n_sot, c.medfilt_width);
+
+        // the cost of the cells in the band
+        int64_t n_cells = 0;
+        float   max_diff = 0.0f;
+
+        for (int64_t i = 1; i <= N; ++i) {
+            for (int64_t j = 1; j <= M; ++j) {
+                if (whisper_dtw_in_band(dtw, i, j)) {
+                    const int64_t d = i + j;
+                    max_diff = std::max(max_diff, std::fabs(dtw.x[dtw.off[d] + i - dtw.lo[d]] - x[(i - 1)*M + j - 1]));
+                    n_cells++;
+                }
+            }
+        }
+
+        assert(c.band > 0 || n_cells == N*M);
+
+        const auto path = test_dtw_ref(x, N, M, c.band > 0 ? &dtw : nullptr);
+
+        printf("%s: N = %4d, M = %4d, heads = %d, medfilt = %d, band = %3d: %7d cells\n",
+                __func__, (int) N, (int) M, (int) c.n_heads, c.medfilt_width, c.band, (int) n_cells);
+
+        assert(max_diff == 0.0f);
+        assert(path == dtw.path);
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+// check that whisper_encode_batch() gives the same encoder results as encoding the states one by one
+
+#include "whisper.h"
+#include "whisper-impl.h"
+
+#include "test-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+int main(void) {
+    whisper_log_set([](enum ggml_log_level level, const char * text, void *) {
+        if (level == GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    const int n_audio_ctx = 64;
+    const int n_mels      = 80;
+    const int n_states    = 3;
+
+    std::vector<char> model = test_model(51864, n_audio_ctx, 64, 64, 2, 2, n_mels);
+
+    whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = false;
+
+    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(model.data(), model.size(), cparams);
+    assert(ctx != nullptr);
+
+    // 0 - encoded with whisper_encode_batch(), 1 - encoded one by one
+    std::vector<whisper_state *> states[2];
+
+    for (int k = 0; k < 2; ++k) {
+        for (int i = 0; i < n_states; ++i) {
+            whisper_state * state = whisper_init_state(ctx);
+            assert(state != nullptr);
+
+            std::vector<float> mel(2*n_audio_ctx*n_mels);
+
+            std::mt19937 rng(i + 1);
+            std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+            for (auto & v : mel) {
+                v = dist(rng);
+            }
+
+            assert(whisper_set_mel_with_state(ctx, state, mel.data(), 2*n_audio_ctx, n_mels) == 0);
+
+            states[k].push_back(state);
+        }
+    }
+
+    // the batched states are freshly initialized, so their own encoder graphs are not allocated yet
+    assert(whisper_encode_batch(ctx, states[0].data(), nullptr, n_states, 1) == 0);
+
+    for (int i = 0; i < n_states; ++i) {
+        assert(whisper_encode_with_state(ctx, states[1][i], 0, 1) == 0);
+    }
+
+    // the decoder reads the cross-attention KV cache written by the encoder, only the last token has logits
+    const whisper_token tokens[] = { whisper_token_sot(ctx), whisper_token_lang(ctx, 0) };
+
+    const int n_vocab = whisper_n_vocab(ctx);
+
+    float max_diff = 0.0f;
+
+    // how much the logits depend on the audio, to make sure the comparison is meaningful
+    float max_diff_audio = 0.0f;
+
+    std::vector<float> logits_prev;
+
+    for (int i = 0; i < n_states; ++i) {
+        std::vector<float> logits[2];
+
+        for (int k = 0; k < 2; ++k) {
+            assert(whisper_decode_with_state(ctx, states[k][i], tokens, 2, 0, 1) == 0);
+
+            const float * res = whisper_get_logits_from_state(states[k][i]);
+            logits[k].assign(res, res + n_vocab);
+        }
+
+        for (int j = 0; j < n_vocab; ++j) {
+            assert(std::isfinite(logits[0][j]));
+            max_diff = std::max(max_diff, std::fabs(logits[0][j] - logits[1][j]));
+
+            if (!logits_prev.empty()) {
+                max_diff_audio = std::max(max_diff_audio, std::fabs(logits[1][j] - logits_prev[j]));
+            }
+        }
+
+        logits_prev = logits[1];
+    }
+
+    printf("%s: %d states, max logits diff = %g (between windows = %g)\n", __func__, n_states, max_diff, max_diff_audio);
+
+    // the serial path may use the fused conv kernel, which rounds differently than im2col + mul_mat
+    assert(max_diff < 0.05f*max_diff_audio);
+
+    for (int k = 0; k < 2; ++k) {
+        for (whisper_state * state : states[k]) {
+            whisper_free_state(state);
+        }
+    }
+
+    whisper_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+// check that the grammar trie rejects the same tokens as checking every token against the grammar stacks
+
+#include "whisper-impl.h"
+
+#include "grammar-parser.h"
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+int main(void) {
+    // byte tokens (most of them invalid UTF-8 on their own), words that share prefixes and tokens that end in the middle
+    // of a UTF-8 sequence, the special tokens follow the text tokens
+    whisper_vocab vocab;
+
+    for (int i = 1; i < 256; ++i) {
+        vocab.id_to_token[i - 1] = std::string(1, (char) i);
+    }
+
+    for (const char * w : {
+        " ", "  ", " y", " ye", " yes", "yes", "es", " n", " no", "no", ".", "..", " .", " r", " re", " red", "ed",
+        " g", " green", "reen", " b", " blue", "lue", " caf", "caf\xc3\xa9", "\xc3\xa9", "\xc3\xa8", "\xc3", "\xa9",
+        " caf\xc3", "\xc3\xa9 ", " \xe4\xbd\xa0", "\xe4\xbd", "\xa0\xe5\xa5\xbd", " 1", "12", "3", "+", "-", "*", "/",
+        " (", ")", "(1", "+2", " x", "x", "\xf0\x9f\x99\x82", "\xf0\x9f", "\x99\x82",
+    }) {
+        const int id = vocab.id_to_token.size();
+        vocab.id_to_token[id] = w;
+    }
+
+    vocab.token_eot = vocab.id_to_token.size();
+    vocab.n_vocab   = vocab.token_eot + 1;
+
+    whisper_grammar_trie trie;
+    whisper_grammar_trie_build(trie, vocab);
+
+    // grammar and texts that it accepts - the rejects are compared after every prefix of the texts
+    const std::vector<std::pair<std::string, std::vector<std::string>>> cases = {
+        {
+            R"(root ::= " " ("yes" | "no") ".")",
+            { " yes.", " no." },
+        },
+        {
+            R"(root ::= (" red" | " green" | " blue")+ "."?)",
+            { " red green blue.", " blue blue" },
+        },
+        {
+            "root  ::= expr\n"
+            "expr  ::= term ([-+*/] term)*\n"
+            "term  ::= num | \"(\" space expr \")\" space\n"
+            "num   ::= [0-9]+ space\n"
+            "space ::= [ \\t\\n]*\n",
+            { "12+3", "(1 +2)*3 ", "((1))" },
+        },
+        {
+            "root ::= \" caf\" [\xc3\xa9\xc3\xa8] \" \" [^x]* \"x\"",
+            { " caf\xc3\xa9 \xe4\xbd\xa0\xe5\xa5\xbd\xf0\x9f\x99\x82x", " caf\xc3\xa8 x" },
+        },
+        {
+            R"(root ::= [^.]* ".")",
+            { "anything goes.", "." },
+        },
+    };
+
+    int n_states = 0;
+
+    for (const auto & c : cases) {
+        const auto parsed = grammar_parser::parse(c.first.c_str());
+        assert(!parsed.rules.empty());
+
+        auto rules = parsed.c_rules();
+
+        const whisper_grammar grammar_init = whisper_grammar_init(rules.data(), rules.size(), parsed.symbol_ids.at("root"));
+
+        for (const auto & text : c.second) {
+            whisper_grammar grammar = grammar_init;
+
+            auto decoded = decode_utf8(text.c_str(), { 0, 0 });
+            decoded.first.pop_back();
+
+            for (size_t i = 0; i <= decoded.first.size(); ++i) {
+                assert(whisper_grammar_trie_reject_tokens(trie, grammar) == whisper_grammar_reject_tokens(vocab, grammar));
+
+                n_states++;
+
+                if (i < decoded.first.size()) {
+                    grammar.stacks = whisper_grammar_accept(*grammar.rules, grammar.stacks, decoded.first[i]);
+                    assert(!grammar.stacks.empty());
+                }
+            }
+        }
+    }
+
+    printf("%s: %d grammar states\n", __func__, n_states);
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+// small randomly initialized models, written to memory in the legacy ggml format
+// load them with whisper_init_from_buffer_with_params_no_state()
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+struct test_model_writer {
+    std::vector<char> buf;
+    std::mt19937 rng;
+
+    explicit test_model_writer(uint32_t seed) : rng(seed) {}
+
+    template <typename T>
+    void write(const T & v) {
+        const char * p = (const char *) &v;
+        buf.insert(buf.end(), p, p + sizeof(v));
+    }
+
+    void write_bytes(const void * data, size_t size) {
+        buf.insert(buf.end(), (const char *) data, (const char *) data + size);
+    }
+
+    // f16 for the 2D weights (ftype == 1), f32 for everything else
+    void tensor(const std::string & name, std::vector<int32_t> ne, bool f16) {
+        write((int32_t) ne.size());
+        write((int32_t) name.size());
+        write((int32_t) (f16 ? 1 : 0));
+        for (int32_t n : ne) {
+            write(n);
+        }
+        write_bytes(name.data(), name.size());
+
+        std::normal_distribution<float> dist(0.0f, 0.1f);
+
+        size_t n = 1;
+        for (int32_t d : ne) {
+            n *= d;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            const float v = dist(rng);
+            if (f16) {
+                write(whisper_test_fp32_to_fp16(v));
+            } else {
+                write(v);
+            }
+        }
+    }
+
+    static uint16_t whisper_test_fp32_to_fp16(float f) {
+        // round to nearest even, the values are small so no special cases are needed
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+
+        const uint32_t sign = (x >> 16) & 0x8000;
+        const int32_t  exp  = (int32_t) ((x >> 23) & 0xff) - 127 + 15;
+
+        uint32_t mant = x & 0x7fffff;
+
+        if (exp <= 0) {
+            return (uint16_t) sign;
+        }
+
+        uint32_t h = sign | (exp << 10) | (mant >> 13);
+        if ((mant & 0x1fff) > 0x1000 || ((mant & 0x1fff) == 0x1000 && (h & 1))) {
+            h++;
+        }
+
+        return (uint16_t) h;
+    }
+};
+
+// seed - the seed of the random weights, the models with the same seed and hyperparameters are identical
+static std::vector<char> test_model(int n_vocab, int n_audio_ctx, int n_text_ctx, int n_state, int n_head, int n_layer, int n_mels, uint32_t seed = 1) {
+    test_model_writer w(seed);
+
+    w.write((uint32_t) 0x67676d6c);
+
+    for (int32_t v : { n_vocab, n_audio_ctx, n_state, n_head, n_layer, n_text_ctx, n_state, n_head, n_layer, n_mels, 1 }) {
+        w.write(v);
+    }
+
+    // mel filters
+    {
+        const int32_t n_fft = 201;
+
+        w.write((int32_t) n_mels);
+        w.write(n_fft);
+        for (int i = 0; i < n_mels*n_fft; ++i) {
+            w.write(0.001f*(i % 10));
+        }
+    }
+
+    // vocab - the single bytes, the rest is filled by the loader
+    {
+        w.write((int32_t) 256);
+        for (int i = 0; i < 256; ++i) {
+            const uint8_t c = i;
+            w.write((uint32_t) 1);
+            w.write(c);
+        }
+    }
+
+    const int S = n_state;
+
+    w.tensor("encoder.positional_embedding", { S, n_audio_ctx }, false);
+    w.tensor("encoder.conv1.weight", { 3, n_mels, S }, true);
+    w.tensor("encoder.conv1.bias",   { 1, S }, false);
+    w.tensor("encoder.conv2.weight", { 3, S, S }, true);
+    w.tensor("encoder.conv2.bias",   { 1, S }, false);
+    w.tensor("encoder.ln_post.weight", { S }, false);
+    w.tensor("encoder.ln_post.bias",   { S }, false);
+
+    auto block = [&](const std::string & p) {
+        w.tensor(p + "mlp_ln.weight", { S }, false);
+        w.tensor(p + "mlp_ln.bias",   { S }, false);
+        w.tensor(p + "mlp.0.weight", { S, 4*S }, true);
+        w.tensor(p + "mlp.0.bias",   { 4*S }, false);
+        w.tensor(p + "mlp.2.weight", { 4*S, S }, true);
+        w.tensor(p + "mlp.2.bias",   { S }, false);
+    };
+
+    auto attn = [&](const std::string & p) {
+        w.tensor(p + "_ln.weight", { S }, false);
+        w.tensor(p + "_ln.bias",   { S }, false);
+        w.tensor(p + ".query.weight", { S, S }, true);
+        w.tensor(p + ".query.bias",   { S }, false);
+        w.tensor(p + ".key.weight",   { S, S }, true);
+        w.tensor(p + ".value.weight", { S, S }, true);
+        w.tensor(p + ".value.bias",   { S }, false);
+        w.tensor(p + ".out.weight",   { S, S }, true);
+        w.tensor(p + ".out.bias",     { S }, false);
+    };
+
+    for (int i = 0; i < n_layer; ++i) {
+        block("encoder.blocks." + std::to_string(i) + ".");
+        attn ("encoder.blocks." + std::to_string(i) + ".attn");
+    }
+
+    w.tensor("decoder.positional_embedding",   { S, n_text_ctx }, false);
+    w.tensor("decoder.token_embedding.weight", { S, n_vocab }, true);
+    w.tensor("decoder.ln.weight", { S }, false);
+    w.tensor("decoder.ln.bias",   { S }, false);
+
+    for (int i = 0; i < n_layer; ++i) {
+        block("decoder.blocks." + std::to_string(i) + ".");
+        attn ("decoder.blocks." + std::to_string(i) + ".attn");
+        attn ("decoder.blocks." + std::to_string(i) + ".cross_attn");
+    }
+
+    return w.buf;
+}
@@ -0,0 +1,119 @@
+// check that speculative decoding gives the same tokens and timestamps as plain greedy decoding at temperature 0
+// a draft identical to the model is accepted up to draft_n_max tokens until the end of each window, a draft with other
+// weights is rejected at the first token
+
+#include "whisper.h"
+
+#include "test-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+struct test_token {
+    whisper_token id;
+    int64_t t0;
+    int64_t t1;
+
+    bool operator==(const test_token & other) const {
+        return id == other.id && t0 == other.t0 && t1 == other.t1;
+    }
+};
+
+// the tokens of all segments, each segment starts with a pseudo-token with the segment timestamps
+static std::vector<test_token> test_transcribe(whisper_context * ctx, whisper_context * draft_ctx, int draft_n_max, const std::vector<float> & pcm) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.n_threads        = 1;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.token_timestamps = true;
+    wparams.temperature_inc  = 0.0f;
+    wparams.draft_ctx        = draft_ctx;
+    wparams.draft_n_max      = draft_n_max;
+
+    whisper_reset_timings(ctx);
+
+    assert(whisper_full(ctx, wparams, pcm.data(), pcm.size()) == 0);
+
+    std::vector<test_token> res;
+
+    for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+        res.push_back({ -1, whisper_full_get_segment_t0(ctx, i), whisper_full_get_segment_t1(ctx, i) });
+
+        for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            const whisper_token_data data = whisper_full_get_token_data(ctx, i, j);
+
+            res.push_back({ data.id, data.t0, data.t1 });
+        }
+    }
+
+    return res;
+}
+
+int main(void) {
+    whisper_log_set([](enum ggml_log_level level, const char * text, void *) {
+        if (level == GGML_LOG_LEVEL_ERROR || level == GGML_LOG_LEVEL_WARN) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    std::vector<char> model       = test_model(51864, 64, 64, 64, 2, 3, 80, 1);
+    std::vector<char> model_other = test_model(51864, 64, 64, 64, 2, 3, 80, 2);
+
+    whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = false;
+
+    whisper_context * ctx         = whisper_init_from_buffer_with_params(model.data(),       model.size(),       cparams);
+    whisper_context * draft_same  = whisper_init_from_buffer_with_params(model.data(),       model.size(),       cparams);
+    whisper_context * draft_other = whisper_init_from_buffer_with_params(model_other.data(), model_other.size(), cparams);
+    assert(ctx != nullptr && draft_same != nullptr && draft_other != nullptr);
+
+    // 40 s of a tone, the model is random anyway - two windows or more
+    std::vector<float> pcm(40*WHISPER_SAMPLE_RATE);
+    for (size_t i = 0; i < pcm.size(); ++i) {
+        pcm[i] = 0.1f*sinf(2.0f*3.14159265f*440.0f*i/WHISPER_SAMPLE_RATE);
+    }
+
+    const auto ref = test_transcribe(ctx, nullptr, 0, pcm);
+    assert(ref.size() > 2);
+
+    struct test_case {
+        whisper_context * draft_ctx;
+        int draft_n_max;
+    };
+
+    for (const auto & c : std::vector<test_case>{
+        { draft_same,  8 },
+        { draft_same,  3 },
+        { draft_other, 8 },
+    }) {
+        const auto res = test_transcribe(ctx, c.draft_ctx, c.draft_n_max, pcm);
+
+        whisper_timings * timings = whisper_get_timings(ctx);
+
+        printf("%s: %s draft, draft_n_max = %d: %zu tokens, %d draft tokens, %d accepted\n", __func__,
+                c.draft_ctx == draft_same ? "same" : "other", c.draft_n_max, res.size(), timings->n_draft, timings->n_draft_accepted);
+
+        assert(res == ref);
+        assert(timings->n_draft > 0);
+
+        // the same model rejects only the draft tokens past the end of a window
+        if (c.draft_ctx == draft_same) {
+            assert(2*timings->n_draft_accepted > timings->n_draft);
+        } else {
+            assert(2*timings->n_draft_accepted < timings->n_draft);
+        }
+
+        delete timings;
+    }
+
+    whisper_free(draft_other);
+    whisper_free(draft_same);
+    whisper_free(ctx);
+
+    return 0;
+}
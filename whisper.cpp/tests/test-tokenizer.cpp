@@ -0,0 +1,74 @@
+// check that the trie tokenizer returns the same tokens as the original std::regex + std::map tokenizer
+
+#include "whisper-impl.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+int main(void) {
+    // byte tokens and a few words that share prefixes, so that the longest match is not always the first one
+    whisper_vocab vocab;
+
+    for (int i = 0; i < 256; ++i) {
+        vocab.token_to_id[std::string(1, (char) i)] = i;
+    }
+
+    for (const char * w : {
+        " t", " th", " the", " then", " there", "the", "he", "re", " qu", " quick", "ick", " brown", "own", " fox",
+        " jump", "s", " over", " lazy", " dog", "The", " It", "'s", "'t", "'re", "'ve", "'m", "'ll", "'d", " don",
+        " we", " they", " I", " you", " he", " 19", "84", " 3", "14", "159", ",", ".", "!", "?", " --", " (", ")",
+        "  ", "   ", " \n", "\n\n", "\t", " caf", "caf\xc3\xa9", "\xc3\xa9", " na", "\xc3\xaf", "ve",
+        " \xe4\xbd\xa0", "\xe5\xa5\xbd", " \xd0\xbf\xd1\x80\xd0\xb8", "\xd0\xb2\xd0\xb5\xd1\x82", " \xf0\x9f\x99",
+        "'S", "''", " Mr", " e", "-", "mail", " x", "86", "_", "64", " #", "hash", "tag", " @", "user",
+    }) {
+        const int id = vocab.token_to_id.size();
+        vocab.token_to_id[w] = id;
+    }
+
+    whisper_vocab_trie_build(vocab.trie, vocab.token_to_id);
+
+    // contractions, numbers, punctuation, whitespace runs and non-ASCII text
+    const std::vector<std::string> parts = {
+        " the", " then", " there", " quick", " brown", " fox", " jumps", " over", " lazy", " dog", "The", " It's",
+        " we're", " they've", " I'm", " you'll", " he'd", " don't", " 'quoted'", " 1984", " 3.14159", " 2,048", ",",
+        ".", "!", "?", " --", " (a)", "  ", "   ", "\t", "\n", " \n ", " caf\xc3\xa9", " na\xc3\xafve",
+        " \xe4\xbd\xa0\xe5\xa5\xbd", " \xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82", " \xf0\x9f\x99\x82", "'S",
+        "''", " Mr.", " e-mail", " x86_64", " #hashtag", " @user", "'", "'x", "'l", " ", "a",
+    };
+
+    std::vector<std::string> texts = { "", " ", "  ", "'", "'s", "'re", "'ll", " the", "the quick brown fox" };
+
+    for (const auto & part : parts) {
+        texts.push_back(part);
+    }
+
+    // every pair of parts, to cover the word boundaries
+    for (const auto & a : parts) {
+        for (const auto & b : parts) {
+            texts.push_back(a + b);
+        }
+    }
+
+    std::mt19937 rng(1);
+
+    for (int i = 0; i < 100; ++i) {
+        std::string text;
+        while (text.size() < 256) {
+            text += parts[rng() % parts.size()];
+        }
+        texts.push_back(text);
+    }
+
+    for (const auto & text : texts) {
+        assert(tokenize(vocab, text) == tokenize_regex(vocab, text));
+    }
+
+    printf("%s: %zu texts\n", __func__, texts.size());
+
+    return 0;
+}